@@ -30,10 +30,16 @@ struct arguments {
     bool force;
     bool packonly;
     bool compress;
+    bool verbose;
+    bool optimizemeshes;
     char *privatekey;
     char *signature;
     char *indent;
     char *paatype;
+    char *indexcache;
+    char *jobs;
+    char *cachedir;
+    char *pch;
     int num_mutedwarnings;
     char **mutedwarnings;
     int num_includefolders;
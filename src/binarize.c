@@ -34,6 +34,7 @@
 #include "args.h"
 #include "filesystem.h"
 #include "utils.h"
+#include "cache.h"
 #include "rapify.h"
 #include "p3d.h"
 #include "binarize.h"
@@ -81,6 +82,63 @@ char *find_root(char *source) {
 }
 
 
+static uint32_t dependency_hash(char *name) {
+    char lower[2048];
+
+    strncpy(lower, name, sizeof(lower) - 1);
+    lower[sizeof(lower) - 1] = 0;
+    lower_case(lower);
+
+    return hash_string(lower, strlen(lower));
+}
+
+
+static char **add_bis_dependency(char **dependencies, uint32_t *num_dependencies, uint32_t *size_dependencies, char *name) {
+    /*
+     * Adds the given file to the dependency set unless it is already in
+     * there. The set is an open addressing table keyed case-insensitively,
+     * empty slots are NULL. Returns the (possibly reallocated) table.
+     */
+
+    char **old_dependencies;
+    uint32_t old_size;
+    uint32_t i;
+    uint32_t j;
+
+    if ((*num_dependencies + 1) * 4 > *size_dependencies * 3) {
+        old_dependencies = dependencies;
+        old_size = *size_dependencies;
+
+        *size_dependencies = (old_size == 0) ? 64 : old_size * 2;
+        dependencies = (char **)safe_malloc(sizeof(char *) * *size_dependencies);
+        memset(dependencies, 0, sizeof(char *) * *size_dependencies);
+
+        for (i = 0; i < old_size; i++) {
+            if (old_dependencies[i] == NULL)
+                continue;
+            j = dependency_hash(old_dependencies[i]) & (*size_dependencies - 1);
+            while (dependencies[j] != NULL)
+                j = (j + 1) & (*size_dependencies - 1);
+            dependencies[j] = old_dependencies[i];
+        }
+
+        free(old_dependencies);
+    }
+
+    i = dependency_hash(name) & (*size_dependencies - 1);
+    while (dependencies[i] != NULL) {
+        if (stricmp(name, dependencies[i]) == 0)
+            return dependencies;
+        i = (i + 1) & (*size_dependencies - 1);
+    }
+
+    dependencies[i] = safe_strdup(name);
+    (*num_dependencies)++;
+
+    return dependencies;
+}
+
+
 int attempt_bis_binarize(char *source, char *target) {
     /*
      * Attempts to find and use the BI binarize.exe for binarization. If the
@@ -88,7 +146,7 @@ int attempt_bis_binarize(char *source, char *target) {
      * success and a positive integer on failure.
      */
 
-    extern char *current_target;
+    extern __thread char *current_target;
     SECURITY_ATTRIBUTES secattr = { sizeof(secattr) };
     STARTUPINFO info = { sizeof(info) };
     PROCESS_INFORMATION processInfo;
@@ -97,16 +155,16 @@ int attempt_bis_binarize(char *source, char *target) {
     int32_t num_lods;
     int i;
     int j;
-    int k;
     bool is_rtm;
     char command[2048];
     char temp[2048];
     char tempfolder[2048];
     char target_tempfolder[2048];
     char filename[2048];
-    char *dependencies[MAXTEXTURES];
+    char **dependencies;
+    uint32_t num_dependencies;
+    uint32_t size_dependencies;
     char *root;
-    FILE *f_source;
     struct mlod_lod *mlod_lods;
 
     current_target = source;
@@ -137,66 +195,31 @@ int attempt_bis_binarize(char *source, char *target) {
 
     // Read P3D and create a list of required files
     if (!is_rtm) {
-        f_source = fopen(source, "rb");
-        if (!f_source) {
+        num_lods = read_mlod(source, &mlod_lods);
+        if (num_lods == -1) {
             printf("Failed to open %s.\n", source);
             return 1;
         }
-
-        fseek(f_source, 8, SEEK_SET);
-        fread(&num_lods, 4, 1, f_source);
-        mlod_lods = (struct mlod_lod *)safe_malloc(sizeof(struct mlod_lod) * num_lods);
-        num_lods = read_lods(f_source, mlod_lods, num_lods);
-        fflush(stdout);
         if (num_lods < 0) {
             printf("Source file seems to be invalid P3D.\n");
             return 2;
         }
 
-        fclose(f_source);
-
-        memset(dependencies, 0, sizeof(dependencies));
+        dependencies = NULL;
+        num_dependencies = 0;
+        size_dependencies = 0;
         for (i = 0; i < num_lods; i++) {
             for (j = 0; j < mlod_lods[i].num_faces; j++) {
-                if (strlen(mlod_lods[i].faces[j].texture_name) > 0 && mlod_lods[i].faces[j].texture_name[0] != '#') {
-                    for (k = 0; k < MAXTEXTURES; k++) {
-                        if (dependencies[k] == 0)
-                            break;
-                        if (stricmp(mlod_lods[i].faces[j].texture_name, dependencies[k]) == 0)
-                            break;
-                    }
-                    if (k < MAXTEXTURES && dependencies[k] == 0) {
-                        dependencies[k] = (char *)safe_malloc(2048);
-                        strcpy(dependencies[k], mlod_lods[i].faces[j].texture_name);
-                    }
-                }
-                if (strlen(mlod_lods[i].faces[j].material_name) > 0 && mlod_lods[i].faces[j].material_name[0] != '#') {
-                    for (k = 0; k < MAXTEXTURES; k++) {
-                        if (dependencies[k] == 0)
-                            break;
-                        if (stricmp(mlod_lods[i].faces[j].material_name, dependencies[k]) == 0)
-                            break;
-                    }
-                    if (k < MAXTEXTURES && dependencies[k] == 0) {
-                        dependencies[k] = (char *)safe_malloc(2048);
-                        strcpy(dependencies[k], mlod_lods[i].faces[j].material_name);
-                    }
-                }
+                if (strlen(mlod_lods[i].faces[j].texture_name) > 0 && mlod_lods[i].faces[j].texture_name[0] != '#')
+                    dependencies = add_bis_dependency(dependencies, &num_dependencies, &size_dependencies,
+                        mlod_lods[i].faces[j].texture_name);
+                if (strlen(mlod_lods[i].faces[j].material_name) > 0 && mlod_lods[i].faces[j].material_name[0] != '#')
+                    dependencies = add_bis_dependency(dependencies, &num_dependencies, &size_dependencies,
+                        mlod_lods[i].faces[j].material_name);
             }
-
-            free(mlod_lods[i].points);
-            free(mlod_lods[i].facenormals);
-            free(mlod_lods[i].faces);
-            free(mlod_lods[i].mass);
-            free(mlod_lods[i].sharp_edges);
-
-            for (j = 0; j < mlod_lods[i].num_selections; j++) {
-                free(mlod_lods[i].selections[j].points);
-                free(mlod_lods[i].selections[j].faces);
-            }
-
-            free(mlod_lods[i].selections);
         }
+
+        free_lods(mlod_lods, num_lods);
         free(mlod_lods);
     }
 
@@ -250,9 +273,9 @@ int attempt_bis_binarize(char *source, char *target) {
     free(root);
 
     if (!is_rtm) {
-        for (i = 0; i < MAXTEXTURES; i++) {
-            if (dependencies[i] == 0)
-                break;
+        for (i = 0; i < size_dependencies; i++) {
+            if (dependencies[i] == NULL)
+                continue;
 
             *filename = 0;
             if (dependencies[i][0] != '\\')
@@ -275,6 +298,8 @@ int attempt_bis_binarize(char *source, char *target) {
 
             free(dependencies[i]);
         }
+
+        free(dependencies);
     }
 
     // Call binarize.exe
@@ -366,7 +391,7 @@ int binarize(char *source, char *target) {
     if (!strcmp(fileext, ".cpp") ||
             !strcmp(fileext, ".rvmat") ||
             !strcmp(fileext, ".ext"))
-        return rapify_file(source, target);
+        return cache_binarize(source, target, rapify_file);
 
     if (!strcmp(fileext, ".p3d") ||
             !strcmp(fileext, ".rtm")) {
@@ -380,7 +405,7 @@ int binarize(char *source, char *target) {
         }
 #endif
         if (!strcmp(fileext, ".p3d"))
-            return mlod2odol(source, target);
+            return cache_binarize(source, target, mlod2odol);
     }
 
     return -1;
@@ -22,6 +22,7 @@
 #include <stdint.h>
 #include <string.h>
 #include <unistd.h>
+#include <sys/stat.h>
 
 #ifdef _WIN32
 #include <windows.h>
@@ -30,7 +31,9 @@
 #include "sha1.h"
 #include "args.h"
 #include "binarize.h"
+#include "cache.h"
 #include "filesystem.h"
+#include "jobs.h"
 #include "utils.h"
 #include "sign.h"
 #include "build.h"
@@ -52,9 +55,50 @@ bool file_allowed(char *filename) {
 }
 
 
-int binarize_callback(char *root, char *source, char *junk) {
-    int success;
-    char target[2048];
+struct pbo_entry {
+    char *name; // path inside the addon folder
+    char *path; // file the data is read from
+    char *binarized;
+    long size;
+};
+
+struct pbo_entries {
+    int num_entries;
+    struct pbo_entry *entries;
+    struct pbo_entry **jobs;
+    char *tempfolder;
+};
+
+
+void add_entry(struct pbo_entries *entries, char *name, char *path) {
+    struct pbo_entry *entry;
+
+    entries->entries = (struct pbo_entry *)safe_realloc(entries->entries,
+        sizeof(struct pbo_entry) * (entries->num_entries + 1));
+
+    entry = &entries->entries[entries->num_entries++];
+    entry->name = safe_strdup(name);
+    entry->path = safe_strdup(path);
+    entry->binarized = NULL;
+    entry->size = 0;
+}
+
+
+void free_entries(struct pbo_entries *entries) {
+    int i;
+
+    for (i = 0; i < entries->num_entries; i++) {
+        free(entries->entries[i].name);
+        free(entries->entries[i].path);
+        free(entries->entries[i].binarized);
+    }
+
+    free(entries->entries);
+    free(entries->jobs);
+}
+
+
+int collect_callback(char *root, char *source, char *entries) {
     char filename[1024];
 
     filename[0] = 0;
@@ -63,36 +107,192 @@ int binarize_callback(char *root, char *source, char *junk) {
     if (!file_allowed(filename))
         return 0;
 
-    strncpy(target, source, sizeof(target));
+    add_entry((struct pbo_entries *)entries, filename, source);
+
+    return 0;
+}
+
+
+int compare_entries(const void *a, const void *b) {
+    /*
+     * Sorts entries the same way traverse_directory would visit them:
+     * case-insensitive, folder by folder.
+     */
+
+    char name_a[1024];
+    char name_b[1024];
+    char *ptr_a;
+    char *ptr_b;
+    char *end_a;
+    char *end_b;
+    int i;
+    int result;
+
+    strncpy(name_a, ((struct pbo_entry *)a)->name, sizeof(name_a));
+    strncpy(name_b, ((struct pbo_entry *)b)->name, sizeof(name_b));
+
+    for (i = 0; i < strlen(name_a); i++) {
+        if (name_a[i] >= 'A' && name_a[i] <= 'Z')
+            name_a[i] = name_a[i] - ('A' - 'a');
+    }
+
+    for (i = 0; i < strlen(name_b); i++) {
+        if (name_b[i] >= 'A' && name_b[i] <= 'Z')
+            name_b[i] = name_b[i] - ('A' - 'a');
+    }
+
+    ptr_a = name_a;
+    ptr_b = name_b;
+    while (true) {
+        end_a = strchr(ptr_a, PATHSEP);
+        end_b = strchr(ptr_b, PATHSEP);
+        if (end_a != NULL)
+            *end_a = 0;
+        if (end_b != NULL)
+            *end_b = 0;
+
+        result = strcoll(ptr_a, ptr_b);
+        if (result != 0 || end_a == NULL || end_b == NULL)
+            return result;
+
+        ptr_a = end_a + 1;
+        ptr_b = end_b + 1;
+    }
+}
+
+
+int compare_jobs(const void *a, const void *b) {
+    // biggest files first, so we don't end up waiting for a single big model
+    long size_a = (*(struct pbo_entry **)a)->size;
+    long size_b = (*(struct pbo_entry **)b)->size;
+
+    return (size_a < size_b) - (size_a > size_b);
+}
+
+
+int binarize_job(int job, void *entries_ptr) {
+    struct pbo_entries *entries = (struct pbo_entries *)entries_ptr;
+    struct pbo_entry *entry = entries->jobs[job];
+    int success;
+    char target[2048];
+
+    snprintf(target, sizeof(target), "%s%s", entries->tempfolder, entry->name);
 
     if (strlen(target) > 10 &&
             strcmp(target + strlen(target) - 10, "config.cpp") == 0) {
         strcpy(target + strlen(target) - 3, "bin");
     }
 
-    success = binarize(source, target);
+    *strrchr(target, PATHSEP) = 0;
+    if (create_folders(target))
+        return 1;
+    target[strlen(target)] = PATHSEP;
+
+    success = binarize(entry->path, target);
 
     if (success > 0)
-        return success * -1;
+        return success;
+
+    // file was binarized, otherwise it's packed as it is
+    if (success == 0)
+        entry->binarized = safe_strdup(target);
 
     return 0;
 }
 
 
-int write_header_to_pbo(char *root, char *source, char *target) {
-    FILE *f_source;
+int binarize_entries(struct pbo_entries *entries, char *tempfolder) {
+    /*
+     * Binarizes all entries into the given temp folder, spreading them
+     * across multiple threads. Afterwards, the entries point to the
+     * binarized files instead of the sources. Sources are never modified.
+     *
+     * Returns 0 on success and a positive integer on failure.
+     */
+
+    struct pbo_entry *entry;
+    struct stat st;
+    int num_entries;
+    int success;
+    int i;
+    int j;
+
+    num_entries = entries->num_entries;
+    entries->tempfolder = tempfolder;
+    entries->jobs = (struct pbo_entry **)safe_malloc(sizeof(struct pbo_entry *) * num_entries);
+
+    for (i = 0; i < num_entries; i++) {
+        entry = &entries->entries[i];
+        entry->size = (stat(entry->path, &st) == 0) ? st.st_size : 0;
+        entries->jobs[i] = entry;
+    }
+
+    qsort(entries->jobs, num_entries, sizeof(struct pbo_entry *), compare_jobs);
+    success = run_jobs(num_entries, binarize_job, entries);
+    if (success)
+        return success;
+
+    for (i = 0; i < num_entries; i++) {
+        entry = &entries->entries[i];
+        if (entry->binarized == NULL)
+            continue;
+
+        // binarized under the same name, just swap the source
+        if (strcmp(entry->name, entry->binarized + strlen(tempfolder)) == 0) {
+            free(entry->path);
+            entry->path = entry->binarized;
+            entry->binarized = NULL;
+            continue;
+        }
+
+        // config.cpp -> config.bin, replacing any existing config.bin
+        for (j = 0; j < entries->num_entries; j++) {
+            if (strcmp(entries->entries[j].name, entry->binarized + strlen(tempfolder)) == 0)
+                break;
+        }
+
+        if (j < entries->num_entries) {
+            free(entries->entries[j].path);
+            entries->entries[j].path = safe_strdup(entry->binarized);
+        } else {
+            add_entry(entries, entry->binarized + strlen(tempfolder), entry->binarized);
+        }
+    }
+
+    return 0;
+}
+
+
+struct pbo_writer {
     FILE *f_target;
-    char filename[1024];
+    SHA1Context sha;
+    char *buffer;
+};
 
-    filename[0] = 0;
-    strcat(filename, source + strlen(root) + 1);
 
-    if (!file_allowed(filename))
+int pbo_write(struct pbo_writer *writer, void *data, size_t size) {
+    /*
+     * Writes data to the PBO, adding it to the checksum at the same time.
+     * Returns 0 on success and a positive integer on failure.
+     */
+
+    if (size == 0)
         return 0;
 
-    f_target = fopen(target, "ab");
-    if (!f_target)
-        return -1;
+    if (fwrite(data, size, 1, writer->f_target) != 1)
+        return 1;
+
+    SHA1Input(&writer->sha, (const unsigned char *)data, size);
+
+    return 0;
+}
+
+
+int write_header_to_pbo(struct pbo_writer *writer, struct pbo_entry *entry) {
+    char filename[1024];
+
+    filename[0] = 0;
+    strcat(filename, entry->name);
 
     struct {
         uint32_t method;
@@ -102,19 +302,10 @@ int write_header_to_pbo(char *root, char *source, char *target) {
         uint32_t datasize;
     } header;
     header.method = 0;
+    header.originalsize = entry->size;
     header.reserved = 0;
     header.timestamp = 0;
-
-    f_source = fopen(source, "rb");
-    if (!f_source) {
-        fclose(f_target);
-        return -2;
-    }
-
-    fseek(f_source, 0, SEEK_END);
-    header.datasize = ftell(f_source);
-    header.originalsize = header.datasize;
-    fclose(f_source);
+    header.datasize = entry->size;
 
     // replace pathseps on linux
 #ifndef _WIN32
@@ -129,103 +320,71 @@ int write_header_to_pbo(char *root, char *source, char *target) {
     if (strlen(filename) > 5 && !strcmp(filename + strlen(filename) - 5, ".p3do"))
         filename[strlen(filename) - 1] = 0;
 
-    fwrite(filename, strlen(filename), 1, f_target);
-    fputc(0, f_target);
-
-    fwrite(&header, sizeof(header), 1, f_target);
-    fclose(f_target);
+    if (pbo_write(writer, filename, strlen(filename) + 1))
+        return 1;
 
-    return 0;
+    return pbo_write(writer, &header, sizeof(header));
 }
 
 
-int write_data_to_pbo(char *root, char *source, char *target) {
+int write_data_to_pbo(struct pbo_writer *writer, struct pbo_entry *entry) {
     FILE *f_source;
-    FILE *f_target;
-    char buffer[4096];
-    char filename[1024];
-    int datasize;
-    int i;
+    long datasize;
+    long i;
+    size_t size;
 
-    filename[0] = 0;
-    strcat(filename, source + strlen(root) + 1);
-
-    if (!file_allowed(filename))
-        return 0;
-
-    f_source = fopen(source, "rb");
+    f_source = fopen(entry->path, "rb");
     if (!f_source)
-        return -1;
-    fseek(f_source, 0, SEEK_END);
-    datasize = ftell(f_source);
+        return 1;
 
-    f_target = fopen(target, "ab");
-    if (!f_target) {
-        fclose(f_source);
-        return -2;
-    }
+    for (i = 0; i < entry->size; i += size) {
+        datasize = entry->size - i;
+        size = fread(writer->buffer, 1, MIN(datasize, PBOBUFFERSIZE), f_source);
 
-    fseek(f_source, 0, SEEK_SET);
-    for (i = 0; datasize - i >= sizeof(buffer); i += sizeof(buffer)) {
-        fread(buffer, sizeof(buffer), 1, f_source);
-        fwrite(buffer, sizeof(buffer), 1, f_target);
+        // file changed since the header was written
+        if (size == 0 || pbo_write(writer, writer->buffer, size)) {
+            fclose(f_source);
+            return 2;
+        }
     }
-    fread(buffer, datasize - i, 1, f_source);
-    fwrite(buffer, datasize - i, 1, f_target);
 
     fclose(f_source);
-    fclose(f_target);
 
     return 0;
 }
 
 
-int hash_file(char *path, unsigned char *hash) {
-    SHA1Context sha;
-    FILE *file;
-    int filesize, i;
-    unsigned temp;
-    char buffer[4096];
-
-    SHA1Reset(&sha);
-
-    file = fopen(path, "rb");
-    if (!file)
-        return -1;
-
-    fseek(file, 0, SEEK_END);
-    filesize = ftell(file);
-    fseek(file, 0, SEEK_SET);
+int write_checksum_to_pbo(struct pbo_writer *writer) {
+    /*
+     * Appends the SHA1 of everything written so far to the PBO.
+     */
 
-    for (i = 0; filesize - i >= sizeof(buffer); i += sizeof(buffer)) {
-        fread(buffer, sizeof(buffer), 1, file);
-        SHA1Input(&sha, (const unsigned char *)buffer, sizeof(buffer));
-    }
-    fread(buffer, filesize - i, 1, file);
-    SHA1Input(&sha, (const unsigned char *)buffer, filesize - i);
-
-    fclose(file);
+    unsigned temp;
+    int i;
 
-    if (!SHA1Result(&sha))
-        return -2;
+    if (!SHA1Result(&writer->sha))
+        return 1;
 
     for (i = 0; i < 5; i++) {
-        temp = sha.Message_Digest[i];
-        sha.Message_Digest[i] = ((temp>>24)&0xff) |
+        temp = writer->sha.Message_Digest[i];
+        writer->sha.Message_Digest[i] = ((temp>>24)&0xff) |
             ((temp<<8)&0xff0000) | ((temp>>8)&0xff00) | ((temp<<24)&0xff000000);
     }
 
-    memcpy(hash, sha.Message_Digest, 20);
+    fputc(0, writer->f_target);
+    if (fwrite(writer->sha.Message_Digest, 20, 1, writer->f_target) != 1)
+        return 2;
 
     return 0;
 }
 
 
 int cmd_build() {
-    extern char *current_target;
+    extern __thread char *current_target;
     int i;
     int j;
     int k;
+    int success;
     char buffer[512];
     bool valid = false;
 
@@ -318,17 +477,24 @@ int cmd_build() {
     strcat(addonprefix, tmp);
 #endif
 
-    // create and prepare temp folder
+    // create temp folder for binarized files
     char tempfolder[1024];
     if (create_temp_folder(addonprefix, tempfolder, sizeof(tempfolder))) {
         errorf("Failed to create temp folder.\n");
         remove_file(args.positionals[2]);
         return 2;
     }
-    if (copy_directory(args.positionals[1], tempfolder)) {
-        errorf("Failed to copy to temp folder.\n");
+
+    // collect files, the source folder itself is never modified
+    struct pbo_entries entries;
+    entries.num_entries = 0;
+    entries.entries = NULL;
+    entries.jobs = NULL;
+    if (traverse_directory(args.positionals[1], collect_callback, (char *)&entries)) {
+        errorf("Failed to read source folder.\n");
         remove_file(args.positionals[2]);
         remove_folder(tempfolder);
+        free_entries(&entries);
         return 3;
     }
 
@@ -340,44 +506,70 @@ int cmd_build() {
     strcpy(nobinpath + strlen(nobinpath) - 11, "$NOBIN$");
     strcpy(notestpath + strlen(notestpath) - 11, "$NOBIN-NOTEST$");
     if (!args.packonly && access(nobinpath, F_OK) == -1 && access(notestpath, F_OK) == -1) {
-        if (traverse_directory(tempfolder, binarize_callback, "")) {
+        if (binarize_entries(&entries, tempfolder)) {
             current_target = args.positionals[1];
             errorf("Failed to binarize some files.\n");
             remove_file(args.positionals[2]);
             remove_folder(tempfolder);
+            free_entries(&entries);
             return 4;
         }
 
-        char configpath[2048];
-        strcpy(configpath, tempfolder);
-        strcat(configpath, "?config.cpp");
-        configpath[strlen(tempfolder)] = PATHSEP;
+        print_cache_summary();
 
-        if (access(configpath, F_OK) != -1) {
-#ifdef _WIN32
-            if (!DeleteFile(configpath)) {
-#else
-            if (remove(configpath)) {
-#endif
-                remove_file(args.positionals[2]);
-                remove_folder(tempfolder);
-                return 5;
-            }
+        // the config.bin replaces the top-level config.cpp
+        for (i = 0; i < entries.num_entries; i++) {
+            if (strcmp(entries.entries[i].name, "config.cpp") == 0)
+                break;
+        }
+
+        if (i < entries.num_entries) {
+            free(entries.entries[i].name);
+            free(entries.entries[i].path);
+            free(entries.entries[i].binarized);
+            memmove(&entries.entries[i], &entries.entries[i + 1],
+                sizeof(struct pbo_entry) * (entries.num_entries - i - 1));
+            entries.num_entries--;
         }
     }
 
+    qsort(entries.entries, entries.num_entries, sizeof(struct pbo_entry), compare_entries);
+
     current_target = args.positionals[1];
 
+    // collect file sizes for the header
+    struct stat st;
+    for (i = 0; i < entries.num_entries; i++) {
+        if (stat(entries.entries[i].path, &st) != 0) {
+            errorf("Failed to read %s.\n", entries.entries[i].path);
+            remove_file(args.positionals[2]);
+            remove_folder(tempfolder);
+            free_entries(&entries);
+            return 7;
+        }
+        entries.entries[i].size = st.st_size;
+    }
+
+    struct pbo_writer writer;
+    writer.f_target = fopen(args.positionals[2], "wb");
+    if (!writer.f_target) {
+        errorf("Failed to open %s.\n", args.positionals[2]);
+        remove_file(args.positionals[2]);
+        remove_folder(tempfolder);
+        free_entries(&entries);
+        return 2;
+    }
+    writer.buffer = (char *)safe_malloc(PBOBUFFERSIZE);
+    SHA1Reset(&writer.sha);
+
     // write header extensions
-    f_target = fopen(args.positionals[2], "wb");
-    fwrite("\0sreV\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0prefix\0", 28, 1, f_target);
+    success = pbo_write(&writer, "\0sreV\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0prefix\0", 28);
     // write addonprefix with windows pathseps
     for (i = 0; i <= strlen(addonprefix); i++) {
         if (addonprefix[i] == PATHSEP)
-            fputc('\\', f_target);
-        else
-            fputc(addonprefix[i], f_target);
+            addonprefix[i] = '\\';
     }
+    success |= pbo_write(&writer, addonprefix, strlen(addonprefix) + 1);
     // write extra header extensions
     for (i = 0; i < args.num_headerextensions && args.headerextensions[i][0] != 0; i++) {
         k = 0;
@@ -391,14 +583,16 @@ int cmd_build() {
                 // validate
                 if (args.headerextensions[i][j] == '\0' && !valid) {
                     errorf("Invalid header extension format (%s).\n", args.headerextensions[i]);
+                    fclose(writer.f_target);
+                    free(writer.buffer);
                     remove_file(args.positionals[2]);
                     remove_folder(tempfolder);
+                    free_entries(&entries);
                     return 6;
                 }
 
                 // write
-                fputs(buffer, f_target);
-                fputc(0, f_target);
+                success |= pbo_write(&writer, buffer, strlen(buffer) + 1);
                 k = 0;
                 valid = true;
             } else {
@@ -407,50 +601,53 @@ int cmd_build() {
             }
         }
     }
-    fputc(0, f_target);
-    fclose(f_target);
+    success |= pbo_write(&writer, "\0", 1);
 
     // write headers to file
-    if (traverse_directory(tempfolder, write_header_to_pbo, args.positionals[2])) {
-        errorf("Failed to write some file header(s) to PBO.\n");
-        remove_file(args.positionals[2]);
-        remove_folder(tempfolder);
-        return 7;
-    }
+    for (i = 0; i < entries.num_entries && !success; i++)
+        success = write_header_to_pbo(&writer, &entries.entries[i]);
 
     // header boundary
-    f_target = fopen(args.positionals[2], "ab");
-    if (!f_target) {
-        errorf("Failed to write header boundary to PBO.\n");
+    memset(buffer, 0, 21);
+    success |= pbo_write(&writer, buffer, 21);
+
+    if (success) {
+        errorf("Failed to write some file header(s) to PBO.\n");
+        fclose(writer.f_target);
+        free(writer.buffer);
         remove_file(args.positionals[2]);
         remove_folder(tempfolder);
-        return 8;
+        free_entries(&entries);
+        return 7;
     }
-    for (i = 0; i < 21; i++)
-        fputc(0, f_target);
-    fclose(f_target);
 
     // write contents to file
-    if (traverse_directory(tempfolder, write_data_to_pbo, args.positionals[2])) {
-        errorf("Failed to pack some file(s) into the PBO.\n");
+    for (i = 0; i < entries.num_entries; i++) {
+        if (write_data_to_pbo(&writer, &entries.entries[i]))
+            break;
+    }
+    if (i < entries.num_entries) {
+        errorf("Failed to pack %s into the PBO.\n", entries.entries[i].path);
+        fclose(writer.f_target);
+        free(writer.buffer);
         remove_file(args.positionals[2]);
         remove_folder(tempfolder);
+        free_entries(&entries);
         return 9;
     }
 
     // write checksum to file
-    unsigned char checksum[20];
-    hash_file(args.positionals[2], checksum);
-    f_target = fopen(args.positionals[2], "ab");
-    if (!f_target) {
+    success = write_checksum_to_pbo(&writer);
+    free(writer.buffer);
+    if (fclose(writer.f_target) || success) {
         errorf("Failed to write checksum to file.\n");
         remove_file(args.positionals[2]);
         remove_folder(tempfolder);
+        free_entries(&entries);
         return 10;
     }
-    fputc(0, f_target);
-    fwrite(checksum, 20, 1, f_target);
-    fclose(f_target);
+
+    free_entries(&entries);
 
     // remove temp folder
     if (remove_folder(tempfolder)) {
@@ -19,4 +19,7 @@
 #pragma once
 
 
+#define PBOBUFFERSIZE (1024 * 1024)
+
+
 int cmd_build();
@@ -0,0 +1,444 @@
+/*
+ * Copyright (C)  2016  Felix "KoffeinFlummi" Wiegand
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#ifdef _WIN32
+#include <windows.h>
+#endif
+
+#include "sha1.h"
+#include "args.h"
+#include "filesystem.h"
+#include "utils.h"
+#include "cache.h"
+
+
+struct file_hash {
+    char *path;
+    char hash[41];
+};
+
+__thread struct dependencies *current_dependencies;
+
+pthread_mutex_t cache_lock = PTHREAD_MUTEX_INITIALIZER;
+struct file_hash *file_hashes;
+int num_file_hashes;
+int size_file_hashes;
+int cache_temp_id;
+int cache_hits;
+int cache_misses;
+
+
+void sha_to_hex(SHA1Context *sha, char *hex) {
+    int i;
+
+    SHA1Result(sha);
+
+    for (i = 0; i < 5; i++)
+        sprintf(hex + i * 8, "%08x", sha->Message_Digest[i]);
+}
+
+
+struct file_hash *find_file_hash(char *path) {
+    /*
+     * Returns the slot for the given path in the hash table. Needs to be
+     * called with the cache lock held.
+     */
+
+    uint32_t i;
+
+    i = hash_string(path, strlen(path)) & (size_file_hashes - 1);
+    while (file_hashes[i].path != NULL && strcmp(file_hashes[i].path, path) != 0)
+        i = (i + 1) & (size_file_hashes - 1);
+
+    return &file_hashes[i];
+}
+
+
+void add_file_hash(char *path, char *hash) {
+    struct file_hash *old_hashes;
+    struct file_hash *slot;
+    int old_size;
+    int i;
+
+    pthread_mutex_lock(&cache_lock);
+
+    if ((num_file_hashes + 1) * 4 > size_file_hashes * 3) {
+        old_hashes = file_hashes;
+        old_size = size_file_hashes;
+
+        size_file_hashes = (old_size == 0) ? 256 : old_size * 2;
+        file_hashes = (struct file_hash *)safe_malloc(sizeof(struct file_hash) * size_file_hashes);
+        for (i = 0; i < size_file_hashes; i++)
+            file_hashes[i].path = NULL;
+
+        for (i = 0; i < old_size; i++) {
+            if (old_hashes[i].path != NULL)
+                *find_file_hash(old_hashes[i].path) = old_hashes[i];
+        }
+        free(old_hashes);
+    }
+
+    slot = find_file_hash(path);
+    if (slot->path == NULL) {
+        slot->path = safe_strdup(path);
+        strcpy(slot->hash, hash);
+        num_file_hashes++;
+    }
+
+    pthread_mutex_unlock(&cache_lock);
+}
+
+
+void hash_file(char *path, char *hash) {
+    /*
+     * Writes the SHA1 of the given file as a hex string to hash. The hash of
+     * a missing file is all zeroes. Hashes are remembered for the rest of
+     * the run, since the same headers get included over and over again.
+     */
+
+    SHA1Context sha;
+    struct file_hash *slot;
+    FILE *f;
+    char buffer[4096];
+    size_t size;
+
+    pthread_mutex_lock(&cache_lock);
+    if (size_file_hashes > 0) {
+        slot = find_file_hash(path);
+        if (slot->path != NULL) {
+            strcpy(hash, slot->hash);
+            pthread_mutex_unlock(&cache_lock);
+            return;
+        }
+    }
+    pthread_mutex_unlock(&cache_lock);
+
+    f = fopen(path, "rb");
+    if (!f) {
+        memset(hash, '0', 40);
+        hash[40] = 0;
+    } else {
+        SHA1Reset(&sha);
+        while ((size = fread(buffer, 1, sizeof(buffer), f)) > 0)
+            SHA1Input(&sha, (const unsigned char *)buffer, size);
+        fclose(f);
+
+        sha_to_hex(&sha, hash);
+    }
+
+    add_file_hash(path, hash);
+}
+
+
+void add_dependency(char *path) {
+    /*
+     * Remembers that the file currently being binarized on this thread
+     * depends on the given file. Does nothing outside of cache_binarize.
+     */
+
+    struct dependencies *dependencies = current_dependencies;
+    int i;
+
+    if (dependencies == NULL)
+        return;
+
+    for (i = 0; i < dependencies->num_dependencies; i++) {
+        if (strcmp(dependencies->dependencies[i], path) == 0)
+            return;
+    }
+
+    dependencies->dependencies = (char **)safe_realloc(dependencies->dependencies,
+        sizeof(char *) * (dependencies->num_dependencies + 1));
+    dependencies->dependencies[dependencies->num_dependencies++] = safe_strdup(path);
+}
+
+
+struct dependencies *collect_dependencies(struct dependencies *dependencies) {
+    /*
+     * Starts collecting the dependencies of this thread in the given (empty)
+     * list, even outside of cache_binarize. Returns the previous list, which
+     * needs to be passed to restore_dependencies afterwards.
+     */
+
+    struct dependencies *previous = current_dependencies;
+
+    dependencies->num_dependencies = 0;
+    dependencies->dependencies = NULL;
+    current_dependencies = dependencies;
+
+    return previous;
+}
+
+
+void restore_dependencies(struct dependencies *previous) {
+    current_dependencies = previous;
+}
+
+
+void add_dependencies(struct dependencies *dependencies) {
+    /*
+     * Adds all dependencies in the given list to the current one. Used to
+     * replay what was read for something that is cached in memory.
+     */
+
+    int i;
+
+    for (i = 0; i < dependencies->num_dependencies; i++)
+        add_dependency(dependencies->dependencies[i]);
+}
+
+
+void free_dependencies(struct dependencies *dependencies) {
+    int i;
+
+    for (i = 0; i < dependencies->num_dependencies; i++)
+        free(dependencies->dependencies[i]);
+    free(dependencies->dependencies);
+
+    dependencies->num_dependencies = 0;
+    dependencies->dependencies = NULL;
+}
+
+
+int replace_file(char *source, char *target) {
+#ifdef _WIN32
+    return !MoveFileEx(source, target, MOVEFILE_REPLACE_EXISTING);
+#else
+    return rename(source, target);
+#endif
+}
+
+
+void get_cache_temp_name(char *path, char *temp, size_t bufsize) {
+    int id;
+
+    pthread_mutex_lock(&cache_lock);
+    id = cache_temp_id++;
+    pthread_mutex_unlock(&cache_lock);
+
+    snprintf(temp, bufsize, "%s.%i_%i.tmp", path, (int)getpid(), id);
+}
+
+
+int cache_store(char *source, char *target, char *source_key, struct dependencies *dependencies) {
+    /*
+     * Stores the binarized target in the cache, along with the manifest of
+     * everything it depends on.
+     *
+     * Returns 0 on success and a positive integer on failure.
+     */
+
+    extern struct arguments args;
+    SHA1Context sha;
+    FILE *f;
+    int i;
+    char hash[41];
+    char output_key[41];
+    char line[2048 + 64];
+    char manifest_path[2048];
+    char output_path[2048];
+    char temp_path[2048];
+
+    if (create_folders(args.cachedir))
+        return 1;
+
+    snprintf(manifest_path, sizeof(manifest_path), "%s%c%s%s", args.cachedir, PATHSEP, source_key, CACHEMANIFESTEXT);
+    get_cache_temp_name(manifest_path, temp_path, sizeof(temp_path));
+
+    f = fopen(temp_path, "wb");
+    if (!f)
+        return 2;
+
+    SHA1Reset(&sha);
+    SHA1Input(&sha, (const unsigned char *)source_key, 40);
+
+    for (i = 0; i < dependencies->num_dependencies; i++) {
+        if (strcmp(dependencies->dependencies[i], source) == 0)
+            continue;
+
+        hash_file(dependencies->dependencies[i], hash);
+        snprintf(line, sizeof(line), "%s %s", hash, dependencies->dependencies[i]);
+        SHA1Input(&sha, (const unsigned char *)line, strlen(line));
+
+        fputs(line, f);
+        fputc('\n', f);
+    }
+
+    if (fclose(f)) {
+        remove_file(temp_path);
+        return 3;
+    }
+
+    sha_to_hex(&sha, output_key);
+    snprintf(output_path, sizeof(output_path), "%s%c%s%s", args.cachedir, PATHSEP, output_key, CACHEOUTPUTEXT);
+
+    // output first, so a manifest never points to a missing output
+    get_cache_temp_name(output_path, line, sizeof(line));
+    if (copy_file(target, line) || replace_file(line, output_path)) {
+        remove_file(line);
+        remove_file(temp_path);
+        return 4;
+    }
+
+    if (replace_file(temp_path, manifest_path)) {
+        remove_file(temp_path);
+        return 5;
+    }
+
+    return 0;
+}
+
+
+int cache_binarize(char *source, char *target, int (*binarizer)(char *, char *)) {
+    /*
+     * Binarizes source into target using the given binarizer, unless the
+     * same file was binarized before with the same dependencies (includes,
+     * model.cfg, materials), in which case the result is copied from the
+     * folder given with --cache-dir.
+     *
+     * For every source, the cache holds a manifest of the files read while
+     * binarizing it, along with their hashes. The output itself is stored
+     * under a hash of the source and all of those dependencies.
+     *
+     * Returns the same as the binarizer.
+     */
+
+    extern struct arguments args;
+    struct dependencies dependencies;
+    SHA1Context sha;
+    FILE *f;
+    bool valid;
+    int success;
+    int i;
+#ifdef _WIN32
+    DWORD length;
+#endif
+    char *path;
+    char hash[41];
+    char source_key[41];
+    char output_key[41];
+    char line[2048 + 64];
+    char manifest_path[2048];
+    char output_path[2048];
+
+    if (args.cachedir == NULL || strcmp(target, "-") == 0)
+        return binarizer(source, target);
+
+    // relative includes, model.cfg and materials are found next to the source, so the full path
+    // is part of the key, and absolute includes depend on the include folders
+#ifdef _WIN32
+    path = (char *)safe_malloc(2048);
+    length = GetFullPathName(source, 2048, path, NULL);
+    if (length == 0 || length >= 2048) {
+        free(path);
+        return binarizer(source, target);
+    }
+#else
+    path = realpath(source, NULL);
+    if (path == NULL)
+        return binarizer(source, target);
+#endif
+
+    SHA1Reset(&sha);
+    SHA1Input(&sha, (const unsigned char *)VERSION, strlen(VERSION) + 1);
+    SHA1Input(&sha, (const unsigned char *)path, strlen(path) + 1);
+    free(path);
+    for (i = 0; i < args.num_includefolders; i++)
+        SHA1Input(&sha, (const unsigned char *)args.includefolders[i], strlen(args.includefolders[i]) + 1);
+    SHA1Input(&sha, (const unsigned char *)(args.optimizemeshes ? "1" : "0"), 1);
+    hash_file(source, hash);
+    SHA1Input(&sha, (const unsigned char *)hash, 40);
+    sha_to_hex(&sha, source_key);
+
+    snprintf(manifest_path, sizeof(manifest_path), "%s%c%s%s", args.cachedir, PATHSEP, source_key, CACHEMANIFESTEXT);
+
+    // check if the dependencies are still the same as last time
+    f = fopen(manifest_path, "rb");
+    if (f) {
+        SHA1Reset(&sha);
+        SHA1Input(&sha, (const unsigned char *)source_key, 40);
+
+        valid = true;
+        while (fgets(line, sizeof(line), f)) {
+            if (line[strlen(line) - 1] == '\n')
+                line[strlen(line) - 1] = 0;
+
+            if (strlen(line) < 42) {
+                valid = false;
+                break;
+            }
+
+            hash_file(line + 41, hash);
+            if (strncmp(line, hash, 40) != 0) {
+                valid = false;
+                break;
+            }
+
+            SHA1Input(&sha, (const unsigned char *)line, strlen(line));
+        }
+        fclose(f);
+
+        if (valid) {
+            sha_to_hex(&sha, output_key);
+            snprintf(output_path, sizeof(output_path), "%s%c%s%s", args.cachedir, PATHSEP, output_key, CACHEOUTPUTEXT);
+
+            if (access(output_path, F_OK) != -1 && copy_file(output_path, target) == 0) {
+                pthread_mutex_lock(&cache_lock);
+                cache_hits++;
+                pthread_mutex_unlock(&cache_lock);
+                return 0;
+            }
+        }
+    }
+
+    // binarize, keeping track of all files that are read
+    dependencies.num_dependencies = 0;
+    dependencies.dependencies = NULL;
+
+    current_dependencies = &dependencies;
+    success = binarizer(source, target);
+    current_dependencies = NULL;
+
+    pthread_mutex_lock(&cache_lock);
+    cache_misses++;
+    pthread_mutex_unlock(&cache_lock);
+
+    if (success == 0 && cache_store(source, target, source_key, &dependencies))
+        lwarningf(source, -1, "Failed to store binarized file in cache.\n");
+
+    free_dependencies(&dependencies);
+
+    return success;
+}
+
+
+void print_cache_summary() {
+    extern struct arguments args;
+
+    if (args.cachedir == NULL)
+        return;
+
+    infof("Binarization cache: %i hits, %i misses.\n", cache_hits, cache_misses);
+}
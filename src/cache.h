@@ -0,0 +1,44 @@
+/*
+ * Copyright (C)  2016  Felix "KoffeinFlummi" Wiegand
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#pragma once
+
+
+#define CACHEMANIFESTEXT ".deps"
+#define CACHEOUTPUTEXT ".bin"
+
+
+struct dependencies {
+    int num_dependencies;
+    char **dependencies;
+};
+
+
+void add_dependency(char *path);
+
+struct dependencies *collect_dependencies(struct dependencies *dependencies);
+
+void restore_dependencies(struct dependencies *previous);
+
+void add_dependencies(struct dependencies *dependencies);
+
+void free_dependencies(struct dependencies *dependencies);
+
+int cache_binarize(char *source, char *target, int (*binarizer)(char *, char *));
+
+void print_cache_summary();
@@ -35,125 +35,330 @@
 #include "derapify.h"
 
 
-int skip_array(FILE *f) {
+char *index_string(struct config_index *index, uint32_t *pos) {
+    /*
+     * Returns the string at the given position and moves the position past
+     * it, or NULL if the string isn't terminated inside the data.
+     */
+
+    char *result;
+    char *end;
+
+    if (*pos >= index->length)
+        return NULL;
+
+    result = index->data + *pos;
+    end = memchr(result, 0, index->length - *pos);
+    if (end == NULL)
+        return NULL;
+
+    *pos += end - result + 1;
+
+    return result;
+}
+
+
+int index_compressed_int(struct config_index *index, uint32_t *pos, uint32_t *result) {
+    int i;
+    uint8_t temp;
+
+    *result = 0;
+
+    for (i = 0; i <= 4; i++) {
+        if (*pos >= index->length)
+            return 1;
+
+        temp = index->data[(*pos)++];
+        *result = *result | ((uint32_t)(temp & 0x7f) << (i * 7));
+
+        if (temp < 0x80)
+            break;
+    }
+
+    return 0;
+}
+
+
+int index_skip_array(struct config_index *index, uint32_t *pos) {
     uint8_t type;
     uint32_t num_entries;
 
-    for (num_entries = read_compressed_int(f); num_entries > 0; num_entries--) {
-        type = fgetc(f);
+    if (index_compressed_int(index, pos, &num_entries))
+        return 1;
 
-        if (type == 0 || type == 4)
-            while (fgetc(f) != 0);
-        else if (type == 1 || type == 2)
-            fseek(f, 4, SEEK_CUR);
-        else
-            skip_array(f);
+    for (; num_entries > 0; num_entries--) {
+        if (*pos >= index->length)
+            return 1;
+
+        type = index->data[(*pos)++];
+
+        if (type == 0) {
+            if (index_string(index, pos) == NULL)
+                return 1;
+        } else if (type == 1 || type == 2) {
+            *pos += 4;
+        } else if (type == 3) {
+            if (index_skip_array(index, pos))
+                return 1;
+        } else {
+            return 1;
+        }
     }
 
-    return 0;
+    return (*pos > index->length);
 }
 
 
-int seek_config_path(FILE *f, char *config_path) {
+int normalize_config_path(char *config_path, char *key, size_t keysize) {
     /*
-     * Assumes the file pointer f points at the start of a rapified
-     * class body. The config path should be formatted like one used
-     * by the ingame commands (case insensitive):
+     * Converts a config path formatted like one used by the ingame
+     * commands (case insensitive):
      *
      *   CfgExample >> MyClass >> MyValue
      *
-     * This function then moves the file pointer to the start of the
-     * desired class entry (or class body for classes).
+     * into the form used as a key in the config index:
      *
-     * Returns a positive integer on failure, a 0 on success and -1
-     * if the given path doesn't exist.
+     *   cfgexample>myclass>myvalue
+     *
+     * Returns 0 on success and 1 if the path doesn't fit into the key.
+     */
+
+    char c;
+    size_t i;
+    bool separate;
+
+    i = 0;
+    separate = false;
+
+    for (; *config_path != 0; config_path++) {
+        c = *config_path;
+
+        if (c == '>') {
+            separate = (i > 0);
+            continue;
+        }
+        if (c == ' ' || c == '\t')
+            continue;
+
+        if (i + 2 >= keysize)
+            return 1;
+
+        if (separate) {
+            key[i++] = '>';
+            separate = false;
+        }
+
+        if (c >= 'A' && c <= 'Z')
+            c -= 'A' - 'a';
+        key[i++] = c;
+    }
+
+    key[i] = 0;
+
+    return 0;
+}
+
+
+void add_config_entry(struct config_index *index, char *key, uint8_t type, uint32_t offset) {
+    /*
+     * Adds the given entry to the index. If the key already exists, the
+     * first entry is kept, same as a linear search would find it.
+     */
+
+    struct config_entry *old_entries;
+    uint32_t old_size;
+    uint32_t i;
+    uint32_t j;
+
+    if ((index->num_entries + 1) * 4 > index->size_entries * 3) {
+        old_entries = index->entries;
+        old_size = index->size_entries;
+
+        index->size_entries = (old_size == 0) ? 256 : old_size * 2;
+        index->entries = (struct config_entry *)safe_malloc(sizeof(struct config_entry) * index->size_entries);
+        for (i = 0; i < index->size_entries; i++)
+            index->entries[i].key = NULL;
+
+        for (i = 0; i < old_size; i++) {
+            if (old_entries[i].key == NULL)
+                continue;
+
+            j = hash_string(old_entries[i].key, strlen(old_entries[i].key)) & (index->size_entries - 1);
+            while (index->entries[j].key != NULL)
+                j = (j + 1) & (index->size_entries - 1);
+            index->entries[j] = old_entries[i];
+        }
+        free(old_entries);
+    }
+
+    i = hash_string(key, strlen(key)) & (index->size_entries - 1);
+    while (index->entries[i].key != NULL) {
+        if (strcmp(index->entries[i].key, key) == 0)
+            return;
+        i = (i + 1) & (index->size_entries - 1);
+    }
+
+    index->entries[i].key = arena_strndup(index->arena, key, strlen(key));
+    index->entries[i].type = type;
+    index->entries[i].offset = offset;
+    index->num_entries++;
+}
+
+
+int index_class(struct config_index *index, char *path, uint32_t offset) {
+    /*
+     * Adds all entries of the class body at the given offset to the index,
+     * descending into subclasses.
+     *
+     * Returns 0 on success and a positive integer if the data is malformed.
      */
 
     int i;
+    int success;
     uint8_t type;
+    uint32_t pos;
+    uint32_t start;
     uint32_t num_entries;
-    uint32_t fp;
-    char path[2048];
-    char target[512];
-    char buffer[512];
-
-    // Trim leading spaces
-    strncpy(path, config_path, sizeof(path));
-    trim_leading(path, sizeof(path));
-
-    // Extract first element
-    for (i = 0; i < sizeof(target) - 1; i++) {
-        if (path[i] == 0 || path[i] == '>' || path[i] == ' ')
-            break;
-    }
-    strncpy(target, path, i);
-    target[i] = 0;
+    uint32_t body;
+    char *name;
+    char key[2048];
+
+    pos = offset;
 
     // Inherited classname
-    while (fgetc(f) != 0);
+    if (index_string(index, &pos) == NULL)
+        return 1;
 
-    num_entries = read_compressed_int(f);
+    if (index_compressed_int(index, &pos, &num_entries))
+        return 1;
 
     for (i = 0; i < num_entries; i++) {
-        fp = ftell(f);
-        type = fgetc(f);
+        if (pos >= index->length)
+            return 1;
 
-        if (type == 0) { // class
-            if (fgets(buffer, sizeof(buffer), f) == NULL)
-                return 1;
+        start = pos;
+        type = index->data[pos++];
 
-            fseek(f, fp + strlen(buffer) + 2, SEEK_SET);
-            fread(&fp, 4, 1, f);
+        if (type == 1) // value type
+            pos++;
+        else if (type == 5) // array expansion flag
+            pos += 4;
 
-            if (stricmp(buffer, target))
-                continue;
+        name = index_string(index, &pos);
+        if (name == NULL)
+            return 1;
+
+        if (snprintf(key, sizeof(key), (path[0] == 0) ? "%s%s" : "%s>%s", path, name) >= sizeof(key))
+            return 2;
+        lower_case(key + strlen(key) - strlen(name));
+
+        if (type == 0) { // class
+            if (pos + 4 > index->length)
+                return 1;
+            memcpy(&body, index->data + pos, 4);
+            pos += 4;
 
-            fseek(f, fp, SEEK_SET);
+            // bodies are always written after their entry, this also rules out loops
+            if (body <= start || body >= index->length)
+                return 1;
 
-            if (strchr(path, '>') == NULL)
-                return 0;
+            add_config_entry(index, key, type, body);
 
-            strcpy(path, strchr(config_path, '>') + 2);
-            return seek_config_path(f, path);
+            success = index_class(index, key, body);
+            if (success)
+                return success;
         } else if (type == 1) { // value
-            type = fgetc(f);
+            if (index->data[start + 1] == 0) {
+                if (index_string(index, &pos) == NULL)
+                    return 1;
+            } else {
+                pos += 4;
+            }
 
-            if (fgets(buffer, sizeof(buffer), f) == NULL)
+            add_config_entry(index, key, type, start);
+        } else if (type == 2 || type == 5) { // array
+            if (index_skip_array(index, &pos))
                 return 1;
 
-            if (stricmp(buffer, target) == 0) {
-                fseek(f, fp, SEEK_SET);
-                return 0;
-            }
+            // expansions only make sense in combination with the parent
+            if (type == 2)
+                add_config_entry(index, key, type, start);
+        } else if (type != 3 && type != 4) { // extern & delete statements
+            return 3;
+        }
+    }
 
-            fseek(f, fp + strlen(buffer) + 3, SEEK_SET);
+    return (pos > index->length);
+}
 
-            if (type == 0)
-                while (fgetc(f) != 0);
-            else
-                fseek(f, 4, SEEK_CUR);
-        } else if (type == 2) { // array
-            if (fgets(buffer, sizeof(buffer), f) == NULL)
-                return 1;
 
-            if (stricmp(buffer, target) == 0) {
-                fseek(f, fp, SEEK_SET);
-                return 0;
-            }
+struct config_index *config_index_init(char *data, size_t length) {
+    /*
+     * Indexes the given rapified config, so that entries can be looked up
+     * by their config path without scanning the config. The data is not
+     * copied and has to stay around until the index is freed.
+     *
+     * Returns NULL if the data isn't a valid rapified config.
+     */
 
-            fseek(f, fp + strlen(buffer) + 2, SEEK_SET);
+    struct config_index *index;
 
-            skip_array(f);
-        } else { // extern & delete statements
-            while (fgetc(f) != 0);
-        }
+    if (length < 16 || memcmp(data, "\0raP", 4) != 0)
+        return NULL;
+
+    index = (struct config_index *)safe_malloc(sizeof(struct config_index));
+    index->data = data;
+    index->length = length;
+    index->num_entries = 0;
+    index->size_entries = 0;
+    index->entries = NULL;
+    index->arena = arena_init();
+
+    add_config_entry(index, "", 0, 16);
+
+    if (index_class(index, "", 16)) {
+        config_index_free(index);
+        return NULL;
+    }
+
+    return index;
+}
+
+
+void config_index_free(struct config_index *index) {
+    free(index->entries);
+    arena_free(index->arena);
+    free(index);
+}
+
+
+struct config_entry *find_config_entry(struct config_index *index, char *config_path) {
+    /*
+     * Looks up the given config path (case insensitive). For classes the
+     * offset of the entry points to the class body, for everything else
+     * to the start of the entry.
+     *
+     * Returns NULL if the path doesn't exist.
+     */
+
+    uint32_t i;
+    char key[2048];
+
+    if (normalize_config_path(config_path, key, sizeof(key)))
+        return NULL;
+
+    i = hash_string(key, strlen(key)) & (index->size_entries - 1);
+    while (index->entries[i].key != NULL) {
+        if (strcmp(index->entries[i].key, key) == 0)
+            return &index->entries[i];
+        i = (i + 1) & (index->size_entries - 1);
     }
 
-    return -1;
+    return NULL;
 }
 
 
-int find_parent(FILE *f, char *config_path, char *buffer, size_t buffsize) {
+int find_parent(struct config_index *index, char *config_path, char *buffer, size_t buffsize) {
     /*
      * Takes a config path and returns the parent class of that class.
      * Assumes the given config path points to an existing class.
@@ -166,18 +371,19 @@ int find_parent(FILE *f, char *config_path, char *buffer, size_t buffsize) {
     int i;
     int success;
     bool is_root;
+    struct config_entry *entry;
     char containing[2048];
     char name[2048];
     char parent[2048];
 
     // Loop up class
-    fseek(f, 16, SEEK_SET);
-    if (seek_config_path(f, config_path))
+    entry = find_config_entry(index, config_path);
+    if (entry == NULL || entry->type != 0)
         return 1;
 
-    // Get parent class name
-    if (fgets(parent, sizeof(parent), f) == NULL)
-        return 2;
+    // Get parent class name, the index made sure it's terminated
+    strncpy(parent, index->data + entry->offset, sizeof(parent));
+    parent[sizeof(parent) - 1] = 0;
     lower_case(parent);
 
     if (strlen(parent) == 0)
@@ -187,6 +393,7 @@ int find_parent(FILE *f, char *config_path, char *buffer, size_t buffsize) {
     is_root = strchr(config_path, '>') == NULL;
     if (is_root) {
         strncpy(name, config_path, sizeof(name));
+        trim_leading(name, sizeof(name));
 
         containing[0] = 0;
     } else {
@@ -202,11 +409,12 @@ int find_parent(FILE *f, char *config_path, char *buffer, size_t buffsize) {
 
     // Check parent class inside same containing class
     if (strcmp(name, parent) != 0) {
-        sprintf(buffer, "%s >> %s", containing, parent);
+        if (is_root)
+            snprintf(buffer, buffsize, "%s", parent);
+        else
+            snprintf(buffer, buffsize, "%s >> %s", containing, parent);
 
-        fseek(f, 16, SEEK_SET);
-        success = seek_config_path(f, buffer);
-        if (success == 0)
+        if (find_config_entry(index, buffer) != NULL)
             return 0;
     }
 
@@ -215,7 +423,7 @@ int find_parent(FILE *f, char *config_path, char *buffer, size_t buffsize) {
         return -2;
 
     // Try to find the class parent in the parent of the containing class
-    success = find_parent(f, containing, buffer, sizeof(buffer));
+    success = find_parent(index, containing, buffer, buffsize);
     if (success > 0)
         return success;
     if (success < 0)
@@ -227,46 +435,44 @@ int find_parent(FILE *f, char *config_path, char *buffer, size_t buffsize) {
 }
 
 
-int seek_definition(FILE *f, char *config_path) {
+int seek_definition(struct config_index *index, char *config_path, uint32_t *offset) {
     /*
      * Finds the definition of the given value, even if it is defined in a
-     * parent class.
+     * parent class, and returns the offset of its entry.
      *
      * Returns 0 on success, a positive integer on failure.
      */
 
+    int i;
     int success;
+    struct config_entry *entry;
+    char containing[2048];
+    char parent[2048];
+    char value[2048];
 
     // Try the direct way first
-    fseek(f, 16, SEEK_SET);
-    success = seek_config_path(f, config_path);
-    if (success >= 0)
-        return success;
+    entry = find_config_entry(index, config_path);
+    if (entry != NULL) {
+        *offset = entry->offset;
+        return (entry->type == 0) ? 1 : 0;
+    }
 
     // No containing class
     if (strchr(config_path, '>') == NULL)
         return 1;
 
     // Try to find the definition
-    int i;
-    char containing[2048];
-    char parent[2048];
-    char value[2048];
-
     strncpy(containing, config_path, sizeof(containing));
     *(strrchr(containing, '>') - 1) = 0;
     for (i = strlen(containing) - 1; i >= 0 && containing[i] == ' '; i--)
         containing[i] = 0;
 
-    fseek(f, 16, SEEK_SET);
-    success = seek_config_path(f, containing);
-
     // Containing class doesn't even exist
-    if (success < 0)
-        return success;
+    if (find_config_entry(index, containing) == NULL)
+        return -1;
 
     // Find parent of the containing class
-    success = find_parent(f, containing, parent, sizeof(parent));
+    success = find_parent(index, containing, parent, sizeof(parent));
     if (success) {
         return success;
     }
@@ -277,48 +483,70 @@ int seek_definition(FILE *f, char *config_path) {
     strcat(parent, " >> ");
     strcat(parent, value);
 
-    return seek_definition(f, parent);
+    return seek_definition(index, parent, offset);
 }
 
 
-int read_string(FILE *f, char *config_path, char *buffer, size_t buffsize) {
+int read_value(struct config_index *index, char *config_path, uint8_t *type, uint32_t *pos) {
     /*
-     * Reads the given config string into the given buffer.
+     * Finds the given value and returns its type and the position of its
+     * content.
      *
      * Returns -1 if the value could not be found, 0 on success
      * and a positive integer on failure.
      */
 
     int success;
-    long fp;
-    uint8_t temp;
 
-    success = seek_definition(f, config_path);
+    success = seek_definition(index, config_path, pos);
     if (success != 0)
         return success;
 
-    temp = fgetc(f);
-    if (temp != 1)
+    if (index->data[*pos] != 1)
         return 1;
 
-    temp = fgetc(f);
-    if (temp != 0)
-        return 2;
+    *type = index->data[*pos + 1];
+    *pos += 2;
 
-    while (fgetc(f) != 0);
+    if (index_string(index, pos) == NULL)
+        return 1;
+
+    return 0;
+}
 
-    fp = ftell(f);
 
-    if (fgets(buffer, buffsize, f) == NULL)
+int read_string(struct config_index *index, char *config_path, char *buffer, size_t buffsize) {
+    /*
+     * Reads the given config string into the given buffer.
+     *
+     * Returns -1 if the value could not be found, 0 on success
+     * and a positive integer on failure.
+     */
+
+    int success;
+    uint8_t type;
+    uint32_t pos;
+    char *value;
+
+    success = read_value(index, config_path, &type, &pos);
+    if (success != 0)
+        return success;
+
+    if (type != 0)
+        return 2;
+
+    value = index_string(index, &pos);
+    if (value == NULL)
         return 3;
 
-    fseek(f, fp + strlen(buffer) + 1, SEEK_SET);
+    strncpy(buffer, value, buffsize - 1);
+    buffer[buffsize - 1] = 0;
 
     return 0;
 }
 
 
-int read_int(FILE *f, char *config_path, int32_t *result) {
+int read_int(struct config_index *index, char *config_path, int32_t *result) {
     /*
      * Reads the given integer from config.
      *
@@ -327,29 +555,23 @@ int read_int(FILE *f, char *config_path, int32_t *result) {
      */
 
     int success;
-    uint8_t temp;
+    uint8_t type;
+    uint32_t pos;
 
-    success = seek_definition(f, config_path);
+    success = read_value(index, config_path, &type, &pos);
     if (success != 0)
         return success;
 
-    temp = fgetc(f);
-    if (temp != 1)
-        return 1;
-
-    temp = fgetc(f);
-    if (temp != 2)
+    if (type != 2)
         return 2;
 
-    while (fgetc(f) != 0);
-
-    fread(result, 4, 1, f);
+    memcpy(result, index->data + pos, 4);
 
     return 0;
 }
 
 
-int read_float(FILE *f, char *config_path, float *result) {
+int read_float(struct config_index *index, char *config_path, float *result) {
     /*
      * Reads the given float from config.
      *
@@ -358,36 +580,26 @@ int read_float(FILE *f, char *config_path, float *result) {
      */
 
     int success;
-    uint8_t temp;
+    uint8_t type;
+    uint32_t pos;
 
-    success = seek_definition(f, config_path);
+    success = read_value(index, config_path, &type, &pos);
     if (success != 0)
         return success;
 
-    temp = fgetc(f);
-    if (temp != 1)
-        return 1;
-
-    temp = fgetc(f);
-
-    while (fgetc(f) != 0);
-
-    if (temp == 2) {
+    if (type == 2) {
         // Convert integer to float
         int32_t int_value;
 
-        fread(&int_value, 4, 1, f);
+        memcpy(&int_value, index->data + pos, 4);
         *result = (float)int_value;
-    } else if (temp == 0) {
+    } else if (type == 0) {
         // Try to parse "rad X" strings
         char string_value[512];
         char *endptr;
-        long fp;
 
-        fp = ftell(f);
-        if (fgets(string_value, sizeof(string_value), f) == NULL)
-            return 2;
-        fseek(f, fp + strlen(string_value) + 1, SEEK_SET);
+        strncpy(string_value, index->data + pos, sizeof(string_value) - 1);
+        string_value[sizeof(string_value) - 1] = 0;
 
         trim_leading(string_value, sizeof(string_value));
         lower_case(string_value);
@@ -401,14 +613,44 @@ int read_float(FILE *f, char *config_path, float *result) {
 
         *result *= RAD2DEG;
     } else {
-        fread(result, 4, 1, f);
+        memcpy(result, index->data + pos, 4);
     }
 
     return 0;
 }
 
 
-int read_long_array(FILE *f, char *config_path, int32_t *array, int size) {
+int read_array(struct config_index *index, char *config_path, uint32_t *num_entries, uint32_t *pos) {
+    /*
+     * Finds the given array and returns the number of elements and the
+     * position of the first element.
+     *
+     * Returns -1 if the array could not be found, 0 on success
+     * and a positive integer on failure.
+     */
+
+    int success;
+
+    success = seek_definition(index, config_path, pos);
+    if (success != 0)
+        return success;
+
+    if (index->data[*pos] != 2)
+        return 1;
+
+    *pos += 1;
+
+    if (index_string(index, pos) == NULL)
+        return 1;
+
+    if (index_compressed_int(index, pos, num_entries))
+        return 1;
+
+    return 0;
+}
+
+
+int read_long_array(struct config_index *index, char *config_path, int32_t *array, int size) {
     /*
      * Reads the given array from config. size should be the maximum number of
      * elements in the array, buffsize the length of the individual buffers.
@@ -421,32 +663,28 @@ int read_long_array(FILE *f, char *config_path, int32_t *array, int size) {
     int success;
     uint8_t temp;
     uint32_t num_entries;
+    uint32_t pos;
     float float_value;
 
-    success = seek_definition(f, config_path);
+    success = read_array(index, config_path, &num_entries, &pos);
     if (success != 0)
         return success;
 
-    temp = fgetc(f);
-    if (temp != 2)
-        return 1;
-
-    while (fgetc(f) != 0);
-
-    num_entries = read_compressed_int(f);
-
     for (i = 0; i < num_entries; i++) {
         // Array is full
         if (i == size)
             return 2;
 
-        temp = fgetc(f);
-        if (temp != 1 && temp != 2)
+        if (pos + 5 > index->length)
             return 3;
 
-        if (fread(&array[i], sizeof(int32_t), 1, f) != 1)
+        temp = index->data[pos++];
+        if (temp != 1 && temp != 2)
             return 3;
 
+        memcpy(&array[i], index->data + pos, sizeof(int32_t));
+        pos += sizeof(int32_t);
+
         if (temp == 1) {
             memcpy(&float_value, &array[i], sizeof(int32_t));
             array[i] = (int32_t)float_value;
@@ -457,7 +695,7 @@ int read_long_array(FILE *f, char *config_path, int32_t *array, int size) {
 }
 
 
-int read_float_array(FILE *f, char *config_path, float *array, int size) {
+int read_float_array(struct config_index *index, char *config_path, float *array, int size) {
     /*
      * Reads the given array from config. size should be the maximum number of
      * elements in the array, buffsize the length of the individual buffers.
@@ -470,32 +708,28 @@ int read_float_array(FILE *f, char *config_path, float *array, int size) {
     int success;
     uint8_t temp;
     uint32_t num_entries;
+    uint32_t pos;
     uint32_t long_value;
 
-    success = seek_definition(f, config_path);
+    success = read_array(index, config_path, &num_entries, &pos);
     if (success != 0)
         return success;
 
-    temp = fgetc(f);
-    if (temp != 2)
-        return 1;
-
-    while (fgetc(f) != 0);
-
-    num_entries = read_compressed_int(f);
-
     for (i = 0; i < num_entries; i++) {
         // Array is full
         if (i == size)
             return 2;
 
-        temp = fgetc(f);
-        if (temp != 1 && temp != 2)
+        if (pos + 5 > index->length)
             return 3;
 
-        if (fread(&array[i], sizeof(float), 1, f) != 1)
+        temp = index->data[pos++];
+        if (temp != 1 && temp != 2)
             return 3;
 
+        memcpy(&array[i], index->data + pos, sizeof(float));
+        pos += sizeof(float);
+
         if (temp == 2) {
             memcpy(&long_value, &array[i], sizeof(float));
             array[i] = (float)long_value;
@@ -506,7 +740,7 @@ int read_float_array(FILE *f, char *config_path, float *array, int size) {
 }
 
 
-int read_string_array(FILE *f, char *config_path, char *buffer, int size, size_t buffsize) {
+int read_string_array(struct config_index *index, char *config_path, char *buffer, int size, size_t buffsize) {
     /*
      * Reads the given array from config. size should be the maximum number of
      * elements in the array, buffsize the length of the individual buffers.
@@ -517,44 +751,35 @@ int read_string_array(FILE *f, char *config_path, char *buffer, int size, size_t
 
     int i;
     int success;
-    long fp;
-    uint8_t temp;
     uint32_t num_entries;
+    uint32_t pos;
+    char *value;
 
-    success = seek_definition(f, config_path);
+    success = read_array(index, config_path, &num_entries, &pos);
     if (success != 0)
         return success;
 
-    temp = fgetc(f);
-    if (temp != 2)
-        return 1;
-
-    while (fgetc(f) != 0);
-
-    num_entries = read_compressed_int(f);
-
     for (i = 0; i < num_entries; i++) {
         // Array is full
         if (i == size)
             return 2;
 
-        temp = fgetc(f);
-        if (temp != 0)
+        if (pos >= index->length || index->data[pos++] != 0)
             return 3;
 
-        fp = ftell(f);
-
-        if (fgets(buffer + i * buffsize, buffsize, f) == NULL)
+        value = index_string(index, &pos);
+        if (value == NULL)
             return 3;
 
-        fseek(f, fp + strlen(buffer + i * buffsize) + 1, SEEK_SET);
+        strncpy(buffer + i * buffsize, value, buffsize - 1);
+        buffer[i * buffsize + buffsize - 1] = 0;
     }
 
     return 0;
 }
 
 
-int read_classes(FILE *f, char *config_path, char *array, int size, size_t buffsize) {
+int read_classes(struct config_index *index, char *config_path, char *array, int size, size_t buffsize) {
     /*
      * Reads all subclass names for the given config path into the given
      * array.
@@ -565,31 +790,36 @@ int read_classes(FILE *f, char *config_path, char *array, int size, size_t buffs
 
     int i;
     int j;
-    int success;
     uint8_t type;
     uint32_t num_entries;
-    uint32_t fp;
-    char target[512];
-    char buffer[512];
+    uint32_t pos;
+    uint32_t start;
+    char *name;
+    struct config_entry *entry;
 
-    fseek(f, 16, SEEK_SET);
-    success = seek_config_path(f, config_path);
-    if (success)
-        return success;
-
-    // Inherited classname
-    while (fgetc(f) != 0);
+    entry = find_config_entry(index, config_path);
+    if (entry == NULL)
+        return -1;
+    if (entry->type != 0)
+        return 1;
 
-    num_entries = read_compressed_int(f);
+    // The index already made sure the class body is well-formed
+    pos = entry->offset;
+    index_string(index, &pos);
+    index_compressed_int(index, &pos, &num_entries);
 
     for (i = 0; i < num_entries; i++) {
-        fp = ftell(f);
-        type = fgetc(f);
+        start = pos;
+        type = index->data[pos++];
 
-        if (type == 0) { // class
-            if (fgets(buffer, sizeof(buffer), f) == NULL)
-                return 1;
+        if (type == 1)
+            pos++;
+        else if (type == 5)
+            pos += 4;
 
+        name = index_string(index, &pos);
+
+        if (type == 0) { // class
             for (j = 0; j < size; j++) {
                 if (*(array + j * buffsize) == 0)
                     break;
@@ -597,44 +827,16 @@ int read_classes(FILE *f, char *config_path, char *array, int size, size_t buffs
             if (j == size)
                 return 2;
 
-            strncpy(array + j * buffsize, buffer, buffsize);
+            strncpy(array + j * buffsize, name, buffsize);
 
-            fseek(f, fp + strlen(buffer) + 6, SEEK_SET);
+            pos += 4;
         } else if (type == 1) { // value
-            type = fgetc(f);
-
-            if (fgets(buffer, sizeof(buffer), f) == NULL)
-                return 1;
-
-            lower_case(buffer);
-
-            if (strcmp(buffer, target) == 0) {
-                fseek(f, fp, SEEK_SET);
-                return 0;
-            }
-
-            fseek(f, fp + strlen(buffer) + 3, SEEK_SET);
-
-            if (type == 0 || type == 4)
-                while (fgetc(f) != 0);
+            if (index->data[start + 1] == 0)
+                index_string(index, &pos);
             else
-                fseek(f, 4, SEEK_CUR);
-        } else if (type == 2) { // array
-            if (fgets(buffer, sizeof(buffer), f) == NULL)
-                return 1;
-
-            lower_case(buffer);
-
-            if (strcmp(buffer, target) == 0) {
-                fseek(f, fp, SEEK_SET);
-                return 0;
-            }
-
-            fseek(f, fp + strlen(buffer) + 2, SEEK_SET);
-
-            skip_array(f);
-        } else { // extern & delete statements
-            while (fgetc(f) != 0);
+                pos += 4;
+        } else if (type == 2 || type == 5) { // array
+            index_skip_array(index, &pos);
         }
     }
 
@@ -836,7 +1038,7 @@ int derapify_file(char *source, char *target) {
      * returned. 0 is returned on success and a positive integer on failure.
      */
 
-    extern char *current_target;
+    extern __thread char *current_target;
     FILE *f_source;
     FILE *f_target;
     char buffer[4096];
@@ -19,28 +19,51 @@
 #pragma once
 
 
+#include "utils.h"
+
+
 #define RAD2DEG 0.017453293;
 
 
-int seek_config_path(FILE *f, char *config_path);
+struct config_entry {
+    char *key;
+    uint8_t type;
+    uint32_t offset;
+};
+
+struct config_index {
+    char *data;
+    size_t length;
+    uint32_t num_entries;
+    uint32_t size_entries;
+    struct config_entry *entries;
+    struct arena *arena;
+};
+
+
+struct config_index *config_index_init(char *data, size_t length);
+
+void config_index_free(struct config_index *index);
+
+struct config_entry *find_config_entry(struct config_index *index, char *config_path);
 
-int find_parent(FILE *f, char *config_path, char *buffer, size_t buffsize);
+int find_parent(struct config_index *index, char *config_path, char *buffer, size_t buffsize);
 
-int seek_definition(FILE *f, char *config_path);
+int seek_definition(struct config_index *index, char *config_path, uint32_t *offset);
 
-int read_string(FILE *f, char *config_path, char *buffer, size_t buffsize);
+int read_string(struct config_index *index, char *config_path, char *buffer, size_t buffsize);
 
-int read_int(FILE *f, char *config_path, int32_t *result);
+int read_int(struct config_index *index, char *config_path, int32_t *result);
 
-int read_float(FILE *f, char *config_path, float *result);
+int read_float(struct config_index *index, char *config_path, float *result);
 
-int read_long_array(FILE *f, char *config_path, int32_t *array, int size);
+int read_long_array(struct config_index *index, char *config_path, int32_t *array, int size);
 
-int read_float_array(FILE *f, char *config_path, float *array, int size);
+int read_float_array(struct config_index *index, char *config_path, float *array, int size);
 
-int read_string_array(FILE *f, char *config_path, char *buffer, int size, size_t buffsize);
+int read_string_array(struct config_index *index, char *config_path, char *buffer, int size, size_t buffsize);
 
-int read_classes(FILE *f, char *config_path, char *array, int size, size_t buffsize);
+int read_classes(struct config_index *index, char *config_path, char *array, int size, size_t buffsize);
 
 int derapify_file(char *source, char *target);
 
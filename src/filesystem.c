@@ -125,7 +125,11 @@ int create_folder(char *path) {
     if (stat(path, &st) != -1)
         return -2;
 
-    return mkdir(path, 0755);
+    // someone else might have been faster
+    if (mkdir(path, 0755) == -1)
+        return (errno == EEXIST) ? -2 : -1;
+
+    return 0;
 
 #endif
 }
@@ -177,6 +181,7 @@ int create_temp_folder(char *addon, char *temp_folder, size_t bufsize) {
     char temp[2048] = TEMPPATH;
     char addon_sanitized[2048];
     int i;
+    int success;
 
 #ifdef _WIN32
     temp[0] = 0;
@@ -189,17 +194,20 @@ int create_temp_folder(char *addon, char *temp_folder, size_t bufsize) {
     for (i = 0; i <= strlen(addon); i++)
         addon_sanitized[i] = (addon[i] == '\\' || addon[i] == '/') ? '_' : addon[i];
 
-    // find a free one
+    // find a free one, creating it right away so parallel jobs don't get the same one
     for (i = 0; i < 1024; i++) {
         snprintf(temp_folder, bufsize, "%s_%s_%i%c", temp, addon_sanitized, i, PATHSEP);
+        if (access(temp_folder, F_OK) != -1)
+            continue;
+
+        success = create_folder(temp_folder);
+        if (success == 0)
+            return 0;
         if (access(temp_folder, F_OK) == -1)
-            break;
+            return -1;
     }
 
-    if (i == 1024)
-        return -1;
-
-    return create_folders(temp_folder);
+    return -1;
 }
 
 
@@ -280,7 +288,7 @@ int copy_file(char *source, char *target) {
     if (f_source < 0)
         return -2;
 
-    f_target = open(target, O_WRONLY | O_CREAT, 0666);
+    f_target = open(target, O_WRONLY | O_CREAT | O_TRUNC, 0666);
     if (f_target < 0) {
         close(f_source);
         if (f_target >= 0)
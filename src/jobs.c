@@ -0,0 +1,175 @@
+/*
+ * Copyright (C)  2016  Felix "KoffeinFlummi" Wiegand
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#ifdef _WIN32
+#include <windows.h>
+#endif
+
+#include "args.h"
+#include "utils.h"
+#include "jobs.h"
+
+
+struct job_queue {
+    pthread_mutex_t lock;
+    int num_jobs;
+    int next_job;
+    int failed_job;
+    int result;
+    int (*callback)(int, void *);
+    void *data;
+};
+
+
+// set on worker threads, so jobs started from within a job don't add more threads
+__thread bool in_job_thread;
+
+
+int get_num_threads() {
+    /*
+     * Returns the number of worker threads to use, either as given with
+     * --jobs or the number of available cores.
+     */
+
+    extern struct arguments args;
+    int num_threads;
+#ifdef _WIN32
+    SYSTEM_INFO info;
+#endif
+
+    if (args.jobs != NULL) {
+        num_threads = atoi(args.jobs);
+        return MAX(num_threads, 1);
+    }
+
+#ifdef _WIN32
+    GetSystemInfo(&info);
+    num_threads = info.dwNumberOfProcessors;
+#else
+    num_threads = sysconf(_SC_NPROCESSORS_ONLN);
+#endif
+
+    return MAX(num_threads, 1);
+}
+
+
+void *job_worker(void *queue_ptr) {
+    struct job_queue *queue = (struct job_queue *)queue_ptr;
+    int job;
+    int success;
+
+    while (true) {
+        pthread_mutex_lock(&queue->lock);
+        if (queue->next_job >= queue->num_jobs || queue->failed_job >= 0) {
+            pthread_mutex_unlock(&queue->lock);
+            break;
+        }
+        job = queue->next_job++;
+        pthread_mutex_unlock(&queue->lock);
+
+        success = queue->callback(job, queue->data);
+        if (success == 0)
+            continue;
+
+        pthread_mutex_lock(&queue->lock);
+        if (queue->failed_job < 0 || job < queue->failed_job) {
+            queue->failed_job = job;
+            queue->result = success;
+        }
+        pthread_mutex_unlock(&queue->lock);
+    }
+
+    return NULL;
+}
+
+
+void *job_thread(void *queue_ptr) {
+    in_job_thread = true;
+
+    return job_worker(queue_ptr);
+}
+
+
+int run_jobs(int num_jobs, int (*callback)(int, void *), void *data) {
+    /*
+     * Calls the callback for every job index from 0 to num_jobs - 1,
+     * distributing the jobs over get_num_threads() worker threads. Jobs are
+     * handed out in order, so expensive jobs should come first.
+     *
+     * After a job failed, no new jobs are started. Returns 0 if all jobs
+     * succeeded and the return value of the first failed job otherwise.
+     *
+     * When called from a job that is already running on a worker thread,
+     * the jobs are run on the calling thread, since the outer jobs are
+     * already using all cores.
+     */
+
+    struct job_queue queue;
+    pthread_attr_t attr;
+    pthread_t *threads;
+    int num_threads;
+    int i;
+
+    pthread_mutex_init(&queue.lock, NULL);
+    queue.num_jobs = num_jobs;
+    queue.next_job = 0;
+    queue.failed_job = -1;
+    queue.result = 0;
+    queue.callback = callback;
+    queue.data = data;
+
+    num_threads = in_job_thread ? 1 : MIN(get_num_threads(), num_jobs);
+
+    // no need for any threads
+    if (num_threads <= 1) {
+        job_worker(&queue);
+        pthread_mutex_destroy(&queue.lock);
+        return queue.result;
+    }
+
+    threads = (pthread_t *)safe_malloc(sizeof(pthread_t) * num_threads);
+
+    pthread_attr_init(&attr);
+    pthread_attr_setstacksize(&attr, JOBSTACKSIZE);
+
+    for (i = 0; i < num_threads; i++) {
+        if (pthread_create(&threads[i], &attr, job_thread, &queue) != 0)
+            break;
+    }
+
+    // if we couldn't start any threads, do it ourselves
+    if (i == 0)
+        job_worker(&queue);
+
+    num_threads = i;
+    for (i = 0; i < num_threads; i++)
+        pthread_join(threads[i], NULL);
+
+    pthread_attr_destroy(&attr);
+    pthread_mutex_destroy(&queue.lock);
+    free(threads);
+
+    return queue.result;
+}
@@ -34,14 +34,16 @@
 #include "filesystem.h"
 #include "keygen.h"
 #include "sign.h"
+#include "preprocess.h"
 
 
 void print_usage() {
     printf("armake\n"
            "\n"
            "Usage:\n"
-           "    armake binarize [-f] [-w <wname>] [-i <includefolder>] <source> [<target>]\n"
-           "    armake build [-f] [-p] [-w <wname>] [-i <includefolder>] [-x <xlist>] [-k <privatekey>] [-s <signature>] [-e <headerextension>] <folder> <pbo>\n"
+           "    armake binarize [-f] [-w <wname>] [-i <includefolder>] [-j <jobs>] [--indexcache <file>] [--cache-dir <folder>] [--pch <file>] [--optimize-meshes] [--verbose] <source> [<target>]\n"
+           "    armake build [-f] [-p] [-w <wname>] [-i <includefolder>] [-x <xlist>] [-k <privatekey>] [-s <signature>] [-e <headerextension>] [-j <jobs>] [--indexcache <file>] [--cache-dir <folder>] [--pch <file>] [--optimize-meshes] [--verbose] <folder> <pbo>\n"
+           "    armake pch [-f] [-w <wname>] [-i <includefolder>] [--indexcache <file>] <header> <pch>\n"
            "    armake inspect <pbo>\n"
            "    armake unpack [-f] [-i <includepattern>] [-x <excludepattern>] <pbo> <folder>\n"
            "    armake cat <pbo> <name>\n"
@@ -56,6 +58,8 @@ void print_usage() {
            "Commands:\n"
            "    binarize    Binarize a file.\n"
            "    build       Pack a folder into a PBO.\n"
+           "    pch         Precompile a header that only defines macros. The header can\n"
+           "                    be given as a path or as an absolute include path.\n"
            "    inspect     Inspect a PBO and list contained files.\n"
            "    unpack      Unpack a PBO into a folder.\n"
            "    cat         Read the named file from the target PBO to stdout.\n"
@@ -77,10 +81,22 @@ void print_usage() {
            "                        Example: foo=bar\n"
            "    -k --key        Private key to use for signing the PBO.\n"
            "    -s --signature  Signature name to use for signing the PBO.\n"
+           "    -j --jobs       Number of files (or LODs of a single model) to binarize in\n"
+           "                        parallel, defaults to the number of CPU cores.\n"
            "    -d --indent     String to use for indentation. "    " (4 spaces) by default.\n"
            "    -z --compress   Compress final PAA where possible.\n"
            "    -t --type       PAA type. One of: DXT1, DXT3, DXT5, ARGB4444, ARGB1555, AI88\n"
            "                        Currently only DXT1 and DXT5 are implemented.\n"
+           "    --indexcache    File to persist the include folder index in between runs.\n"
+           "    --cache-dir     Folder to cache binarized files in, so unchanged files\n"
+           "                        don't have to be binarized again.\n"
+           "    --pch           Header precompiled with \"armake pch\". Includes of that\n"
+           "                        header are replayed from it instead of preprocessed.\n"
+           "    --optimize-meshes\n"
+           "                    Reorder faces and vertices of visual LODs for the GPU\n"
+           "                        vertex cache. The ACMR before and after is shown\n"
+           "                        with --verbose.\n"
+           "    --verbose       Print additional statistics while binarizing.\n"
            "    -h --help       Show usage information and exit.\n"
            "    -v --version    Print the version number and exit.\n"
            "\n"
@@ -120,14 +136,20 @@ int read_args(int argc, char *argv[]) {
     const struct arg_option bool_options[] = {
         { "-f", "--force", &args.force, NULL },
         { "-p", "--packonly", &args.packonly, NULL },
-        { "-z", "--compress", &args.compress, NULL }
+        { "-z", "--compress", &args.compress, NULL },
+        { NULL, "--verbose", &args.verbose, NULL },
+        { NULL, "--optimize-meshes", &args.optimizemeshes, NULL }
     };
 
     const struct arg_option single_options[] = {
         { "-k", "--key", &args.privatekey, NULL },
         { "-s", "--signature", &args.signature, NULL },
         { "-d", "--indent", &args.indent, NULL },
-        { "-t", "--type", &args.paatype, NULL }
+        { "-t", "--type", &args.paatype, NULL },
+        { "-j", "--jobs", &args.jobs, NULL },
+        { NULL, "--indexcache", &args.indexcache, NULL },
+        { NULL, "--cache-dir", &args.cachedir, NULL },
+        { NULL, "--pch", &args.pch, NULL }
     };
 
     const struct arg_option multi_options[] = {
@@ -149,7 +171,7 @@ int read_args(int argc, char *argv[]) {
         }
 
         for (j = 0; j < sizeof(bool_options) / sizeof(struct arg_option); j++) {
-            if (strcmp(bool_options[j].short_name, argv[i]) == 0 ||
+            if ((bool_options[j].short_name != NULL && strcmp(bool_options[j].short_name, argv[i]) == 0) ||
                     strcmp(bool_options[j].long_name, argv[i]) == 0) {
                 *(bool *)(bool_options[j].value) = true;
                 break;
@@ -160,7 +182,7 @@ int read_args(int argc, char *argv[]) {
             continue;
 
         for (j = 0; j < sizeof(single_options) / sizeof(struct arg_option); j++) {
-            if (strcmp(single_options[j].short_name, argv[i]) == 0 ||
+            if ((single_options[j].short_name != NULL && strcmp(single_options[j].short_name, argv[i]) == 0) ||
                     strcmp(single_options[j].long_name, argv[i]) == 0) {
                 if (++i == argc)
                     return 1;
@@ -173,7 +195,7 @@ int read_args(int argc, char *argv[]) {
             continue;
 
         for (j = 0; j < sizeof(multi_options) / sizeof(struct arg_option); j++) {
-            if (strcmp(multi_options[j].short_name, argv[i]) == 0 ||
+            if ((multi_options[j].short_name != NULL && strcmp(multi_options[j].short_name, argv[i]) == 0) ||
                     strcmp(multi_options[j].long_name, argv[i]) == 0) {
                 if (++i == argc)
                     return 1;
@@ -242,10 +264,20 @@ int main(int argc, char *argv[]) {
     if (args.num_positionals == 0 || args.num_positionals > 3)
         goto error;
 
+    if (args.indexcache != NULL)
+        include_index_load(args.indexcache);
+
+    if (args.pch != NULL && pch_load(args.pch)) {
+        success = 1;
+        goto done;
+    }
+
     if (strcmp(args.positionals[0], "binarize") == 0)
         success = cmd_binarize();
     else if (strcmp(args.positionals[0], "build") == 0)
         success = cmd_build();
+    else if (strcmp(args.positionals[0], "pch") == 0)
+        success = cmd_pch();
     else if (strcmp(args.positionals[0], "inspect") == 0)
         success = cmd_inspect();
     else if (strcmp(args.positionals[0], "unpack") == 0)
@@ -272,6 +304,13 @@ error:
     print_usage();
 
 done:
+    if (args.pch != NULL)
+        pch_check_used(args.pch);
+
+    if (args.indexcache != NULL && include_index_save(args.indexcache) && success == 0)
+        success = 1;
+    include_index_free();
+
     if (args.positionals)
         free(args.positionals);
     if (args.mutedwarnings)
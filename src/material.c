@@ -23,6 +23,7 @@
 #include <string.h>
 #include <unistd.h>
 #include <math.h>
+#include <pthread.h>
 
 #include "args.h"
 #include "filesystem.h"
@@ -32,6 +33,7 @@
 #include "derapify.h"
 #include "matrix.h"
 #include "material.h"
+#include "cache.h"
 
 
 const struct shader_ref pixelshaders[153] = {
@@ -239,27 +241,47 @@ const struct shader_ref vertexshaders[45] = {
 };
 
 
-int read_material(struct material *material) {
+struct cached_material {
+    char *path;
+    char *real_path;
+    struct material *material;
+    struct dependencies dependencies;
+};
+
+pthread_mutex_t material_cache_lock = PTHREAD_MUTEX_INITIALIZER;
+struct cached_material *cached_materials;
+int num_cached_materials;
+int size_cached_materials;
+
+
+int read_material_file(struct material *material) {
     /*
-     * Reads the material information for the given material struct.
-     * Returns 0 on success and a positive integer on failure.
+     * Reads the material information for the given material struct from
+     * the rvmat. Returns 0 on success and a positive integer on failure.
      */
 
-    extern char *current_target;
-    FILE *f;
+    extern __thread char *current_target;
+    struct membuffer rapified;
+    struct config_index *config;
     char actual_path[2048];
-    char rapified_path[2048];
     char config_path[2048];
     char temp[2048];
     char shader[2048];
     int i;
     struct color default_color = { 0.0f, 0.0f, 0.0f, 1.0f };
 
-    if (material->path[0] != '\\') {
+    if (material->path[0] != '\\' && material->path[0] != '/') {
         strcpy(temp, "\\");
-        strcat(temp, material->path);
+        strncat(temp, material->path, sizeof(temp) - 2);
     } else {
-        strcpy(temp, material->path);
+        strncpy(temp, material->path, sizeof(temp) - 1);
+        temp[sizeof(temp) - 1] = 0;
+    }
+
+    // virtual paths only use backslashes
+    for (i = 0; temp[i] != 0; i++) {
+        if (temp[i] == '/')
+            temp[i] = '\\';
     }
 
     // Write default values
@@ -303,36 +325,35 @@ int read_material(struct material *material) {
 
     current_target = temp;
 
-    strcpy(rapified_path, actual_path);
-    strcat(rapified_path, ".armake.bin"); // it is assumed that this doesn't exist
-
     // Rapify file
-    if (rapify_file(actual_path, rapified_path)) {
+    membuffer_init(&rapified);
+    if (rapify_to_buffer(actual_path, &rapified)) {
         lwarningf(current_target, -1, "Failed to rapify %s.\n", actual_path);
+        membuffer_free(&rapified);
         return 2;
     }
 
     current_target = material->path;
 
-    // Open rapified file
-    f = fopen(rapified_path, "rb");
-    if (!f) {
-        lwarningf(current_target, -1, "Failed to open rapified material.\n");
+    config = config_index_init(rapified.data, rapified.length);
+    if (config == NULL) {
+        lwarningf(current_target, -1, "Failed to read rapified material.\n");
+        membuffer_free(&rapified);
         return 3;
     }
 
     // Read colors
-    read_float_array(f, "emmisive", (float *)&material->emissive, 4); // "Did you mean: emissive?"
-    read_float_array(f, "ambient", (float *)&material->ambient, 4);
-    read_float_array(f, "diffuse", (float *)&material->diffuse, 4);
-    read_float_array(f, "forcedDiffuse", (float *)&material->forced_diffuse, 4);
-    read_float_array(f, "specular", (float *)&material->specular, 4);
+    read_float_array(config, "emmisive", (float *)&material->emissive, 4); // "Did you mean: emissive?"
+    read_float_array(config, "ambient", (float *)&material->ambient, 4);
+    read_float_array(config, "diffuse", (float *)&material->diffuse, 4);
+    read_float_array(config, "forcedDiffuse", (float *)&material->forced_diffuse, 4);
+    read_float_array(config, "specular", (float *)&material->specular, 4);
     material->specular2 = material->specular;
 
-    read_float(f, "specularPower", &material->specular_power);
+    read_float(config, "specularPower", &material->specular_power);
 
     // Read shaders
-    if (!read_string(f, "PixelShaderID", shader, sizeof(shader))) {
+    if (!read_string(config, "PixelShaderID", shader, sizeof(shader))) {
         for (i = 0; i < sizeof(pixelshaders) / sizeof(struct shader_ref); i++) {
             if (stricmp((char *)pixelshaders[i].name, shader) == 0)
                 break;
@@ -344,7 +365,7 @@ int read_material(struct material *material) {
         material->pixelshader_id = pixelshaders[i].id;
     }
 
-    if (!read_string(f, "VertexShaderID", shader, sizeof(shader))) {
+    if (!read_string(config, "VertexShaderID", shader, sizeof(shader))) {
         for (i = 0; i < sizeof(vertexshaders) / sizeof(struct shader_ref); i++) {
             if (stricmp((char *)vertexshaders[i].name, shader) == 0)
                 break;
@@ -359,7 +380,7 @@ int read_material(struct material *material) {
     // Read stages
     for (i = 1; i < MAXSTAGES; i++) {
         snprintf(config_path, sizeof(config_path), "Stage%i >> texture", i);
-        if (read_string(f, config_path, temp, sizeof(temp)))
+        if (read_string(config, config_path, temp, sizeof(temp)))
             break;
         material->num_textures++;
         material->num_transforms++;
@@ -375,7 +396,7 @@ int read_material(struct material *material) {
             material->textures[i].path[0] = 0;
         } else {
             snprintf(config_path, sizeof(config_path), "Stage%i >> texture", i);
-            read_string(f, config_path, material->textures[i].path, sizeof(material->textures[i].path));
+            read_string(config, config_path, material->textures[i].path, sizeof(material->textures[i].path));
         }
 
         material->textures[i].texture_filter = 3;
@@ -388,27 +409,182 @@ int read_material(struct material *material) {
 
         if (i != 0) {
             snprintf(config_path, sizeof(config_path), "Stage%i >> uvTransform >> aside", i + 1);
-            read_float_array(f, config_path, material->transforms[i].transform[0], 4);
+            read_float_array(config, config_path, material->transforms[i].transform[0], 4);
 
             snprintf(config_path, sizeof(config_path), "Stage%i >> uvTransform >> up", i + 1);
-            read_float_array(f, config_path, material->transforms[i].transform[1], 4);
+            read_float_array(config, config_path, material->transforms[i].transform[1], 4);
 
             snprintf(config_path, sizeof(config_path), "Stage%i >> uvTransform >> dir", i + 1);
-            read_float_array(f, config_path, material->transforms[i].transform[2], 4);
+            read_float_array(config, config_path, material->transforms[i].transform[2], 4);
 
             snprintf(config_path, sizeof(config_path), "Stage%i >> uvTransform >> pos", i + 1);
-            read_float_array(f, config_path, material->transforms[i].transform[3], 4);
+            read_float_array(config, config_path, material->transforms[i].transform[3], 4);
         }
     }
 
-    read_string(f, "StageTI >> texture", material->dummy_texture.path, sizeof(material->dummy_texture.path));
+    read_string(config, "StageTI >> texture", material->dummy_texture.path, sizeof(material->dummy_texture.path));
 
     // Clean up
-    fclose(f);
-    if (remove_file(rapified_path)) {
-        lwarningf(current_target, -1, "Failed to remove temporary material.\n");
-        return 4;
+    config_index_free(config);
+    membuffer_free(&rapified);
+
+    return 0;
+}
+
+
+void copy_material(struct material *target, struct material *source) {
+    /*
+     * Copies everything but the path, which is kept as it was referenced.
+     */
+
+    char path[2048];
+
+    strcpy(path, target->path);
+    *target = *source;
+    strcpy(target->path, path);
+
+    target->textures = (struct stage_texture *)safe_malloc(sizeof(struct stage_texture) * source->num_textures);
+    memcpy(target->textures, source->textures, sizeof(struct stage_texture) * source->num_textures);
+    target->transforms = (struct stage_transform *)safe_malloc(sizeof(struct stage_transform) * source->num_transforms);
+    memcpy(target->transforms, source->transforms, sizeof(struct stage_transform) * source->num_transforms);
+}
+
+
+struct cached_material *find_cached_material(char *path) {
+    /*
+     * Returns the slot for the given path in the material cache. Needs to be
+     * called with the material cache lock held.
+     */
+
+    uint32_t i;
+
+    i = hash_string(path, strlen(path)) & (size_cached_materials - 1);
+    while (cached_materials[i].path != NULL && strcmp(cached_materials[i].path, path) != 0)
+        i = (i + 1) & (size_cached_materials - 1);
+
+    return &cached_materials[i];
+}
+
+
+void add_cached_material(char *path, char *real_path, struct material *material,
+        struct dependencies *dependencies) {
+    /*
+     * Adds a copy of the material to the cache, taking ownership of the
+     * dependency list. If another thread was faster or the path is already
+     * taken by another file, the list is freed.
+     */
+
+    struct cached_material *old_materials;
+    struct cached_material *slot;
+    int old_size;
+    int i;
+
+    pthread_mutex_lock(&material_cache_lock);
+
+    if ((num_cached_materials + 1) * 4 > size_cached_materials * 3) {
+        old_materials = cached_materials;
+        old_size = size_cached_materials;
+
+        size_cached_materials = (old_size == 0) ? 64 : old_size * 2;
+        cached_materials = (struct cached_material *)safe_malloc(sizeof(struct cached_material) * size_cached_materials);
+        for (i = 0; i < size_cached_materials; i++)
+            cached_materials[i].path = NULL;
+
+        for (i = 0; i < old_size; i++) {
+            if (old_materials[i].path != NULL)
+                *find_cached_material(old_materials[i].path) = old_materials[i];
+        }
+        free(old_materials);
+    }
+
+    slot = find_cached_material(path);
+    if (slot->path == NULL) {
+        slot->path = safe_strdup(path);
+        slot->real_path = safe_strdup(real_path);
+        slot->material = (struct material *)safe_malloc(sizeof(struct material));
+        slot->material->path[0] = 0;
+        copy_material(slot->material, material);
+        slot->dependencies = *dependencies;
+        num_cached_materials++;
+        pthread_mutex_unlock(&material_cache_lock);
+        return;
+    }
+
+    pthread_mutex_unlock(&material_cache_lock);
+
+    free_dependencies(dependencies);
+}
+
+
+int read_material(struct material *material) {
+    /*
+     * Reads the material information for the given material struct.
+     * Returns 0 on success and a positive integer on failure.
+     *
+     * Materials are cached for the rest of the run by their virtual path
+     * (case-insensitive, with either kind of slash), so each rvmat is only
+     * parsed once no matter how many LODs and models use it. The path is
+     * still located every time, and the cached material is only used if it
+     * was read from the same file, so whether a spelling is found doesn't
+     * depend on the order materials are read in. Files the material was
+     * read from are still added as dependencies of every model using it.
+     */
+
+    struct dependencies *previous_dependencies;
+    struct dependencies dependencies;
+    struct cached_material *cached;
+    char path[2048];
+    char virtual_path[2048];
+    char real_path[2048];
+    char *ptr;
+    int success;
+
+    // Same path that is looked up in read_material_file
+    if (material->path[0] != '\\' && material->path[0] != '/') {
+        strcpy(virtual_path, "\\");
+        strncat(virtual_path, material->path, sizeof(virtual_path) - 2);
+    } else {
+        strncpy(virtual_path, material->path, sizeof(virtual_path) - 1);
+        virtual_path[sizeof(virtual_path) - 1] = 0;
+    }
+
+    for (ptr = virtual_path; *ptr != 0; ptr++) {
+        if (*ptr == '/')
+            *ptr = '\\';
     }
 
+    // Failures are left to read_material_file to report
+    if (find_file(virtual_path, "", real_path))
+        return read_material_file(material);
+
+    strcpy(path, virtual_path);
+    lower_case(path);
+
+    pthread_mutex_lock(&material_cache_lock);
+    if (size_cached_materials > 0) {
+        cached = find_cached_material(path);
+        if (cached->path != NULL && strcmp(cached->real_path, real_path) == 0) {
+            copy_material(material, cached->material);
+            add_dependencies(&cached->dependencies);
+            pthread_mutex_unlock(&material_cache_lock);
+            return 0;
+        }
+    }
+    pthread_mutex_unlock(&material_cache_lock);
+
+    // Collect the dependencies of the material on their own so they can be replayed later
+    previous_dependencies = collect_dependencies(&dependencies);
+    success = read_material_file(material);
+    restore_dependencies(previous_dependencies);
+
+    add_dependencies(&dependencies);
+
+    if (success) {
+        free_dependencies(&dependencies);
+        return success;
+    }
+
+    add_cached_material(path, real_path, material, &dependencies);
+
     return 0;
 }
@@ -0,0 +1,376 @@
+/*
+ * Copyright (C)  2016  Felix "KoffeinFlummi" Wiegand
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <math.h>
+
+#include "utils.h"
+#include "vector.h"
+#include "matrix.h"
+#include "material.h"
+#include "model_config.h"
+#include "p3d.h"
+#include "meshopt.h"
+
+
+float get_acmr(struct odol_lod *odol_lod) {
+    /*
+     * Returns the average cache miss ratio (transformed vertices per
+     * triangle) of the LOD's faces in their current order, simulating a
+     * FIFO post-transform cache. Quads count as two triangles.
+     */
+
+    uint32_t fifo[VERTEXFIFOSIZE];
+    uint32_t num_fifo;
+    uint32_t next_fifo;
+    uint32_t misses;
+    uint32_t triangles;
+    uint32_t i;
+    uint32_t j;
+    uint32_t k;
+    uint32_t v;
+
+    num_fifo = 0;
+    next_fifo = 0;
+    misses = 0;
+    triangles = 0;
+
+    for (i = 0; i < odol_lod->num_faces; i++) {
+        for (j = 0; j < odol_lod->faces[i].face_type; j++) {
+            v = odol_lod->faces[i].table[j];
+
+            for (k = 0; k < num_fifo; k++) {
+                if (fifo[k] == v)
+                    break;
+            }
+            if (k < num_fifo)
+                continue;
+
+            misses++;
+            fifo[next_fifo] = v;
+            next_fifo = (next_fifo + 1) % VERTEXFIFOSIZE;
+            num_fifo = MIN(num_fifo + 1, VERTEXFIFOSIZE);
+        }
+
+        triangles += odol_lod->faces[i].face_type - 2;
+    }
+
+    if (triangles == 0)
+        return 0.0f;
+
+    return misses / (float)triangles;
+}
+
+
+float vertex_score(int32_t cache_position, uint32_t remaining) {
+    /*
+     * Vertex score as described by Tom Forsyth in "Linear-Speed Vertex
+     * Cache Optimisation": vertices that are in the cache score higher,
+     * the most recent ones a bit less so to avoid long strips, and vertices
+     * with few remaining faces get a boost so they are finished off.
+     */
+
+    float score;
+
+    if (remaining == 0)
+        return -1.0f;
+
+    if (cache_position < 0)
+        score = 0.0f;
+    else if (cache_position < 3)
+        score = 0.75f;
+    else
+        score = powf(1.0f - (cache_position - 3) / (float)(VERTEXCACHESIZE - 3), 1.5f);
+
+    return score + 2.0f * powf((float)remaining, -0.5f);
+}
+
+
+void optimize_section(struct odol_lod *odol_lod, uint32_t face_start, uint32_t face_end, uint32_t *local_index) {
+    /*
+     * Reorders the faces in the given range for the vertex cache. local_index
+     * has to map all vertices to NOPOINT and is left that way.
+     */
+
+    struct odol_face *faces;
+    struct odol_face *faces_tmp;
+    uint32_t *face_lookup_tmp;
+    uint32_t *vertices;
+    uint32_t *remaining;
+    uint32_t *adjacency_start;
+    uint32_t *adjacency;
+    uint32_t *order;
+    int32_t *cache_position;
+    float *vertex_scores;
+    bool *emitted;
+    uint32_t cache[VERTEXCACHESIZE + 4];
+    uint32_t new_cache[VERTEXCACHESIZE + 4];
+    uint32_t num_cache;
+    uint32_t num_new_cache;
+    uint32_t num_faces;
+    uint32_t num_vertices;
+    uint32_t next_face;
+    uint32_t best_face;
+    uint32_t face;
+    uint32_t v;
+    uint32_t i;
+    uint32_t j;
+    uint32_t k;
+    uint32_t l;
+    float best_score;
+    float score;
+
+    num_faces = face_end - face_start;
+    if (num_faces < 2)
+        return;
+
+    faces = odol_lod->faces + face_start;
+
+    // Number the vertices used by this section
+    vertices = (uint32_t *)safe_malloc(sizeof(uint32_t) * num_faces * 4);
+    num_vertices = 0;
+    for (i = 0; i < num_faces; i++) {
+        for (j = 0; j < faces[i].face_type; j++) {
+            if (local_index[faces[i].table[j]] != NOPOINT)
+                continue;
+            local_index[faces[i].table[j]] = num_vertices;
+            vertices[num_vertices++] = faces[i].table[j];
+        }
+    }
+
+    // Build the list of faces for every vertex
+    remaining = (uint32_t *)safe_malloc(sizeof(uint32_t) * num_vertices);
+    adjacency_start = (uint32_t *)safe_malloc(sizeof(uint32_t) * (num_vertices + 1));
+    memset(remaining, 0, sizeof(uint32_t) * num_vertices);
+
+    for (i = 0; i < num_faces; i++) {
+        for (j = 0; j < faces[i].face_type; j++)
+            remaining[local_index[faces[i].table[j]]]++;
+    }
+
+    adjacency_start[0] = 0;
+    for (i = 0; i < num_vertices; i++)
+        adjacency_start[i + 1] = adjacency_start[i] + remaining[i];
+
+    adjacency = (uint32_t *)safe_malloc(sizeof(uint32_t) * MAX(adjacency_start[num_vertices], 1));
+    memset(remaining, 0, sizeof(uint32_t) * num_vertices);
+    for (i = 0; i < num_faces; i++) {
+        for (j = 0; j < faces[i].face_type; j++) {
+            v = local_index[faces[i].table[j]];
+            adjacency[adjacency_start[v] + remaining[v]++] = i;
+        }
+    }
+
+    // Faces are scored by the sum of their vertex scores
+    cache_position = (int32_t *)safe_malloc(sizeof(int32_t) * num_vertices);
+    vertex_scores = (float *)safe_malloc(sizeof(float) * num_vertices);
+    for (i = 0; i < num_vertices; i++) {
+        cache_position[i] = -1;
+        vertex_scores[i] = vertex_score(-1, remaining[i]);
+    }
+
+    emitted = (bool *)safe_malloc(sizeof(bool) * num_faces);
+    order = (uint32_t *)safe_malloc(sizeof(uint32_t) * num_faces);
+    for (i = 0; i < num_faces; i++)
+        emitted[i] = false;
+
+    num_cache = 0;
+    next_face = 0;
+    best_face = NOPOINT;
+
+    for (i = 0; i < num_faces; i++) {
+        // Nothing in the cache is of use, continue with the next face in the original order
+        if (best_face == NOPOINT) {
+            while (emitted[next_face])
+                next_face++;
+            best_face = next_face;
+        }
+
+        face = best_face;
+        order[i] = face;
+        emitted[face] = true;
+
+        // Remove the face from its vertices
+        for (j = 0; j < faces[face].face_type; j++) {
+            v = local_index[faces[face].table[j]];
+            for (k = adjacency_start[v]; k < adjacency_start[v] + remaining[v]; k++) {
+                if (adjacency[k] == face)
+                    break;
+            }
+            adjacency[k] = adjacency[adjacency_start[v] + remaining[v] - 1];
+            remaining[v]--;
+        }
+
+        // The vertices of the face move to the front of the cache
+        num_new_cache = 0;
+        for (j = 0; j < faces[face].face_type; j++)
+            new_cache[num_new_cache++] = local_index[faces[face].table[j]];
+        for (j = 0; j < num_cache; j++) {
+            for (k = 0; k < faces[face].face_type; k++) {
+                if (local_index[faces[face].table[k]] == cache[j])
+                    break;
+            }
+            if (k == faces[face].face_type)
+                new_cache[num_new_cache++] = cache[j];
+        }
+
+        for (j = 0; j < num_new_cache; j++) {
+            v = new_cache[j];
+            cache_position[v] = (j < VERTEXCACHESIZE) ? j : -1;
+            vertex_scores[v] = vertex_score(cache_position[v], remaining[v]);
+        }
+
+        num_cache = MIN(num_new_cache, VERTEXCACHESIZE);
+        memcpy(cache, new_cache, sizeof(uint32_t) * num_cache);
+
+        // Rescore the faces affected by the change and pick the best one
+        best_face = NOPOINT;
+        best_score = -1.0f;
+        for (j = 0; j < num_new_cache; j++) {
+            v = new_cache[j];
+            for (k = adjacency_start[v]; k < adjacency_start[v] + remaining[v]; k++) {
+                score = 0.0f;
+                for (l = 0; l < faces[adjacency[k]].face_type; l++)
+                    score += vertex_scores[local_index[faces[adjacency[k]].table[l]]];
+
+                if (score > best_score) {
+                    best_score = score;
+                    best_face = adjacency[k];
+                }
+            }
+        }
+    }
+
+    // Apply the new order
+    faces_tmp = (struct odol_face *)safe_malloc(sizeof(struct odol_face) * num_faces);
+    face_lookup_tmp = (uint32_t *)safe_malloc(sizeof(uint32_t) * num_faces);
+    memcpy(faces_tmp, faces, sizeof(struct odol_face) * num_faces);
+    memcpy(face_lookup_tmp, odol_lod->face_lookup + face_start, sizeof(uint32_t) * num_faces);
+
+    for (i = 0; i < num_faces; i++) {
+        faces[i] = faces_tmp[order[i]];
+        odol_lod->face_lookup[face_start + i] = face_lookup_tmp[order[i]];
+    }
+
+    for (i = 0; i < num_vertices; i++)
+        local_index[vertices[i]] = NOPOINT;
+
+    free(faces_tmp);
+    free(face_lookup_tmp);
+    free(vertices);
+    free(remaining);
+    free(adjacency_start);
+    free(adjacency);
+    free(order);
+    free(cache_position);
+    free(vertex_scores);
+    free(emitted);
+}
+
+
+void optimize_vertex_cache(struct odol_lod *odol_lod) {
+    /*
+     * Reorders the faces within each section so that vertices are reused
+     * while they are still in the post-transform cache. Faces never move
+     * between sections, so the section table stays valid.
+     */
+
+    uint32_t *local_index;
+    uint32_t i;
+
+    local_index = (uint32_t *)safe_malloc(sizeof(uint32_t) * MAX(odol_lod->num_points, 1));
+    for (i = 0; i < odol_lod->num_points; i++)
+        local_index[i] = NOPOINT;
+
+    for (i = 0; i < odol_lod->num_sections; i++)
+        optimize_section(odol_lod, odol_lod->sections[i].face_start, odol_lod->sections[i].face_end, local_index);
+
+    free(local_index);
+}
+
+
+void permute_array(void *array, size_t size, uint32_t *remap, uint32_t num) {
+    char *temp;
+    uint32_t i;
+
+    temp = (char *)safe_malloc(size * MAX(num, 1));
+    for (i = 0; i < num; i++)
+        memcpy(temp + remap[i] * size, (char *)array + i * size, size);
+    memcpy(array, temp, size * num);
+
+    free(temp);
+}
+
+
+void optimize_vertex_fetch(struct odol_lod *odol_lod) {
+    /*
+     * Renumbers the vertices in the order they are first used by the
+     * faces, so vertex fetches walk through memory linearly. Vertices that
+     * aren't used by any face are kept at the end.
+     */
+
+    uint32_t *remap;
+    uint32_t next;
+    uint32_t i;
+    uint32_t j;
+
+    remap = (uint32_t *)safe_malloc(sizeof(uint32_t) * MAX(odol_lod->num_points, 1));
+    for (i = 0; i < odol_lod->num_points; i++)
+        remap[i] = NOPOINT;
+
+    next = 0;
+    for (i = 0; i < odol_lod->num_faces; i++) {
+        for (j = 0; j < odol_lod->faces[i].face_type; j++) {
+            if (remap[odol_lod->faces[i].table[j]] == NOPOINT)
+                remap[odol_lod->faces[i].table[j]] = next++;
+            odol_lod->faces[i].table[j] = remap[odol_lod->faces[i].table[j]];
+        }
+    }
+
+    for (i = 0; i < odol_lod->num_points; i++) {
+        if (remap[i] == NOPOINT)
+            remap[i] = next++;
+    }
+
+    permute_array(odol_lod->points, sizeof(struct triplet), remap, odol_lod->num_points);
+    permute_array(odol_lod->normals, sizeof(struct triplet), remap, odol_lod->num_points);
+    permute_array(odol_lod->uv_coords, sizeof(struct uv_pair), remap, odol_lod->num_points);
+    permute_array(odol_lod->vertex_to_point, sizeof(uint32_t), remap, odol_lod->num_points);
+    permute_array(odol_lod->vertex_next, sizeof(uint32_t), remap, odol_lod->num_points);
+    if (odol_lod->vertexboneref != 0)
+        permute_array(odol_lod->vertexboneref, sizeof(struct odol_vertexboneref), remap, odol_lod->num_points);
+
+    for (i = 0; i < odol_lod->num_points; i++) {
+        if (odol_lod->vertex_next[i] != NOPOINT)
+            odol_lod->vertex_next[i] = remap[odol_lod->vertex_next[i]];
+    }
+
+    for (i = 0; i < odol_lod->num_points_mlod; i++) {
+        if (odol_lod->point_to_vertex[i] != NOPOINT)
+            odol_lod->point_to_vertex[i] = remap[odol_lod->point_to_vertex[i]];
+        if (odol_lod->point_first_vertex[i] != NOPOINT)
+            odol_lod->point_first_vertex[i] = remap[odol_lod->point_first_vertex[i]];
+    }
+
+    free(remap);
+}
@@ -23,7 +23,9 @@
 #include <string.h>
 #include <unistd.h>
 #include <math.h>
+#include <pthread.h>
 
+#include "cache.h"
 #include "filesystem.h"
 #include "rapify.h"
 #include "utils.h"
@@ -31,7 +33,20 @@
 #include "model_config.h"
 
 
-int read_animations(FILE *f, char *config_path, struct skeleton *skeleton) {
+struct cached_model_config {
+    char *path;
+    struct membuffer rapified;
+    struct config_index *config;
+    struct dependencies dependencies;
+};
+
+pthread_mutex_t model_config_cache_lock = PTHREAD_MUTEX_INITIALIZER;
+struct cached_model_config *cached_model_configs;
+int num_cached_model_configs;
+int size_cached_model_configs;
+
+
+int read_animations(struct config_index *config, char *config_path, struct skeleton *skeleton) {
     /*
      * Reads the animation subclasses of the given config path into the struct
      * array.
@@ -50,16 +65,12 @@ int read_animations(FILE *f, char *config_path, struct skeleton *skeleton) {
     char value[2048];
 
     // Run the function for the parent class first
-    fseek(f, 16, SEEK_SET);
-    success = seek_config_path(f, config_path);
-    if (success > 0) {
-        return success;
-    } else if (success == 0) {
-        success = find_parent(f, config_path, parent, sizeof(parent));
+    if (find_config_entry(config, config_path) != NULL) {
+        success = find_parent(config, config_path, parent, sizeof(parent));
         if (success > 0) {
             return 2;
         } else if (success == 0) {
-            success = read_animations(f, parent, skeleton);
+            success = read_animations(config, parent, skeleton);
             if (success > 0)
                 return success;
         }
@@ -68,19 +79,17 @@ int read_animations(FILE *f, char *config_path, struct skeleton *skeleton) {
     // Check parent CfgModels entry
     strcpy(containing, config_path);
     *(strrchr(containing, '>') - 2) = 0;
-    success = find_parent(f, containing, parent, sizeof(parent));
+    success = find_parent(config, containing, parent, sizeof(parent));
     if (success > 0) {
         return 2;
     } else if (success == 0) {
         strcat(parent, " >> Animations");
-        success = read_animations(f, parent, skeleton);
+        success = read_animations(config, parent, skeleton);
         if (success > 0)
             return success;
     }
 
-    fseek(f, 16, SEEK_SET);
-    success = seek_config_path(f, config_path);
-    if (success < 0)
+    if (find_config_entry(config, config_path) == NULL)
         return -1;
 
     // Now go through all the animations
@@ -88,7 +97,7 @@ int read_animations(FILE *f, char *config_path, struct skeleton *skeleton) {
     for (i = 0; i < MAXANIMS; i++)
         anim_names[i][0] = 0;
 
-    success = read_classes(f, config_path, (char *)anim_names, MAXANIMS, 512);
+    success = read_classes(config, config_path, (char *)anim_names, MAXANIMS, 512);
     if (success)
         return success;
 
@@ -118,7 +127,7 @@ int read_animations(FILE *f, char *config_path, struct skeleton *skeleton) {
 
         // Read anim type
         sprintf(value_path, "%s >> %s >> type", config_path, anim_names[i]);
-        if (read_string(f, value_path, value, sizeof(value))) {
+        if (read_string(config, value_path, value, sizeof(value))) {
             lwarningf(current_target, -1, "Animation type for %s could not be found.\n", anim_names[i]);
             continue;
         }
@@ -175,67 +184,67 @@ int read_animations(FILE *f, char *config_path, struct skeleton *skeleton) {
 #define ERROR_READING(key) lwarningf(current_target, -1, "Error reading %s for %s.\n", key, anim_names[i]);
 
         sprintf(value_path, "%s >> %s >> source", config_path, anim_names[i]);
-        if (read_string(f, value_path, skeleton->animations[j].source, sizeof(skeleton->animations[j].source)) > 0)
+        if (read_string(config, value_path, skeleton->animations[j].source, sizeof(skeleton->animations[j].source)) > 0)
             ERROR_READING("source")
 
         sprintf(value_path, "%s >> %s >> selection", config_path, anim_names[i]);
-        if (read_string(f, value_path, skeleton->animations[j].selection, sizeof(skeleton->animations[j].selection)) > 0)
+        if (read_string(config, value_path, skeleton->animations[j].selection, sizeof(skeleton->animations[j].selection)) > 0)
             ERROR_READING("selection")
 
         sprintf(value_path, "%s >> %s >> axis", config_path, anim_names[i]);
-        if (read_string(f, value_path, skeleton->animations[j].axis, sizeof(skeleton->animations[j].axis)) > 0)
+        if (read_string(config, value_path, skeleton->animations[j].axis, sizeof(skeleton->animations[j].axis)) > 0)
             ERROR_READING("axis")
 
         sprintf(value_path, "%s >> %s >> begin", config_path, anim_names[i]);
-        if (read_string(f, value_path, skeleton->animations[j].begin, sizeof(skeleton->animations[j].begin)) > 0)
+        if (read_string(config, value_path, skeleton->animations[j].begin, sizeof(skeleton->animations[j].begin)) > 0)
             ERROR_READING("begin")
 
         sprintf(value_path, "%s >> %s >> end", config_path, anim_names[i]);
-        if (read_string(f, value_path, skeleton->animations[j].end, sizeof(skeleton->animations[j].end)) > 0)
+        if (read_string(config, value_path, skeleton->animations[j].end, sizeof(skeleton->animations[j].end)) > 0)
             ERROR_READING("end")
 
         sprintf(value_path, "%s >> %s >> minValue", config_path, anim_names[i]);
-        if (read_float(f, value_path, &skeleton->animations[j].min_value) > 0)
+        if (read_float(config, value_path, &skeleton->animations[j].min_value) > 0)
             ERROR_READING("minValue")
 
         sprintf(value_path, "%s >> %s >> maxValue", config_path, anim_names[i]);
-        if (read_float(f, value_path, &skeleton->animations[j].max_value) > 0)
+        if (read_float(config, value_path, &skeleton->animations[j].max_value) > 0)
             ERROR_READING("maxValue")
 
         sprintf(value_path, "%s >> %s >> minPhase", config_path, anim_names[i]);
-        if (read_float(f, value_path, &skeleton->animations[j].min_phase) > 0)
+        if (read_float(config, value_path, &skeleton->animations[j].min_phase) > 0)
             ERROR_READING("minPhase")
 
         sprintf(value_path, "%s >> %s >> maxPhase", config_path, anim_names[i]);
-        if (read_float(f, value_path, &skeleton->animations[j].max_phase) > 0)
+        if (read_float(config, value_path, &skeleton->animations[j].max_phase) > 0)
             ERROR_READING("maxPhase")
 
         sprintf(value_path, "%s >> %s >> angle0", config_path, anim_names[i]);
-        if (read_float(f, value_path, &skeleton->animations[j].angle0) > 0)
+        if (read_float(config, value_path, &skeleton->animations[j].angle0) > 0)
             ERROR_READING("angle0")
 
         sprintf(value_path, "%s >> %s >> angle1", config_path, anim_names[i]);
-        if (read_float(f, value_path, &skeleton->animations[j].angle1) > 0)
+        if (read_float(config, value_path, &skeleton->animations[j].angle1) > 0)
             ERROR_READING("angle1")
 
         sprintf(value_path, "%s >> %s >> offset0", config_path, anim_names[i]);
-        if (read_float(f, value_path, &skeleton->animations[j].offset0) > 0)
+        if (read_float(config, value_path, &skeleton->animations[j].offset0) > 0)
             ERROR_READING("offset0")
 
         sprintf(value_path, "%s >> %s >> offset1", config_path, anim_names[i]);
-        if (read_float(f, value_path, &skeleton->animations[j].offset1) > 0)
+        if (read_float(config, value_path, &skeleton->animations[j].offset1) > 0)
             ERROR_READING("offset1")
 
         sprintf(value_path, "%s >> %s >> hideValue", config_path, anim_names[i]);
-        if (read_float(f, value_path, &skeleton->animations[j].hide_value) > 0)
+        if (read_float(config, value_path, &skeleton->animations[j].hide_value) > 0)
             ERROR_READING("hideValue")
 
         sprintf(value_path, "%s >> %s >> unHideValue", config_path, anim_names[i]);
-        if (read_float(f, value_path, &skeleton->animations[j].unhide_value) > 0)
+        if (read_float(config, value_path, &skeleton->animations[j].unhide_value) > 0)
             ERROR_READING("unHideValue")
 
         sprintf(value_path, "%s >> %s >> sourceAddress", config_path, anim_names[i]);
-        success = read_string(f, value_path, value, sizeof(value));
+        success = read_string(config, value_path, value, sizeof(value));
         if (success > 0) {
             ERROR_READING("sourceAddress")
         } else if (success == 0) {
@@ -293,49 +302,21 @@ int sort_bones(struct bone *src, struct bone *tgt, int tgt_index, char *parent)
 }
 
 
-int read_model_config(char *path, struct skeleton *skeleton) {
+int read_model_config_helper(char *path, struct config_index *config, struct skeleton *skeleton) {
     /*
-     * Reads the model config information for the given model path. If no
-     * model config is found, -1 is returned. 0 is returned on success
-     * and a positive integer on failure.
+     * Reads the model config information for the given model path from the
+     * indexed model config. 0 is returned on success and a positive integer
+     * on failure.
      */
 
-    extern char *current_target;
-    FILE *f;
     int i;
     int success;
-    char model_config_path[2048];
-    char rapified_path[2048];
     char config_path[2048];
     char model_name[512];
     char bones[MAXBONES * 2][512] = {};
     char buffer[512];
     struct bone *bones_tmp;
 
-    current_target = path;
-
-    // Extract model.cfg path
-    strncpy(model_config_path, path, sizeof(model_config_path));
-    if (strrchr(model_config_path, PATHSEP) != NULL)
-        strcpy(strrchr(model_config_path, PATHSEP) + 1, "model.cfg");
-    else
-        strcpy(model_config_path, "model.cfg");
-
-    strcpy(rapified_path, model_config_path);
-    strcat(rapified_path, ".armake.bin"); // it is assumed that this doesn't exist
-
-    if (access(model_config_path, F_OK) == -1)
-        return -1;
-
-    // Rapify file
-    success = rapify_file(model_config_path, rapified_path);
-    if (success) {
-        errorf("Failed to rapify model config.\n");
-        return 1;
-    }
-
-    current_target = path;
-
     // Extract model name and convert to lower case
     if (strrchr(path, PATHSEP) != NULL)
         strcpy(model_name, strrchr(path, PATHSEP) + 1);
@@ -345,30 +326,17 @@ int read_model_config(char *path, struct skeleton *skeleton) {
 
     lower_case(model_name);
 
-    // Open rapified file
-    f = fopen(rapified_path, "rb");
-    if (!f) {
-        errorf("Failed to open model config.\n");
-        return 2;
-    }
-
     // Check if model entry even exists
     sprintf(config_path, "CfgModels >> %s", model_name);
-    fseek(f, 16, SEEK_SET);
-    success = seek_config_path(f, config_path);
-    if (success > 0) {
-        errorf("Failed to find model config entry.\n");
-        return success;
-    } else if (success < 0) {
-        goto clean_up;
-    }
+    if (find_config_entry(config, config_path) == NULL)
+        return 0;
 
     if (strchr(model_name, '_') == NULL)
         lnwarningf(path, -1, "model-without-prefix", "Model has a model config entry but doesn't seem to have a prefix (missing _).\n");
 
     // Read name
     sprintf(config_path, "CfgModels >> %s >> skeletonName", model_name);
-    success = read_string(f, config_path, skeleton->name, sizeof(skeleton->name));
+    success = read_string(config, config_path, skeleton->name, sizeof(skeleton->name));
     if (success > 0) {
         errorf("Failed to read skeleton name.\n");
         return success;
@@ -377,7 +345,7 @@ int read_model_config(char *path, struct skeleton *skeleton) {
     // Read bones
     if (strlen(skeleton->name) > 0) {
         sprintf(config_path, "CfgSkeletons >> %s >> skeletonInherit", skeleton->name);
-        success = read_string(f, config_path, buffer, sizeof(buffer));
+        success = read_string(config, config_path, buffer, sizeof(buffer));
         if (success > 0) {
             errorf("Failed to read bones.\n");
             return success;
@@ -385,7 +353,7 @@ int read_model_config(char *path, struct skeleton *skeleton) {
 
         int32_t temp;
         sprintf(config_path, "CfgSkeletons >> %s >> isDiscrete", skeleton->name);
-        success = read_int(f, config_path, &temp);
+        success = read_int(config, config_path, &temp);
         if (success == 0)
             skeleton->is_discrete = (temp > 0);
         else
@@ -394,7 +362,7 @@ int read_model_config(char *path, struct skeleton *skeleton) {
         i = 0;
         if (strlen(buffer) > 0) { // @todo: more than 1 parent
             sprintf(config_path, "CfgSkeletons >> %s >> skeletonBones", buffer);
-            success = read_string_array(f, config_path, (char *)bones, MAXBONES * 2, 512);
+            success = read_string_array(config, config_path, (char *)bones, MAXBONES * 2, 512);
             if (success > 0) {
                 errorf("Failed to read bones.\n");
                 return success;
@@ -407,7 +375,7 @@ int read_model_config(char *path, struct skeleton *skeleton) {
         }
 
         sprintf(config_path, "CfgSkeletons >> %s >> skeletonBones", skeleton->name);
-        success = read_string_array(f, config_path, (char *)bones + i * 512, MAXBONES * 2 - i, 512);
+        success = read_string_array(config, config_path, (char *)bones + i * 512, MAXBONES * 2 - i, 512);
         if (success > 0) {
             errorf("Failed to read bones.\n");
             return success;
@@ -441,7 +409,7 @@ int read_model_config(char *path, struct skeleton *skeleton) {
 
     // Read sections
     sprintf(config_path, "CfgModels >> %s >> sectionsInherit", model_name);
-    success = read_string(f, config_path, buffer, sizeof(buffer));
+    success = read_string(config, config_path, buffer, sizeof(buffer));
     if (success > 0) {
         errorf("Failed to read sections.\n");
         return success;
@@ -450,7 +418,7 @@ int read_model_config(char *path, struct skeleton *skeleton) {
     i = 0;
     if (strlen(buffer) > 0) {
         sprintf(config_path, "CfgModels >> %s >> sections", buffer);
-        success = read_string_array(f, config_path, (char *)skeleton->sections, MAXSECTIONS, 512);
+        success = read_string_array(config, config_path, (char *)skeleton->sections, MAXSECTIONS, 512);
         if (success > 0) {
             errorf("Failed to read sections.\n");
             return success;
@@ -463,7 +431,7 @@ int read_model_config(char *path, struct skeleton *skeleton) {
     }
 
     sprintf(config_path, "CfgModels >> %s >> sections", model_name);
-    success = read_string_array(f, config_path, (char *)skeleton->sections + i * 512, MAXSECTIONS - i, 512);
+    success = read_string_array(config, config_path, (char *)skeleton->sections + i * 512, MAXSECTIONS - i, 512);
     if (success > 0) {
         errorf("Failed to read sections.\n");
         return success;
@@ -475,7 +443,7 @@ int read_model_config(char *path, struct skeleton *skeleton) {
     // Read animations
     skeleton->num_animations = 0;
     sprintf(config_path, "CfgModels >> %s >> Animations", model_name);
-    success = read_animations(f, config_path, skeleton);
+    success = read_animations(config, config_path, skeleton);
     if (success > 0) {
         errorf("Failed to read animations.\n");
         return success;
@@ -486,25 +454,165 @@ int read_model_config(char *path, struct skeleton *skeleton) {
 
     // Read thermal stuff
     sprintf(config_path, "CfgModels >> %s >> htMin", model_name);
-    read_float(f, config_path, &skeleton->ht_min);
+    read_float(config, config_path, &skeleton->ht_min);
     sprintf(config_path, "CfgModels >> %s >> htMax", model_name);
-    read_float(f, config_path, &skeleton->ht_max);
+    read_float(config, config_path, &skeleton->ht_max);
     sprintf(config_path, "CfgModels >> %s >> afMax", model_name);
-    read_float(f, config_path, &skeleton->af_max);
+    read_float(config, config_path, &skeleton->af_max);
     sprintf(config_path, "CfgModels >> %s >> mfMax", model_name);
-    read_float(f, config_path, &skeleton->mf_max);
+    read_float(config, config_path, &skeleton->mf_max);
     sprintf(config_path, "CfgModels >> %s >> mfAct", model_name);
-    read_float(f, config_path, &skeleton->mf_act);
+    read_float(config, config_path, &skeleton->mf_act);
     sprintf(config_path, "CfgModels >> %s >> tBody", model_name);
-    read_float(f, config_path, &skeleton->t_body);
-
-clean_up:
-    // Clean up
-    fclose(f);
-    if (remove_file(rapified_path)) {
-        errorf("Failed to remove temporary model config.\n");
-        return 3;
+    read_float(config, config_path, &skeleton->t_body);
+
+    return 0;
+}
+
+
+struct cached_model_config *find_cached_model_config(char *path) {
+    /*
+     * Returns the slot for the given path in the model config cache. Needs
+     * to be called with the model config cache lock held.
+     */
+
+    uint32_t i;
+
+    i = hash_string(path, strlen(path)) & (size_cached_model_configs - 1);
+    while (cached_model_configs[i].path != NULL && strcmp(cached_model_configs[i].path, path) != 0)
+        i = (i + 1) & (size_cached_model_configs - 1);
+
+    return &cached_model_configs[i];
+}
+
+
+int get_model_config(char *path, struct config_index **config) {
+    /*
+     * Rapifies and indexes the given model config, or returns the one from
+     * an earlier call, since all models in a folder share one model.cfg.
+     * The index is never freed and has to be treated as read-only, as other
+     * threads might be using it too.
+     *
+     * Returns 0 on success and a positive integer on failure.
+     */
+
+    struct cached_model_config *old_configs;
+    struct cached_model_config *slot;
+    struct dependencies *previous_dependencies;
+    struct dependencies dependencies;
+    struct membuffer rapified;
+    int old_size;
+    int i;
+
+    pthread_mutex_lock(&model_config_cache_lock);
+    if (size_cached_model_configs > 0) {
+        slot = find_cached_model_config(path);
+        if (slot->path != NULL) {
+            *config = slot->config;
+            add_dependencies(&slot->dependencies);
+            pthread_mutex_unlock(&model_config_cache_lock);
+            return 0;
+        }
+    }
+    pthread_mutex_unlock(&model_config_cache_lock);
+
+    // Rapify file
+    membuffer_init(&rapified);
+    previous_dependencies = collect_dependencies(&dependencies);
+    i = rapify_to_buffer(path, &rapified);
+    restore_dependencies(previous_dependencies);
+
+    add_dependencies(&dependencies);
+
+    if (i) {
+        errorf("Failed to rapify model config.\n");
+        free_dependencies(&dependencies);
+        membuffer_free(&rapified);
+        return 1;
     }
 
+    *config = config_index_init(rapified.data, rapified.length);
+    if (*config == NULL) {
+        errorf("Failed to read model config.\n");
+        free_dependencies(&dependencies);
+        membuffer_free(&rapified);
+        return 2;
+    }
+
+    pthread_mutex_lock(&model_config_cache_lock);
+
+    if ((num_cached_model_configs + 1) * 4 > size_cached_model_configs * 3) {
+        old_configs = cached_model_configs;
+        old_size = size_cached_model_configs;
+
+        size_cached_model_configs = (old_size == 0) ? 16 : old_size * 2;
+        cached_model_configs = (struct cached_model_config *)safe_malloc(sizeof(struct cached_model_config) * size_cached_model_configs);
+        for (i = 0; i < size_cached_model_configs; i++)
+            cached_model_configs[i].path = NULL;
+
+        for (i = 0; i < old_size; i++) {
+            if (old_configs[i].path != NULL)
+                *find_cached_model_config(old_configs[i].path) = old_configs[i];
+        }
+        free(old_configs);
+    }
+
+    slot = find_cached_model_config(path);
+    if (slot->path == NULL) {
+        slot->path = safe_strdup(path);
+        slot->rapified = rapified;
+        slot->config = *config;
+        slot->dependencies = dependencies;
+        num_cached_model_configs++;
+        pthread_mutex_unlock(&model_config_cache_lock);
+        return 0;
+    }
+
+    // someone else was faster, use theirs
+    config_index_free(*config);
+    *config = slot->config;
+    pthread_mutex_unlock(&model_config_cache_lock);
+
+    free_dependencies(&dependencies);
+    membuffer_free(&rapified);
+
     return 0;
 }
+
+
+int read_model_config(char *path, struct skeleton *skeleton) {
+    /*
+     * Reads the model config information for the given model path. If no
+     * model config is found, -1 is returned. 0 is returned on success
+     * and a positive integer on failure.
+     */
+
+    extern __thread char *current_target;
+    int success;
+    char model_config_path[2048];
+    struct config_index *config;
+
+    current_target = path;
+
+    // Extract model.cfg path
+    strncpy(model_config_path, path, sizeof(model_config_path));
+    if (strrchr(model_config_path, PATHSEP) != NULL)
+        strcpy(strrchr(model_config_path, PATHSEP) + 1, "model.cfg");
+    else
+        strcpy(model_config_path, "model.cfg");
+
+    // a model.cfg appearing later changes the result too
+    add_dependency(model_config_path);
+
+    if (access(model_config_path, F_OK) == -1)
+        return -1;
+
+    success = get_model_config(model_config_path, &config);
+
+    current_target = path;
+
+    if (success)
+        return success;
+
+    return read_model_config_helper(path, config, skeleton);
+}
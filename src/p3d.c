@@ -32,216 +32,370 @@
 #endif
 
 #include "args.h"
+#include "cache.h"
 #include "filesystem.h"
 #include "utils.h"
+#include "jobs.h"
 #include "model_config.h"
 #include "material.h"
 #include "vector.h"
 #include "matrix.h"
 #include "p3d.h"
+#include "meshopt.h"
 
 
-int read_lods(FILE *f_source, struct mlod_lod *mlod_lods, uint32_t num_lods) {
+int mlod_read(char *data, size_t length, size_t *pos, void *target, size_t size) {
     /*
-     * Reads all LODs (starting at the current position of f_source) into
-     * the given LODs array.
+     * Copies size bytes at the given position of the MLOD data into target
+     * and moves the position past them.
+     *
+     * Returns 0 on success and 1 if the data isn't long enough.
+     */
+
+    if (*pos + size > length || *pos + size < *pos)
+        return 1;
+
+    memcpy(target, data + *pos, size);
+    *pos += size;
+
+    return 0;
+}
+
+
+int mlod_read_string(char *data, size_t length, size_t *pos, char *target, size_t buffsize) {
+    /*
+     * Reads the null-terminated string at the given position into target,
+     * truncating it to the buffer size, and moves the position past it.
+     *
+     * Returns 0 on success and 1 if the string isn't terminated inside
+     * the data.
+     */
+
+    char *end;
+    size_t len;
+
+    if (*pos >= length)
+        return 1;
+
+    end = memchr(data + *pos, 0, length - *pos);
+    if (end == NULL)
+        return 1;
+
+    len = end - (data + *pos);
+    if (target != NULL) {
+        strncpy(target, data + *pos, MIN(len, buffsize - 1));
+        target[MIN(len, buffsize - 1)] = 0;
+    }
+
+    *pos += len + 1;
+
+    return 0;
+}
+
+
+void free_lods(struct mlod_lod *mlod_lods, uint32_t num_lods) {
+    /*
+     * Frees everything that read_lods allocated for the given LODs, but not
+     * the array itself.
+     */
+
+    int i;
+    int j;
+
+    for (i = 0; i < num_lods; i++) {
+        free(mlod_lods[i].points);
+        free(mlod_lods[i].facenormals);
+        free(mlod_lods[i].faces);
+        free(mlod_lods[i].mass);
+        free(mlod_lods[i].sharp_edges);
+
+        for (j = 0; j < mlod_lods[i].num_selections; j++) {
+            free(mlod_lods[i].selections[j].points);
+            free(mlod_lods[i].selections[j].faces);
+        }
+
+        free(mlod_lods[i].selections);
+
+        arena_free(mlod_lods[i].strings);
+    }
+}
+
+
+int read_lods(char *data, size_t length, struct mlod_lod *mlod_lods, uint32_t num_lods) {
+    /*
+     * Reads all LODs of the given MLOD data into the given LODs array.
+     * Edit LODs are skipped.
      *
      * Returns number of read lods on success and a negative integer on
      * failure.
      */
 
-    char buffer[256];
+    char buffer[512];
     int i;
     int j;
-    int fp_tmp;
-    int fp_taggs;
+    int success;
+    size_t pos;
+    size_t fp_tmp;
+    size_t fp_taggs;
     bool empty;
     uint32_t tagg_len;
+    uint32_t num_selections;
+    struct mlod_lod *lod;
 
-    fseek(f_source, 0, SEEK_SET);
+#define MLOD_READ(target, size) if (mlod_read(data, length, &pos, (target), (size))) { success = -2; goto error; }
+#define MLOD_READ_STRING(target, size) if (mlod_read_string(data, length, &pos, (target), (size))) { success = -2; goto error; }
+
+    if (length < 12)
+        return -1;
 
-    fread(buffer, 4, 1, f_source);
+    memcpy(buffer, data, 4);
     buffer[4] = 0;
     if (stricmp(buffer, "MLOD"))
         return -1;
 
-    fseek(f_source, 12, SEEK_SET);
+    pos = 12;
 
     for (i = 0; i < num_lods; i++) {
-        fread(buffer, 4, 1, f_source);
-        if (strncmp(buffer, "P3DM", 4) != 0)
-            return -1;
+        lod = &mlod_lods[i];
+
+        lod->points = 0;
+        lod->facenormals = 0;
+        lod->faces = 0;
+        lod->mass = 0;
+        lod->num_sharp_edges = 0;
+        lod->sharp_edges = 0;
+        lod->num_selections = 0;
+        lod->selections = 0;
+        lod->strings = arena_init();
+
+        if (pos + 4 > length || strncmp(data + pos, "P3DM", 4) != 0) {
+            success = -1;
+            goto error;
+        }
 
-        fseek(f_source, 8, SEEK_CUR);
-        fread(&mlod_lods[i].num_points, 4, 1, f_source);
-        fread(&mlod_lods[i].num_facenormals, 4, 1, f_source);
-        fread(&mlod_lods[i].num_faces, 4, 1, f_source);
-        fseek(f_source, 4, SEEK_CUR);
+        pos += 12;
+        MLOD_READ(&lod->num_points, 4);
+        MLOD_READ(&lod->num_facenormals, 4);
+        MLOD_READ(&lod->num_faces, 4);
+        pos += 4;
+
+        // make sure the counts are sane before allocating anything
+        if ((uint64_t)lod->num_points * sizeof(struct point) > length ||
+                (uint64_t)lod->num_facenormals * sizeof(struct triplet) > length ||
+                (uint64_t)lod->num_faces * 72 > length) {
+            success = -2;
+            goto error;
+        }
 
-        empty = mlod_lods[i].num_points == 0;
+        empty = lod->num_points == 0;
 
         if (empty) {
-            mlod_lods[i].num_points = 1;
-            mlod_lods[i].points = (struct point *)safe_malloc(sizeof(struct point));
-            mlod_lods[i].points[0].x = 0.0f;
-            mlod_lods[i].points[0].y = 0.0f;
-            mlod_lods[i].points[0].z = 0.0f;
-            mlod_lods[i].points[0].point_flags = 0;
+            lod->num_points = 1;
+            lod->points = (struct point *)safe_malloc(sizeof(struct point));
+            lod->points[0].x = 0.0f;
+            lod->points[0].y = 0.0f;
+            lod->points[0].z = 0.0f;
+            lod->points[0].point_flags = 0;
         } else {
-            mlod_lods[i].points = (struct point *)safe_malloc(sizeof(struct point) * mlod_lods[i].num_points);
-            for (j = 0; j < mlod_lods[i].num_points; j++)
-                fread(&mlod_lods[i].points[j], sizeof(struct point), 1, f_source);
+            lod->points = (struct point *)safe_malloc(sizeof(struct point) * lod->num_points);
+            MLOD_READ(lod->points, sizeof(struct point) * lod->num_points);
         }
 
-        mlod_lods[i].facenormals = (struct triplet *)safe_malloc(sizeof(struct triplet) * mlod_lods[i].num_facenormals);
-        for (j = 0; j < mlod_lods[i].num_facenormals; j++)
-            fread(&mlod_lods[i].facenormals[j], sizeof(struct triplet), 1, f_source);
-
-        mlod_lods[i].faces = (struct mlod_face *)safe_malloc(sizeof(struct mlod_face) * mlod_lods[i].num_faces);
-        for (j = 0; j < mlod_lods[i].num_faces; j++) {
-            fread(&mlod_lods[i].faces[j], 72, 1, f_source);
+        lod->facenormals = (struct triplet *)safe_malloc(sizeof(struct triplet) * lod->num_facenormals);
+        MLOD_READ(lod->facenormals, sizeof(struct triplet) * lod->num_facenormals);
 
-            fp_tmp = ftell(f_source);
-            fread(mlod_lods[i].faces[j].texture_name,
-                sizeof(mlod_lods[i].faces[j].texture_name), 1, f_source);
-            fseek(f_source, fp_tmp + strlen(mlod_lods[i].faces[j].texture_name) + 1, SEEK_SET);
+        lod->faces = (struct mlod_face *)safe_malloc(sizeof(struct mlod_face) * lod->num_faces);
+        for (j = 0; j < lod->num_faces; j++) {
+            MLOD_READ(&lod->faces[j], 72);
 
-            fp_tmp = ftell(f_source);
-            fread(mlod_lods[i].faces[j].material_name,
-                sizeof(mlod_lods[i].faces[j].material_name), 1, f_source);
-            fseek(f_source, fp_tmp + strlen(mlod_lods[i].faces[j].material_name) + 1, SEEK_SET);
+            // names repeat a lot, so faces only point into the string table
+            MLOD_READ_STRING(buffer, sizeof(buffer));
+            lod->faces[j].texture_name = arena_intern(lod->strings, buffer);
+            MLOD_READ_STRING(buffer, sizeof(buffer));
+            lod->faces[j].material_name = arena_intern(lod->strings, buffer);
 
-            strcpy(mlod_lods[i].faces[j].section_names, "");
+            lod->faces[j].section_names = arena_intern(lod->strings, "");
         }
 
-        fread(buffer, 4, 1, f_source);
-        if (strncmp(buffer, "TAGG", 4) != 0)
-            return -2;
-
-        mlod_lods[i].mass = 0;
-        mlod_lods[i].num_sharp_edges = 0;
-        mlod_lods[i].sharp_edges = 0;
-        mlod_lods[i].selections = 0;
+        if (pos + 4 > length || strncmp(data + pos, "TAGG", 4) != 0) {
+            success = -2;
+            goto error;
+        }
+        pos += 4;
 
         for (j = 0; j < MAXPROPERTIES; j++) {
-            mlod_lods[i].properties[j].name[0] = 0;
-            mlod_lods[i].properties[j].value[0] = 0;
+            lod->properties[j].name[0] = 0;
+            lod->properties[j].value[0] = 0;
         }
 
-        fp_taggs = ftell(f_source);
+        fp_taggs = pos;
 
         // count selections
-        mlod_lods[i].num_selections = 0;
+        num_selections = 0;
         while (true) {
-            fseek(f_source, 1, SEEK_CUR);
-
-            fp_tmp = ftell(f_source);
-            fread(&buffer, sizeof(buffer), 1, f_source);
-            fseek(f_source, fp_tmp + strlen(buffer) + 1, SEEK_SET);
+            pos++;
+            MLOD_READ_STRING(buffer, sizeof(buffer));
+            MLOD_READ(&tagg_len, 4);
 
-            fread(&tagg_len, 4, 1, f_source);
-            fp_tmp = ftell(f_source) + tagg_len;
+            if (tagg_len > length - pos) {
+                success = -2;
+                goto error;
+            }
+            pos += tagg_len;
 
             if (buffer[0] != '#')
-                mlod_lods[i].num_selections++;
-
-            fseek(f_source, fp_tmp, SEEK_SET);
+                num_selections++;
 
             if (strcmp(buffer, "#EndOfFile#") == 0)
                 break;
         }
 
-        mlod_lods[i].selections = (struct mlod_selection *)safe_malloc(sizeof(struct mlod_selection) * mlod_lods[i].num_selections);
-        for (j = 0; j < mlod_lods[i].num_selections; j++)
-            mlod_lods[i].selections[j].name[0] = 0;
+        lod->num_selections = num_selections;
+        lod->selections = (struct mlod_selection *)safe_malloc(sizeof(struct mlod_selection) * lod->num_selections);
+        for (j = 0; j < lod->num_selections; j++) {
+            lod->selections[j].name = 0;
+            lod->selections[j].points = 0;
+            lod->selections[j].faces = 0;
+        }
 
-        fseek(f_source, fp_taggs, SEEK_SET);
+        pos = fp_taggs;
 
         while (true) {
-            fseek(f_source, 1, SEEK_CUR);
-
-            fp_tmp = ftell(f_source);
-            fread(&buffer, sizeof(buffer), 1, f_source);
-            fseek(f_source, fp_tmp + strlen(buffer) + 1, SEEK_SET);
-
-            fread(&tagg_len, 4, 1, f_source);
-            fp_tmp = ftell(f_source) + tagg_len;
+            pos++;
+            MLOD_READ_STRING(buffer, sizeof(buffer));
+            MLOD_READ(&tagg_len, 4);
+            fp_tmp = pos + tagg_len;
 
             if (buffer[0] != '#') {
-                for (j = 0; j < mlod_lods[i].num_selections; j++) {
-                    if (mlod_lods[i].selections[j].name[0] == 0)
+                for (j = 0; j < lod->num_selections; j++) {
+                    if (lod->selections[j].name == 0)
                         break;
                 }
 
-                strcpy(mlod_lods[i].selections[j].name, buffer);
+                lod->selections[j].name = arena_intern(lod->strings, buffer);
 
                 if (empty) {
-                    mlod_lods[i].selections[j].points = (uint8_t *)safe_malloc(1);
-                    mlod_lods[i].selections[j].points[0] = 0;
+                    lod->selections[j].points = (uint8_t *)safe_malloc(1);
+                    lod->selections[j].points[0] = 0;
                 } else {
-                    mlod_lods[i].selections[j].points = (uint8_t *)safe_malloc(mlod_lods[i].num_points);
-                    fread(mlod_lods[i].selections[j].points, mlod_lods[i].num_points, 1, f_source);
+                    lod->selections[j].points = (uint8_t *)safe_malloc(lod->num_points);
+                    MLOD_READ(lod->selections[j].points, lod->num_points);
                 }
 
-                mlod_lods[i].selections[j].faces = (uint8_t *)safe_malloc(mlod_lods[i].num_faces);
-                fread(mlod_lods[i].selections[j].faces, mlod_lods[i].num_faces, 1, f_source);
+                lod->selections[j].faces = (uint8_t *)safe_malloc(lod->num_faces);
+                MLOD_READ(lod->selections[j].faces, lod->num_faces);
             }
 
             if (strcmp(buffer, "#Mass#") == 0) {
                 if (empty) {
-                    mlod_lods[i].mass = (float *)safe_malloc(sizeof(float));
-                    mlod_lods[i].mass[0] = 0.0f;
+                    lod->mass = (float *)safe_malloc(sizeof(float));
+                    lod->mass[0] = 0.0f;
                 } else {
-                    mlod_lods[i].mass = (float *)safe_malloc(sizeof(float) * mlod_lods[i].num_points);
-                    fread(mlod_lods[i].mass, sizeof(float) * mlod_lods[i].num_points, 1, f_source);
+                    lod->mass = (float *)safe_malloc(sizeof(float) * lod->num_points);
+                    MLOD_READ(lod->mass, sizeof(float) * lod->num_points);
                 }
             }
 
             if (strcmp(buffer, "#SharpEdges#") == 0) {
-                mlod_lods[i].num_sharp_edges = tagg_len / (2 * sizeof(uint32_t));
-                mlod_lods[i].sharp_edges = (uint32_t *)safe_malloc(tagg_len);
-                fread(mlod_lods[i].sharp_edges, tagg_len, 1, f_source);
+                lod->num_sharp_edges = tagg_len / (2 * sizeof(uint32_t));
+                lod->sharp_edges = (uint32_t *)safe_malloc(tagg_len);
+                MLOD_READ(lod->sharp_edges, tagg_len);
             }
 
             if (strcmp(buffer, "#Property#") == 0) {
                 for (j = 0; j < MAXPROPERTIES; j++) {
-                    if (mlod_lods[i].properties[j].name[0] == 0)
+                    if (lod->properties[j].name[0] == 0)
                         break;
                 }
-                if (j == MAXPROPERTIES)
-                    return -3;
+                if (j == MAXPROPERTIES) {
+                    success = -3;
+                    goto error;
+                }
 
-                fread(mlod_lods[i].properties[j].name, 64, 1, f_source);
-                fread(mlod_lods[i].properties[j].value, 64, 1, f_source);
+                MLOD_READ(lod->properties[j].name, 64);
+                MLOD_READ(lod->properties[j].value, 64);
             }
 
-            fseek(f_source, fp_tmp, SEEK_SET);
+            pos = fp_tmp;
 
             if (strcmp(buffer, "#EndOfFile#") == 0)
                 break;
         }
 
-        fread(&mlod_lods[i].resolution, 4, 1, f_source);
-
-        if (mlod_lods[i].resolution >= LOD_EDIT_START && mlod_lods[i].resolution < LOD_EDIT_END) {
-            free(mlod_lods[i].points);
-            free(mlod_lods[i].facenormals);
-            free(mlod_lods[i].faces);
-            free(mlod_lods[i].mass);
-            free(mlod_lods[i].sharp_edges);
-
-            for (j = 0; j < mlod_lods[i].num_selections; j++) {
-                free(mlod_lods[i].selections[j].points);
-                free(mlod_lods[i].selections[j].faces);
-            }
+        MLOD_READ(&lod->resolution, 4);
 
-            free(mlod_lods[i].selections);
+        if (lod->resolution >= LOD_EDIT_START && lod->resolution < LOD_EDIT_END) {
+            free_lods(lod, 1);
 
             i--;
             num_lods--;
         }
     }
 
+    return num_lods;
+
+error:
+    free_lods(mlod_lods, i + 1);
+    return success;
+
+#undef MLOD_READ
+#undef MLOD_READ_STRING
+}
+
+
+int read_mlod(char *source, struct mlod_lod **mlod_lods) {
+    /*
+     * Reads the MLOD P3D at the given path into a newly allocated LODs
+     * array. The whole file is read at once and parsed from memory.
+     *
+     * Returns the number of LODs on success, -1 if the file couldn't be
+     * read, -2 if it isn't an MLOD and -3 if it is malformed.
+     */
+
+    FILE *f_source;
+    char *data;
+    long datasize;
+    int num_lods;
+    uint32_t num_lods_header;
+
+    f_source = fopen(source, "rb");
+    if (!f_source)
+        return -1;
+
+    fseek(f_source, 0, SEEK_END);
+    datasize = ftell(f_source);
+    fseek(f_source, 0, SEEK_SET);
+
+    data = (char *)safe_malloc(MAX(datasize, 1));
+    if (datasize < 0 || fread(data, datasize, 1, f_source) != 1) {
+        fclose(f_source);
+        free(data);
+        return -1;
+    }
+
+    fclose(f_source);
+
+    if (datasize < 12 || strncmp(data, "MLOD", 4) != 0) {
+        free(data);
+        return -2;
+    }
+
+    memcpy(&num_lods_header, data + 8, 4);
+    if ((uint64_t)num_lods_header * 28 > datasize) {
+        free(data);
+        return -3;
+    }
+
+    *mlod_lods = (struct mlod_lod *)safe_malloc(sizeof(struct mlod_lod) * MAX(num_lods_header, 1));
+    num_lods = read_lods(data, datasize, *mlod_lods, num_lods_header);
+
+    free(data);
+
+    if (num_lods < 0) {
+        free(*mlod_lods);
+        return -3;
+    }
+
     return num_lods;
 }
 
@@ -531,16 +685,91 @@ void build_model_info(struct mlod_lod *mlod_lods, uint32_t num_lods, struct mode
 }
 
 
+void build_point_weights(struct mlod_lod *mlod_lod, struct odol_lod *odol_lod, struct model_info *model_info) {
+    /*
+     * Resolves the selection of every bone once and collects the bones each
+     * MLOD point is part of, together with the selection weight. The bones
+     * of point i are point_weights[point_weights_start[i]] up to
+     * point_weights[point_weights_start[i + 1]], in the order add_point
+     * assigns them.
+     */
+
+    int32_t *bone_selections;
+    uint32_t num_bones;
+    uint32_t i;
+    uint32_t j;
+    uint8_t *points;
+
+    num_bones = model_info->skeleton->num_bones;
+    bone_selections = (int32_t *)safe_malloc(sizeof(int32_t) * num_bones);
+
+    for (i = 0; i < num_bones; i++) {
+        for (j = 0; j < mlod_lod->num_selections; j++) {
+            if (stricmp(model_info->skeleton->bones[i].name,
+                    mlod_lod->selections[j].name) == 0)
+                break;
+        }
+
+        bone_selections[i] = (j == mlod_lod->num_selections) ? -1 : j;
+    }
+
+    odol_lod->point_weights_start = (uint32_t *)safe_malloc(sizeof(uint32_t) * (mlod_lod->num_points + 1));
+    memset(odol_lod->point_weights_start, 0, sizeof(uint32_t) * (mlod_lod->num_points + 1));
+
+    // Count the bones of each point
+    for (i = 0; i < num_bones; i++) {
+        if (bone_selections[i] < 0)
+            continue;
+
+        points = mlod_lod->selections[bone_selections[i]].points;
+        for (j = 0; j < mlod_lod->num_points; j++) {
+            if (points[j] != 0)
+                odol_lod->point_weights_start[j + 1]++;
+        }
+    }
+
+    for (j = 0; j < mlod_lod->num_points; j++)
+        odol_lod->point_weights_start[j + 1] += odol_lod->point_weights_start[j];
+
+    odol_lod->point_weights = (struct point_weight *)safe_malloc(sizeof(struct point_weight) *
+        MAX(odol_lod->point_weights_start[mlod_lod->num_points], 1));
+
+    // Fill them in, last bone first; this moves every start to the next point's
+    for (i = num_bones; i-- > 0;) {
+        if (bone_selections[i] < 0)
+            continue;
+
+        points = mlod_lod->selections[bone_selections[i]].points;
+        for (j = 0; j < mlod_lod->num_points; j++) {
+            if (points[j] == 0)
+                continue;
+
+            odol_lod->point_weights[odol_lod->point_weights_start[j]].bone = i;
+            odol_lod->point_weights[odol_lod->point_weights_start[j]].weight = points[j];
+            odol_lod->point_weights_start[j]++;
+        }
+    }
+
+    for (j = mlod_lod->num_points; j > 0; j--)
+        odol_lod->point_weights_start[j] = odol_lod->point_weights_start[j - 1];
+    odol_lod->point_weights_start[0] = 0;
+
+    free(bone_selections);
+}
+
+
 uint32_t add_point(struct odol_lod *odol_lod, struct mlod_lod *mlod_lod, struct model_info *model_info,
         uint32_t point_index_mlod, struct triplet *normal, struct uv_pair *uv_coords) {
     uint32_t i;
-    uint32_t j;
+    uint32_t k;
+    uint32_t last;
     uint32_t weight_index;
 
-    // Check if there already is a vertex that satisfies the requirements
-    for (i = 0; i < odol_lod->num_points; i++) {
-        if (odol_lod->vertex_to_point[i] != point_index_mlod)
-            continue;
+    // Check if there already is a vertex that satisfies the requirements,
+    // only the vertices created for the same MLOD point are candidates
+    last = NOPOINT;
+    for (i = odol_lod->point_first_vertex[point_index_mlod]; i != NOPOINT; i = odol_lod->vertex_next[i]) {
+        last = i;
 
         // normals and uvs don't matter for non-visual lods
         if (mlod_lod->resolution < LOD_GEOMETRY) {
@@ -565,18 +794,9 @@ uint32_t add_point(struct odol_lod *odol_lod, struct mlod_lod *mlod_lod, struct
     if (odol_lod->vertexboneref != 0 && model_info->skeleton->num_bones > 0) {
         memset(&odol_lod->vertexboneref[odol_lod->num_points], 0, sizeof(struct odol_vertexboneref));
 
-        for (i = model_info->skeleton->num_bones - 1; (int32_t)i >= 0; i--) {
-            for (j = 0; j < mlod_lod->num_selections; j++) {
-                if (stricmp(model_info->skeleton->bones[i].name,
-                        mlod_lod->selections[j].name) == 0)
-                    break;
-            }
-
-            if (j == mlod_lod->num_selections)
-                continue;
-
-            if (mlod_lod->selections[j].points[point_index_mlod] == 0)
-                continue;
+        for (k = odol_lod->point_weights_start[point_index_mlod];
+                k < odol_lod->point_weights_start[point_index_mlod + 1]; k++) {
+            i = odol_lod->point_weights[k].bone;
 
             if (odol_lod->vertexboneref[odol_lod->num_points].num_bones == 4) {
                 lwarningf(current_target, -1, "Vertex %u of LOD %f is part of more than 4 bones.\n", point_index_mlod, mlod_lod->resolution);
@@ -592,7 +812,7 @@ uint32_t add_point(struct odol_lod *odol_lod, struct mlod_lod *mlod_lod, struct
             odol_lod->vertexboneref[odol_lod->num_points].num_bones++;
 
             odol_lod->vertexboneref[odol_lod->num_points].weights[weight_index][0] = odol_lod->skeleton_to_subskeleton[i].links[0];
-            odol_lod->vertexboneref[odol_lod->num_points].weights[weight_index][1] = mlod_lod->selections[j].points[point_index_mlod];
+            odol_lod->vertexboneref[odol_lod->num_points].weights[weight_index][1] = odol_lod->point_weights[k].weight;
 
             // convert weight
             if (odol_lod->vertexboneref[odol_lod->num_points].weights[weight_index][1] == 0x01)
@@ -608,6 +828,12 @@ uint32_t add_point(struct odol_lod *odol_lod, struct mlod_lod *mlod_lod, struct
     odol_lod->vertex_to_point[odol_lod->num_points] = point_index_mlod;
     odol_lod->point_to_vertex[point_index_mlod] = odol_lod->num_points;
 
+    odol_lod->vertex_next[odol_lod->num_points] = NOPOINT;
+    if (last == NOPOINT)
+        odol_lod->point_first_vertex[point_index_mlod] = odol_lod->num_points;
+    else
+        odol_lod->vertex_next[last] = odol_lod->num_points;
+
     odol_lod->num_points++;
 
     return (odol_lod->num_points - 1);
@@ -667,9 +893,63 @@ bool is_alpha(struct mlod_face *face) {
 }
 
 
+static uint32_t name_hash(char *name) {
+    // pointers are aligned, so the low bits carry no information
+    return (uint32_t)(((uint64_t)(uintptr_t)name * 0x9E3779B97F4A7C15ull) >> 32);
+}
+
+
+static uint32_t get_name_index(struct name_indices *indices, char *name, uint32_t index) {
+    /*
+     * Looks up the index stored for the given name, storing the given index
+     * first if the name isn't known yet. Names are interned per LOD, so the
+     * pointer itself is the key.
+     */
+
+    struct name_index *old_entries;
+    uint32_t old_size;
+    uint32_t i;
+    uint32_t j;
+
+    if ((indices->num_entries + 1) * 4 > indices->size_entries * 3) {
+        old_entries = indices->entries;
+        old_size = indices->size_entries;
+
+        indices->size_entries = (old_size == 0) ? 64 : old_size * 2;
+        indices->entries = (struct name_index *)safe_malloc(sizeof(struct name_index) * indices->size_entries);
+        memset(indices->entries, 0, sizeof(struct name_index) * indices->size_entries);
+
+        for (i = 0; i < old_size; i++) {
+            if (old_entries[i].name == NULL)
+                continue;
+            j = name_hash(old_entries[i].name) & (indices->size_entries - 1);
+            while (indices->entries[j].name != NULL)
+                j = (j + 1) & (indices->size_entries - 1);
+            indices->entries[j] = old_entries[i];
+        }
+
+        free(old_entries);
+    }
+
+    i = name_hash(name) & (indices->size_entries - 1);
+    while (indices->entries[i].name != NULL) {
+        if (indices->entries[i].name == name)
+            return indices->entries[i].index;
+        i = (i + 1) & (indices->size_entries - 1);
+    }
+
+    indices->entries[i].name = name;
+    indices->entries[i].index = index;
+    indices->num_entries++;
+
+    return index;
+}
+
+
 void convert_lod(struct mlod_lod *mlod_lod, struct odol_lod *odol_lod,
         struct model_info *model_info) {
-    extern char *current_target;
+    extern __thread char *current_target;
+    extern struct arguments args;
     unsigned long i;
     unsigned long j;
     unsigned long k;
@@ -677,13 +957,21 @@ void convert_lod(struct mlod_lod *mlod_lod, struct odol_lod *odol_lod,
     unsigned long face_start;
     unsigned long face_end;
     size_t size;
+    size_t length;
     char *ptr;
-    char textures[MAXTEXTURES][512];
+    char **textures;
+    char *section_names;
     char *temp;
+    uint32_t *sections;
+    uint32_t num_sections;
+    double start_time;
+    float acmr;
     bool *tileU;
     bool *tileV;
     struct triplet normal;
     struct uv_pair uv_coords;
+    struct name_indices texture_indices;
+    struct name_indices material_indices;
 
     // Set sub skeleton references
     odol_lod->num_bones_skeleton = model_info->skeleton->num_bones;
@@ -728,47 +1016,44 @@ void convert_lod(struct mlod_lod *mlod_lod, struct odol_lod *odol_lod,
     // Textures & Materials
     odol_lod->num_textures = 0;
     odol_lod->num_materials = 0;
-    odol_lod->materials = (struct material *)safe_malloc(sizeof(struct material) * MAXMATERIALS);
-    memset(textures, 0, sizeof(textures));
-    memset(odol_lod->materials, 0, sizeof(struct material) * MAXMATERIALS);
+    odol_lod->materials = NULL;
+
+    // there can't be more textures than faces
+    textures = (char **)safe_malloc(sizeof(char *) * mlod_lod->num_faces);
+
+    memset(&texture_indices, 0, sizeof(struct name_indices));
+    memset(&material_indices, 0, sizeof(struct name_indices));
 
     size = 0;
     for (i = 0; i < mlod_lod->num_faces; i++) {
-        for (j = 0; j < odol_lod->num_textures; j++) {
-            if (strcmp(mlod_lod->faces[i].texture_name, textures[j]) == 0)
-                break;
-        }
+        j = get_name_index(&texture_indices, mlod_lod->faces[i].texture_name, odol_lod->num_textures);
 
         mlod_lod->faces[i].texture_index = j;
 
-        if (j >= MAXTEXTURES) {
-            lwarningf(current_target, -1, "Maximum amount of textures per LOD (%i) exceeded.", MAXTEXTURES);
-            break;
-        }
-
-        if (j >= odol_lod->num_textures) {
-            strcpy(textures[j], mlod_lod->faces[i].texture_name);
+        if (j == odol_lod->num_textures) {
+            textures[j] = mlod_lod->faces[i].texture_name;
             size += strlen(textures[j]) + 1;
             odol_lod->num_textures++;
         }
 
-        for (j = 0; j < MAXMATERIALS && odol_lod->materials[j].path[0] != 0; j++) {
-            if (strcmp(mlod_lod->faces[i].material_name, odol_lod->materials[j].path) == 0)
-                break;
+        if (mlod_lod->faces[i].material_name[0] == 0) {
+            mlod_lod->faces[i].material_index = -1;
+            continue;
         }
 
-        mlod_lod->faces[i].material_index = (strlen(mlod_lod->faces[i].material_name) > 0) ? j : -1;
+        j = get_name_index(&material_indices, mlod_lod->faces[i].material_name, odol_lod->num_materials);
 
-        if (j >= MAXMATERIALS) {
-            lwarningf(current_target, -1, "Maximum amount of materials per LOD (%i) exceeded.", MAXMATERIALS);
-            break;
-        }
+        mlod_lod->faces[i].material_index = j;
 
-        if (odol_lod->materials[j].path[0] != 0 || mlod_lod->faces[i].material_name[0] == 0)
+        if (j < odol_lod->num_materials)
             continue;
 
         temp = current_target;
 
+        odol_lod->materials = (struct material *)safe_realloc(odol_lod->materials,
+            sizeof(struct material) * (odol_lod->num_materials + 1));
+        memset(&odol_lod->materials[j], 0, sizeof(struct material));
+
         strcpy(odol_lod->materials[j].path, mlod_lod->faces[i].material_name);
         odol_lod->num_materials++;
         read_material(&odol_lod->materials[j]);
@@ -776,6 +1061,9 @@ void convert_lod(struct mlod_lod *mlod_lod, struct odol_lod *odol_lod,
         current_target = temp;
     }
 
+    free(texture_indices.entries);
+    free(material_indices.entries);
+
     odol_lod->textures = (char *)safe_malloc(size);
     ptr = odol_lod->textures;
     for (i = 0; i < odol_lod->num_textures; i++) {
@@ -783,6 +1071,8 @@ void convert_lod(struct mlod_lod *mlod_lod, struct odol_lod *odol_lod,
         ptr += strlen(textures[i]) + 1;
     }
 
+    free(textures);
+
     odol_lod->num_faces = mlod_lod->num_faces;
 
     odol_lod->always_0 = 0;
@@ -794,21 +1084,29 @@ void convert_lod(struct mlod_lod *mlod_lod, struct odol_lod *odol_lod,
 
     odol_lod->point_to_vertex = (uint32_t *)safe_malloc(sizeof(uint32_t) * odol_lod->num_points_mlod);
     odol_lod->vertex_to_point = (uint32_t *)safe_malloc(sizeof(uint32_t) * (odol_lod->num_faces * 4 + odol_lod->num_points_mlod));
+    odol_lod->point_first_vertex = (uint32_t *)safe_malloc(sizeof(uint32_t) * odol_lod->num_points_mlod);
+    odol_lod->vertex_next = (uint32_t *)safe_malloc(sizeof(uint32_t) * (odol_lod->num_faces * 4 + odol_lod->num_points_mlod));
     odol_lod->face_lookup = (uint32_t *)safe_malloc(sizeof(uint32_t) * mlod_lod->num_faces);
 
     for (i = 0; i < mlod_lod->num_faces; i++)
         odol_lod->face_lookup[i] = i;
 
-    for (i = 0; i < odol_lod->num_points_mlod; i++)
+    for (i = 0; i < odol_lod->num_points_mlod; i++) {
         odol_lod->point_to_vertex[i] = NOPOINT;
+        odol_lod->point_first_vertex[i] = NOPOINT;
+    }
 
     odol_lod->uv_coords = (struct uv_pair *)safe_malloc(sizeof(struct uv_pair) * (odol_lod->num_faces * 4 + odol_lod->num_points_mlod));
     odol_lod->points = (struct triplet *)safe_malloc(sizeof(struct triplet) * (odol_lod->num_faces * 4 + odol_lod->num_points_mlod));
     odol_lod->normals = (struct triplet *)safe_malloc(sizeof(struct triplet) * (odol_lod->num_faces * 4 + odol_lod->num_points_mlod));
 
     odol_lod->vertexboneref = 0;
-    if (model_info->skeleton->num_bones > 0)
+    odol_lod->point_weights_start = NULL;
+    odol_lod->point_weights = NULL;
+    if (model_info->skeleton->num_bones > 0) {
         odol_lod->vertexboneref = (struct odol_vertexboneref *)safe_malloc(sizeof(struct odol_vertexboneref) * (odol_lod->num_faces * 4 + odol_lod->num_points_mlod));
+        build_point_weights(mlod_lod, odol_lod, model_info);
+    }
 
     // Set face flags
     tileU = (bool *)safe_malloc(odol_lod->num_textures);
@@ -848,20 +1146,45 @@ void convert_lod(struct mlod_lod *mlod_lod, struct odol_lod *odol_lod,
     free(tileU);
     free(tileV);
 
+    // Find the selections that are sections
+    sections = (uint32_t *)safe_malloc(sizeof(uint32_t) * MAX(mlod_lod->num_selections, 1));
+    num_sections = 0;
     for (i = 0; i < mlod_lod->num_selections; i++) {
         for (j = 0; j < model_info->skeleton->num_sections; j++) {
             if (strcmp(mlod_lod->selections[i].name, model_info->skeleton->sections[j]) == 0)
                 break;
         }
-        if (j < model_info->skeleton->num_sections) {
-            for (k = 0; k < mlod_lod->num_faces; k++) {
-                if (mlod_lod->selections[i].faces[k] > 0) {
-                    strcat(mlod_lod->faces[k].section_names, ":");
-                    strcat(mlod_lod->faces[k].section_names, mlod_lod->selections[i].name);
-                }
+        if (j < model_info->skeleton->num_sections)
+            sections[num_sections++] = i;
+    }
+
+    if (num_sections > 0) {
+        // large enough for a face that is part of all sections
+        length = 1;
+        for (i = 0; i < num_sections; i++)
+            length += strlen(mlod_lod->selections[sections[i]].name) + 1;
+        section_names = (char *)safe_malloc(length);
+
+        for (k = 0; k < mlod_lod->num_faces; k++) {
+            length = 0;
+            for (i = 0; i < num_sections; i++) {
+                if (mlod_lod->selections[sections[i]].faces[k] == 0)
+                    continue;
+
+                section_names[length++] = ':';
+                strcpy(section_names + length, mlod_lod->selections[sections[i]].name);
+                length += strlen(mlod_lod->selections[sections[i]].name);
             }
+            section_names[length] = 0;
+            mlod_lod->faces[k].section_names = arena_intern(mlod_lod->strings, section_names);
         }
 
+        free(section_names);
+    }
+
+    free(sections);
+
+    for (i = 0; i < mlod_lod->num_selections; i++) {
         if (strncmp(mlod_lod->selections[i].name, "proxy:", 6) != 0)
             continue;
 
@@ -884,6 +1207,7 @@ void convert_lod(struct mlod_lod *mlod_lod, struct odol_lod *odol_lod,
     }
 
     // Write face vertices
+    start_time = get_time();
     face_end = 0;
     memset(odol_lod->uv_scale, 0, sizeof(struct uv_pair) * 2);
     for (i = 0; i < mlod_lod->num_faces; i++) {
@@ -931,6 +1255,10 @@ void convert_lod(struct mlod_lod *mlod_lod, struct odol_lod *odol_lod,
             i, &normal, &uv_coords);
     }
 
+    if (args.verbose)
+        debugf("Welded %u points of LOD %f into %u vertices in %.1f ms.\n", odol_lod->num_points_mlod,
+            mlod_lod->resolution, odol_lod->num_points, (get_time() - start_time) * 1000);
+
     // Normalize vertex bone ref
     odol_lod->vertexboneref_is_simple = 1;
     float weight_sum;
@@ -1009,6 +1337,19 @@ void convert_lod(struct mlod_lod *mlod_lod, struct odol_lod *odol_lod,
         odol_lod->sections = 0;
     }
 
+    // Reorder faces within their sections and vertices for the GPU
+    if (args.optimizemeshes && mlod_lod->resolution < LOD_GEOMETRY && odol_lod->num_faces > 0) {
+        start_time = get_time();
+        acmr = get_acmr(odol_lod);
+
+        optimize_vertex_cache(odol_lod);
+        optimize_vertex_fetch(odol_lod);
+
+        if (args.verbose)
+            debugf("Optimized LOD %f for the vertex cache, ACMR %.3f -> %.3f in %.1f ms.\n", mlod_lod->resolution,
+                acmr, get_acmr(odol_lod), (get_time() - start_time) * 1000);
+    }
+
     // Selections
     odol_lod->num_selections = mlod_lod->num_selections;
     odol_lod->selections = (struct odol_selection *)safe_malloc(sizeof(struct odol_selection) * odol_lod->num_selections);
@@ -1185,173 +1526,173 @@ void convert_lod(struct mlod_lod *mlod_lod, struct odol_lod *odol_lod,
 }
 
 
-void write_skeleton(FILE *f_target, struct skeleton *skeleton) {
+void write_skeleton(struct membuffer *target, struct skeleton *skeleton) {
     int i;
 
-    fwrite(skeleton->name, strlen(skeleton->name) + 1, 1, f_target);
+    membuffer_write(target, skeleton->name, strlen(skeleton->name) + 1);
 
     if (strlen(skeleton->name) > 0) {
-        fputc(0, f_target); // is inherited @todo ?
-        fwrite(&skeleton->num_bones, sizeof(uint32_t), 1, f_target);
+        membuffer_putc(target, 0); // is inherited @todo ?
+        membuffer_put_u32(target, skeleton->num_bones);
         for (i = 0; i < skeleton->num_bones; i++) {
-            fwrite(skeleton->bones[i].name, strlen(skeleton->bones[i].name) + 1, 1, f_target);
-            fwrite(skeleton->bones[i].parent, strlen(skeleton->bones[i].parent) + 1, 1, f_target);
+            membuffer_write(target, skeleton->bones[i].name, strlen(skeleton->bones[i].name) + 1);
+            membuffer_write(target, skeleton->bones[i].parent, strlen(skeleton->bones[i].parent) + 1);
         }
-        fputc(0, f_target);
+        membuffer_putc(target, 0);
     }
 }
 
 
-void write_model_info(FILE *f_target, uint32_t num_lods, struct model_info *model_info) {
+void write_model_info(struct membuffer *target, uint32_t num_lods, struct model_info *model_info) {
     int i;
 
-    fwrite( model_info->lod_resolutions,     sizeof(float) * num_lods, 1, f_target);
-    fwrite(&model_info->index,               sizeof(uint32_t), 1, f_target);
-    fwrite(&model_info->bounding_sphere,     sizeof(float), 1, f_target);
-    fwrite(&model_info->geo_lod_sphere,      sizeof(float), 1, f_target);
-    fwrite( model_info->point_flags,         sizeof(uint32_t) * 3, 1, f_target);
-    fwrite(&model_info->aiming_center,       sizeof(struct triplet), 1, f_target);
-    fwrite(&model_info->map_icon_color,      sizeof(uint32_t), 1, f_target);
-    fwrite(&model_info->map_selected_color,  sizeof(uint32_t), 1, f_target);
-    fwrite(&model_info->view_density,        sizeof(float), 1, f_target);
-    fwrite(&model_info->bbox_min,            sizeof(struct triplet), 1, f_target);
-    fwrite(&model_info->bbox_max,            sizeof(struct triplet), 1, f_target);
-    fwrite(&model_info->lod_density_coef,    sizeof(float), 1, f_target);
-    fwrite(&model_info->draw_importance,     sizeof(float), 1, f_target);
-    fwrite(&model_info->bbox_visual_min,     sizeof(struct triplet), 1, f_target);
-    fwrite(&model_info->bbox_visual_max,     sizeof(struct triplet), 1, f_target);
-    fwrite(&model_info->bounding_center,     sizeof(struct triplet), 1, f_target);
-    fwrite(&model_info->geometry_center,     sizeof(struct triplet), 1, f_target);
-    fwrite(&model_info->centre_of_mass,      sizeof(struct triplet), 1, f_target);
-    fwrite(&model_info->inv_inertia,         sizeof(matrix), 1, f_target);
-    fwrite(&model_info->autocenter,          sizeof(bool), 1, f_target);
-    fwrite(&model_info->lock_autocenter,     sizeof(bool), 1, f_target);
-    fwrite(&model_info->can_occlude,         sizeof(bool), 1, f_target);
-    fwrite(&model_info->can_be_occluded,     sizeof(bool), 1, f_target);
-    // fwrite(&model_info->ai_cover,            sizeof(bool), 1, f_target);  // v73
-    fwrite(&model_info->skeleton->ht_min,    sizeof(float), 1, f_target);
-    fwrite(&model_info->skeleton->ht_max,    sizeof(float), 1, f_target);
-    fwrite(&model_info->skeleton->af_max,    sizeof(float), 1, f_target);
-    fwrite(&model_info->skeleton->mf_max,    sizeof(float), 1, f_target);
-    fwrite(&model_info->skeleton->mf_act,    sizeof(float), 1, f_target);
-    fwrite(&model_info->skeleton->t_body,    sizeof(float), 1, f_target);
-    fwrite(&model_info->force_not_alpha,     sizeof(bool), 1, f_target);
-    fwrite(&model_info->sb_source,           sizeof(int32_t), 1, f_target);
-    fwrite(&model_info->prefer_shadow_volume, sizeof(bool), 1, f_target);
-    fwrite(&model_info->shadow_offset,       sizeof(float), 1, f_target);
-    fwrite(&model_info->animated,            sizeof(bool), 1, f_target);
-    write_skeleton(f_target, model_info->skeleton);
-    fwrite(&model_info->map_type,            sizeof(char), 1, f_target);
-    fwrite(&model_info->n_floats,            sizeof(uint32_t), 1, f_target);
+    membuffer_put_array(target, model_info->lod_resolutions, sizeof(float), num_lods);
+    membuffer_put_u32(target, model_info->index);
+    membuffer_put_f32(target, model_info->bounding_sphere);
+    membuffer_put_f32(target, model_info->geo_lod_sphere);
+    membuffer_put_array(target, model_info->point_flags, sizeof(uint32_t), 3);
+    membuffer_write(target, &model_info->aiming_center, sizeof(struct triplet));
+    membuffer_put_u32(target, model_info->map_icon_color);
+    membuffer_put_u32(target, model_info->map_selected_color);
+    membuffer_put_f32(target, model_info->view_density);
+    membuffer_write(target, &model_info->bbox_min, sizeof(struct triplet));
+    membuffer_write(target, &model_info->bbox_max, sizeof(struct triplet));
+    membuffer_put_f32(target, model_info->lod_density_coef);
+    membuffer_put_f32(target, model_info->draw_importance);
+    membuffer_write(target, &model_info->bbox_visual_min, sizeof(struct triplet));
+    membuffer_write(target, &model_info->bbox_visual_max, sizeof(struct triplet));
+    membuffer_write(target, &model_info->bounding_center, sizeof(struct triplet));
+    membuffer_write(target, &model_info->geometry_center, sizeof(struct triplet));
+    membuffer_write(target, &model_info->centre_of_mass, sizeof(struct triplet));
+    membuffer_write(target, &model_info->inv_inertia, sizeof(matrix));
+    membuffer_write(target, &model_info->autocenter, sizeof(bool));
+    membuffer_write(target, &model_info->lock_autocenter, sizeof(bool));
+    membuffer_write(target, &model_info->can_occlude, sizeof(bool));
+    membuffer_write(target, &model_info->can_be_occluded, sizeof(bool));
+    // membuffer_write(target, &model_info->ai_cover, sizeof(bool));  // v73
+    membuffer_put_f32(target, model_info->skeleton->ht_min);
+    membuffer_put_f32(target, model_info->skeleton->ht_max);
+    membuffer_put_f32(target, model_info->skeleton->af_max);
+    membuffer_put_f32(target, model_info->skeleton->mf_max);
+    membuffer_put_f32(target, model_info->skeleton->mf_act);
+    membuffer_put_f32(target, model_info->skeleton->t_body);
+    membuffer_write(target, &model_info->force_not_alpha, sizeof(bool));
+    membuffer_write(target, &model_info->sb_source, sizeof(int32_t));
+    membuffer_write(target, &model_info->prefer_shadow_volume, sizeof(bool));
+    membuffer_put_f32(target, model_info->shadow_offset);
+    membuffer_write(target, &model_info->animated, sizeof(bool));
+    write_skeleton(target, model_info->skeleton);
+    membuffer_write(target, &model_info->map_type, sizeof(char));
+    membuffer_put_u32(target, model_info->n_floats);
     //fwrite("\0\0\0\0\0", 4, 1, f_target); // compression header for empty array
-    fwrite(&model_info->mass,                sizeof(float), 1, f_target);
-    fwrite(&model_info->mass_reciprocal,     sizeof(float), 1, f_target);
-    fwrite(&model_info->armor,               sizeof(float), 1, f_target);
-    fwrite(&model_info->inv_armor,           sizeof(float), 1, f_target);
-    fwrite(&model_info->special_lod_indices, sizeof(struct lod_indices), 1, f_target);
-    fwrite(&model_info->min_shadow,          sizeof(uint32_t), 1, f_target);
-    fwrite(&model_info->can_blend,           sizeof(bool), 1, f_target);
-    fwrite(&model_info->class_type,          sizeof(char), 1, f_target);
-    fwrite(&model_info->destruct_type,       sizeof(char), 1, f_target);
-    fwrite(&model_info->property_frequent,   sizeof(bool), 1, f_target);
-    fwrite(&model_info->always_0,            sizeof(uint32_t), 1, f_target); //@todo Array of unused Selection Names
+    membuffer_put_f32(target, model_info->mass);
+    membuffer_put_f32(target, model_info->mass_reciprocal);
+    membuffer_put_f32(target, model_info->armor);
+    membuffer_put_f32(target, model_info->inv_armor);
+    membuffer_write(target, &model_info->special_lod_indices, sizeof(struct lod_indices));
+    membuffer_put_u32(target, model_info->min_shadow);
+    membuffer_write(target, &model_info->can_blend, sizeof(bool));
+    membuffer_write(target, &model_info->class_type, sizeof(char));
+    membuffer_write(target, &model_info->destruct_type, sizeof(char));
+    membuffer_write(target, &model_info->property_frequent, sizeof(bool));
+    membuffer_put_u32(target, model_info->always_0); //@todo Array of unused Selection Names
 
     // v73 adds another 4 bytes here
 
     //sets preferredShadowVolumeLod, preferredShadowBufferLod, and preferredShadowBufferLodVis for each LOD
     for (i = 0; i < num_lods; i++)
-        fwrite("\xff\xff\xff\xff\xff\xff\xff\xff\xff\xff\xff\xff", 12, 1, f_target);
+        membuffer_write(target, "\xff\xff\xff\xff\xff\xff\xff\xff\xff\xff\xff\xff", 12);
 }
 
 
-void write_odol_section(FILE *f_target, struct odol_section *odol_section) {
-    fwrite(&odol_section->face_index_start,     sizeof(uint32_t), 1, f_target);
-    fwrite(&odol_section->face_index_end,       sizeof(uint32_t), 1, f_target);
-    fwrite(&odol_section->min_bone_index,       sizeof(uint32_t), 1, f_target);
-    fwrite(&odol_section->bones_count,          sizeof(uint32_t), 1, f_target);
-    fwrite(&odol_section->mat_dummy,            sizeof(uint32_t), 1, f_target);
-    fwrite(&odol_section->common_texture_index, sizeof(uint16_t), 1, f_target);
-    fwrite(&odol_section->common_face_flags,    sizeof(uint32_t), 1, f_target);
-    fwrite(&odol_section->material_index,       sizeof(int32_t), 1, f_target);
+void write_odol_section(struct membuffer *target, struct odol_section *odol_section) {
+    membuffer_put_u32(target, odol_section->face_index_start);
+    membuffer_put_u32(target, odol_section->face_index_end);
+    membuffer_put_u32(target, odol_section->min_bone_index);
+    membuffer_put_u32(target, odol_section->bones_count);
+    membuffer_put_u32(target, odol_section->mat_dummy);
+    membuffer_write(target, &odol_section->common_texture_index, sizeof(uint16_t));
+    membuffer_put_u32(target, odol_section->common_face_flags);
+    membuffer_write(target, &odol_section->material_index, sizeof(int32_t));
     if (odol_section->material_index == -1)
-        fputc(0, f_target);
-    fwrite(&odol_section->num_stages,           sizeof(uint32_t), 1, f_target);
-    fwrite(odol_section->area_over_tex,         sizeof(float), odol_section->num_stages, f_target);
-    fwrite(&odol_section->unknown_long,         sizeof(uint32_t), 1, f_target);
+        membuffer_putc(target, 0);
+    membuffer_put_u32(target, odol_section->num_stages);
+    membuffer_put_array(target, odol_section->area_over_tex, sizeof(float), odol_section->num_stages);
+    membuffer_put_u32(target, odol_section->unknown_long);
 }
 
 
-void write_odol_selection(FILE *f_target, struct odol_selection *odol_selection) {
-    fwrite(odol_selection->name, strlen(odol_selection->name) + 1, 1, f_target);
+void write_odol_selection(struct membuffer *target, struct odol_selection *odol_selection) {
+    membuffer_write(target, odol_selection->name, strlen(odol_selection->name) + 1);
 
-    fwrite(&odol_selection->num_faces, sizeof(uint32_t), 1, f_target);
+    membuffer_put_u32(target, odol_selection->num_faces);
     if (odol_selection->num_faces > 0) {
-        fputc(0, f_target);
-        fwrite(odol_selection->faces, sizeof(uint32_t) * odol_selection->num_faces, 1, f_target);
+        membuffer_putc(target, 0);
+        membuffer_put_array(target, odol_selection->faces, sizeof(uint32_t), odol_selection->num_faces);
     }
 
-    fwrite(&odol_selection->always_0, sizeof(uint32_t), 1, f_target);
+    membuffer_put_u32(target, odol_selection->always_0);
 
-    fwrite(&odol_selection->is_sectional, 1, 1, f_target);
-    fwrite(&odol_selection->num_sections, sizeof(uint32_t), 1, f_target);
+    membuffer_write(target, &odol_selection->is_sectional, 1);
+    membuffer_put_u32(target, odol_selection->num_sections);
     if (odol_selection->num_sections > 0) {
-        fputc(0, f_target);
-        fwrite(odol_selection->sections, sizeof(uint32_t) * odol_selection->num_sections, 1, f_target);
+        membuffer_putc(target, 0);
+        membuffer_put_array(target, odol_selection->sections, sizeof(uint32_t), odol_selection->num_sections);
     }
 
-    fwrite(&odol_selection->num_vertices, sizeof(uint32_t), 1, f_target);
+    membuffer_put_u32(target, odol_selection->num_vertices);
     if (odol_selection->num_vertices > 0) {
-        fputc(0, f_target);
-        fwrite(odol_selection->vertices, sizeof(uint32_t) * odol_selection->num_vertices, 1, f_target);
+        membuffer_putc(target, 0);
+        membuffer_put_array(target, odol_selection->vertices, sizeof(uint32_t), odol_selection->num_vertices);
     }
 
-    fwrite(&odol_selection->num_vertex_weights, sizeof(uint32_t), 1, f_target);
+    membuffer_put_u32(target, odol_selection->num_vertex_weights);
     if (odol_selection->num_vertex_weights > 0) {
-        fputc(0, f_target);
-        fwrite(odol_selection->vertex_weights, sizeof(uint8_t) * odol_selection->num_vertex_weights, 1, f_target);
+        membuffer_putc(target, 0);
+        membuffer_put_array(target, odol_selection->vertex_weights, sizeof(uint8_t), odol_selection->num_vertex_weights);
     }
 }
 
 
-void write_material(FILE *f_target, struct material *material) {
+void write_material(struct membuffer *target, struct material *material) {
     int i;
 
-    fwrite( material->path, strlen(material->path) + 1, 1, f_target);
-    fwrite(&material->type, sizeof(uint32_t), 1, f_target);
-    fwrite(&material->emissive, sizeof(struct color), 1, f_target);
-    fwrite(&material->ambient, sizeof(struct color), 1, f_target);
-    fwrite(&material->diffuse, sizeof(struct color), 1, f_target);
-    fwrite(&material->forced_diffuse, sizeof(struct color), 1, f_target);
-    fwrite(&material->specular, sizeof(struct color), 1, f_target);
-    fwrite(&material->specular2, sizeof(struct color), 1, f_target);
-    fwrite(&material->specular_power, sizeof(float), 1, f_target);
-    fwrite(&material->pixelshader_id, sizeof(uint32_t), 1, f_target);
-    fwrite(&material->vertexshader_id, sizeof(uint32_t), 1, f_target);
-    fwrite(&material->depr_1, sizeof(uint32_t), 1, f_target);
-    fwrite(&material->depr_2, sizeof(uint32_t), 1, f_target);
-    fwrite( material->surface, strlen(material->surface) + 1, 1, f_target);
-    fwrite(&material->depr_3, sizeof(uint32_t), 1, f_target);
-    fwrite(&material->render_flags, sizeof(uint32_t), 1, f_target);
-    fwrite(&material->num_textures, sizeof(uint32_t), 1, f_target);
-    fwrite(&material->num_transforms, sizeof(uint32_t), 1, f_target);
+    membuffer_write(target, material->path, strlen(material->path) + 1);
+    membuffer_put_u32(target, material->type);
+    membuffer_write(target, &material->emissive, sizeof(struct color));
+    membuffer_write(target, &material->ambient, sizeof(struct color));
+    membuffer_write(target, &material->diffuse, sizeof(struct color));
+    membuffer_write(target, &material->forced_diffuse, sizeof(struct color));
+    membuffer_write(target, &material->specular, sizeof(struct color));
+    membuffer_write(target, &material->specular2, sizeof(struct color));
+    membuffer_put_f32(target, material->specular_power);
+    membuffer_put_u32(target, material->pixelshader_id);
+    membuffer_put_u32(target, material->vertexshader_id);
+    membuffer_put_u32(target, material->depr_1);
+    membuffer_put_u32(target, material->depr_2);
+    membuffer_write(target, material->surface, strlen(material->surface) + 1);
+    membuffer_put_u32(target, material->depr_3);
+    membuffer_put_u32(target, material->render_flags);
+    membuffer_put_u32(target, material->num_textures);
+    membuffer_put_u32(target, material->num_transforms);
 
     for (i = 0; i < material->num_textures; i++) {
-        fwrite(&material->textures[i].texture_filter, sizeof(uint32_t), 1, f_target);
-        fwrite( material->textures[i].path, strlen(material->textures[i].path) + 1, 1, f_target);
-        fwrite(&material->textures[i].transform_index, sizeof(uint32_t), 1, f_target);
-        fwrite(&material->dummy_texture.type11_bool, sizeof(bool), 1, f_target);
+        membuffer_put_u32(target, material->textures[i].texture_filter);
+        membuffer_write(target, material->textures[i].path, strlen(material->textures[i].path) + 1);
+        membuffer_put_u32(target, material->textures[i].transform_index);
+        membuffer_write(target, &material->dummy_texture.type11_bool, sizeof(bool));
     }
 
-    fwrite( material->transforms, sizeof(struct stage_transform), material->num_transforms, f_target);
+    membuffer_put_array(target, material->transforms, sizeof(struct stage_transform), material->num_transforms);
 
-    fwrite(&material->dummy_texture.texture_filter, sizeof(uint32_t), 1, f_target);
-    fwrite( material->dummy_texture.path, strlen(material->dummy_texture.path) + 1, 1, f_target);
-    fwrite(&material->dummy_texture.transform_index, sizeof(uint32_t), 1, f_target);
-    fwrite(&material->dummy_texture.type11_bool, sizeof(bool), 1, f_target);
+    membuffer_put_u32(target, material->dummy_texture.texture_filter);
+    membuffer_write(target, material->dummy_texture.path, strlen(material->dummy_texture.path) + 1);
+    membuffer_put_u32(target, material->dummy_texture.transform_index);
+    membuffer_write(target, &material->dummy_texture.type11_bool, sizeof(bool));
 }
 
 
-void write_odol_lod(FILE *f_target, struct odol_lod *odol_lod) {
+void write_odol_lod(struct membuffer *target, struct odol_lod *odol_lod) {
     short u, v;
     int x, y, z;
     long i;
@@ -1361,97 +1702,98 @@ void write_odol_lod(FILE *f_target, struct odol_lod *odol_lod) {
     float u_relative;
     float v_relative;
 
-    fwrite(&odol_lod->num_proxies, sizeof(uint32_t), 1, f_target);
+    membuffer_put_u32(target, odol_lod->num_proxies);
     for (i = 0; i < odol_lod->num_proxies; i++) {
-        fwrite( odol_lod->proxies[i].name, strlen(odol_lod->proxies[i].name) + 1, 1, f_target);
-        fwrite(&odol_lod->proxies[i].transform_x, sizeof(struct triplet), 1, f_target);
-        fwrite(&odol_lod->proxies[i].transform_y, sizeof(struct triplet), 1, f_target);
-        fwrite(&odol_lod->proxies[i].transform_z, sizeof(struct triplet), 1, f_target);
-        fwrite(&odol_lod->proxies[i].transform_n, sizeof(struct triplet), 1, f_target);
-        fwrite(&odol_lod->proxies[i].proxy_id, sizeof(uint32_t), 1, f_target);
-        fwrite(&odol_lod->proxies[i].selection_index, sizeof(uint32_t), 1, f_target);
-        fwrite(&odol_lod->proxies[i].bone_index, sizeof(int32_t), 1, f_target);
-        fwrite(&odol_lod->proxies[i].section_index, sizeof(uint32_t), 1, f_target);
+        membuffer_write(target, odol_lod->proxies[i].name, strlen(odol_lod->proxies[i].name) + 1);
+        membuffer_write(target, &odol_lod->proxies[i].transform_x, sizeof(struct triplet));
+        membuffer_write(target, &odol_lod->proxies[i].transform_y, sizeof(struct triplet));
+        membuffer_write(target, &odol_lod->proxies[i].transform_z, sizeof(struct triplet));
+        membuffer_write(target, &odol_lod->proxies[i].transform_n, sizeof(struct triplet));
+        membuffer_put_u32(target, odol_lod->proxies[i].proxy_id);
+        membuffer_put_u32(target, odol_lod->proxies[i].selection_index);
+        membuffer_write(target, &odol_lod->proxies[i].bone_index, sizeof(int32_t));
+        membuffer_put_u32(target, odol_lod->proxies[i].section_index);
     }
 
-    fwrite(&odol_lod->num_bones_subskeleton, sizeof(uint32_t), 1, f_target);
-    fwrite( odol_lod->subskeleton_to_skeleton, sizeof(uint32_t) * odol_lod->num_bones_subskeleton, 1, f_target);
+    membuffer_put_u32(target, odol_lod->num_bones_subskeleton);
+    membuffer_put_array(target, odol_lod->subskeleton_to_skeleton, sizeof(uint32_t), odol_lod->num_bones_subskeleton);
 
-    fwrite(&odol_lod->num_bones_skeleton, sizeof(uint32_t), 1, f_target);
+    membuffer_put_u32(target, odol_lod->num_bones_skeleton);
     for (i = 0; i < odol_lod->num_bones_skeleton; i++) {
-        fwrite(&odol_lod->skeleton_to_subskeleton[i].num_links, sizeof(uint32_t), 1, f_target);
-        fwrite( odol_lod->skeleton_to_subskeleton[i].links, sizeof(uint32_t) * odol_lod->skeleton_to_subskeleton[i].num_links, 1, f_target);
+        membuffer_put_u32(target, odol_lod->skeleton_to_subskeleton[i].num_links);
+        membuffer_put_array(target, odol_lod->skeleton_to_subskeleton[i].links, sizeof(uint32_t), odol_lod->skeleton_to_subskeleton[i].num_links);
     }
 
-    fwrite(&odol_lod->num_points, sizeof(uint32_t), 1, f_target);
-    fwrite(&odol_lod->face_area, sizeof(float), 1, f_target);
-    fwrite( odol_lod->clip_flags, sizeof(uint32_t), 2, f_target);
-    fwrite(&odol_lod->min_pos, sizeof(struct triplet), 1, f_target);
-    fwrite(&odol_lod->max_pos, sizeof(struct triplet), 1, f_target);
-    fwrite(&odol_lod->autocenter_pos, sizeof(struct triplet), 1, f_target);
-    fwrite(&odol_lod->sphere, sizeof(float), 1, f_target);
+    membuffer_put_u32(target, odol_lod->num_points);
+    membuffer_put_f32(target, odol_lod->face_area);
+    membuffer_put_array(target, odol_lod->clip_flags, sizeof(uint32_t), 2);
+    membuffer_write(target, &odol_lod->min_pos, sizeof(struct triplet));
+    membuffer_write(target, &odol_lod->max_pos, sizeof(struct triplet));
+    membuffer_write(target, &odol_lod->autocenter_pos, sizeof(struct triplet));
+    membuffer_put_f32(target, odol_lod->sphere);
 
-    fwrite(&odol_lod->num_textures, sizeof(uint32_t), 1, f_target);
+    membuffer_put_u32(target, odol_lod->num_textures);
     ptr = odol_lod->textures;
     for (i = 0; i < odol_lod->num_textures; i++)
         ptr += strlen(ptr) + 1;
-    fwrite( odol_lod->textures, ptr - odol_lod->textures, 1, f_target);
+    membuffer_write(target, odol_lod->textures, ptr - odol_lod->textures);
 
-    fwrite(&odol_lod->num_materials, sizeof(uint32_t), 1, f_target);
+    membuffer_put_u32(target, odol_lod->num_materials);
     for (i = 0; i < odol_lod->num_materials; i++)
-        write_material(f_target, &odol_lod->materials[i]);
+        write_material(target, &odol_lod->materials[i]);
 
     // the point-to-vertex and vertex-to-point arrays are just left out
-    fwrite("\0\0\0\0\0\0\0\0", sizeof(uint32_t) * 2, 1, f_target);
+    membuffer_write(target, "\0\0\0\0\0\0\0\0", 8);
 
-    fwrite(&odol_lod->num_faces, sizeof(uint32_t), 1, f_target);
-    fwrite(&odol_lod->face_allocation_size, sizeof(uint32_t), 1, f_target);
-    fwrite(&odol_lod->always_0, sizeof(uint16_t), 1, f_target);
+    membuffer_put_u32(target, odol_lod->num_faces);
+    membuffer_put_u32(target, odol_lod->face_allocation_size);
+    membuffer_write(target, &odol_lod->always_0, sizeof(uint16_t));
 
     for (i = 0; i < odol_lod->num_faces; i++) {
-        fwrite(&odol_lod->faces[i].face_type, sizeof(uint8_t), 1, f_target);
-        fwrite( odol_lod->faces[i].table, sizeof(uint32_t) * odol_lod->faces[i].face_type, 1, f_target);
+        membuffer_write(target, &odol_lod->faces[i].face_type, sizeof(uint8_t));
+        membuffer_put_array(target, odol_lod->faces[i].table, sizeof(uint32_t), odol_lod->faces[i].face_type);
     }
 
-    fwrite(&odol_lod->num_sections, sizeof(uint32_t), 1, f_target);
+    membuffer_put_u32(target, odol_lod->num_sections);
     for (i = 0; i < odol_lod->num_sections; i++) {
-        write_odol_section(f_target, &odol_lod->sections[i]);
+        write_odol_section(target, &odol_lod->sections[i]);
     }
 
-    fwrite(&odol_lod->num_selections, sizeof(uint32_t), 1, f_target);
+    membuffer_put_u32(target, odol_lod->num_selections);
     for (i = 0; i < odol_lod->num_selections; i++) {
-        write_odol_selection(f_target, &odol_lod->selections[i]);
+        write_odol_selection(target, &odol_lod->selections[i]);
     }
 
-    fwrite(&odol_lod->num_properties, sizeof(uint32_t), 1, f_target);
+    membuffer_put_u32(target, odol_lod->num_properties);
     for (i = 0; i < odol_lod->num_properties; i++) {
-        fwrite(odol_lod->properties[i].name, strlen(odol_lod->properties[i].name) + 1, 1, f_target);
-        fwrite(odol_lod->properties[i].value, strlen(odol_lod->properties[i].value) + 1, 1, f_target);
+        membuffer_write(target, odol_lod->properties[i].name, strlen(odol_lod->properties[i].name) + 1);
+        membuffer_write(target, odol_lod->properties[i].value, strlen(odol_lod->properties[i].value) + 1);
     }
 
-    fwrite(&odol_lod->num_frames, sizeof(uint32_t), 1, f_target);
+    membuffer_put_u32(target, odol_lod->num_frames);
     // @todo frames
 
-    fwrite(&odol_lod->icon_color, sizeof(uint32_t), 1, f_target);
-    fwrite(&odol_lod->selected_color, sizeof(uint32_t), 1, f_target);
-    fwrite(&odol_lod->flags, sizeof(uint32_t), 1, f_target);
-    fwrite(&odol_lod->vertexboneref_is_simple, sizeof(bool), 1, f_target);
+    membuffer_put_u32(target, odol_lod->icon_color);
+    membuffer_put_u32(target, odol_lod->selected_color);
+    membuffer_put_u32(target, odol_lod->flags);
+    membuffer_write(target, &odol_lod->vertexboneref_is_simple, sizeof(bool));
 
-    fp_vertextable_size = ftell(f_target);
-    fwrite("\0\0\0\0", 4, 1, f_target);
+    fp_vertextable_size = target->length;
+    membuffer_write(target, "\0\0\0\0", 4);
 
     // pointflags
-    fwrite(&odol_lod->num_points, 4, 1, f_target);
-    fputc(1, f_target);
+    membuffer_put_u32(target, odol_lod->num_points);
+    membuffer_putc(target, 1);
     if (odol_lod->num_points > 0)
-        fwrite("\0\0\0\0", 4, 1, f_target);
+        membuffer_write(target, "\0\0\0\0", 4);
 
     // uvs
-    fwrite( odol_lod->uv_scale, sizeof(struct uv_pair) * 2, 1, f_target);
-    fwrite(&odol_lod->num_points, sizeof(uint32_t), 1, f_target);
-    fputc(0, f_target);
+    membuffer_put_array(target, odol_lod->uv_scale, sizeof(struct uv_pair), 2);
+    membuffer_put_u32(target, odol_lod->num_points);
+    membuffer_putc(target, 0);
     if (odol_lod->num_points > 0) {
-        fputc(0, f_target);
+        membuffer_putc(target, 0);
+        membuffer_reserve(target, sizeof(int16_t) * 2 * odol_lod->num_points);
         for (i = 0; i < odol_lod->num_points; i++) {
             // write compressed pair
             u_relative = (odol_lod->uv_coords[i].u - odol_lod->uv_scale[0].u) / (odol_lod->uv_scale[1].u - odol_lod->uv_scale[0].u);
@@ -1459,24 +1801,25 @@ void write_odol_lod(FILE *f_target, struct odol_lod *odol_lod) {
             u = (short)(u_relative * 2 * INT16_MAX - INT16_MAX);
             v = (short)(v_relative * 2 * INT16_MAX - INT16_MAX);
 
-            fwrite(&u, sizeof(int16_t), 1, f_target);
-            fwrite(&v, sizeof(int16_t), 1, f_target);
+            membuffer_write(target, &u, sizeof(int16_t));
+            membuffer_write(target, &v, sizeof(int16_t));
         }
     }
-    fwrite("\x01\0\0\0", 4, 1, f_target);
+    membuffer_write(target, "\x01\0\0\0", 4);
 
     // points
-    fwrite(&odol_lod->num_points, sizeof(uint32_t), 1, f_target);
+    membuffer_put_u32(target, odol_lod->num_points);
     if (odol_lod->num_points > 0) {
-        fputc(0, f_target);
-        fwrite( odol_lod->points, sizeof(struct triplet) * odol_lod->num_points, 1, f_target);
+        membuffer_putc(target, 0);
+        membuffer_put_array(target, odol_lod->points, sizeof(struct triplet), odol_lod->num_points);
     }
 
     // normals
-    fwrite(&odol_lod->num_points, sizeof(uint32_t), 1, f_target);
-    fputc(0, f_target);
+    membuffer_put_u32(target, odol_lod->num_points);
+    membuffer_putc(target, 0);
     if (odol_lod->num_points > 0) {
-        fputc(0, f_target);
+        membuffer_putc(target, 0);
+        membuffer_reserve(target, sizeof(uint32_t) * odol_lod->num_points);
         for (i = 0; i < odol_lod->num_points; i++) {
             // write compressed triplet
             x = (int)(-511.0f * odol_lod->normals[i].x + 0.5);
@@ -1488,35 +1831,33 @@ void write_odol_lod(FILE *f_target, struct odol_lod *odol_lod) {
             z = MAX(MIN(z, 511), -511);
 
             temp = (((uint32_t)z & 0x3FF) << 20) | (((uint32_t)y & 0x3FF) << 10) | ((uint32_t)x & 0x3FF);
-            fwrite(&temp, sizeof(uint32_t), 1, f_target);
+            membuffer_put_u32(target, temp);
         }
     }
 
     // ST coordinates
-    fwrite("\0\0\0\0", 4, 1, f_target);
+    membuffer_write(target, "\0\0\0\0", 4);
 
     // vertex bone ref
     if (odol_lod->vertexboneref == 0 || odol_lod->num_points == 0) {
-        fwrite("\0\0\0\0", 4, 1, f_target);
+        membuffer_write(target, "\0\0\0\0", 4);
     } else {
-        fwrite(&odol_lod->num_points, sizeof(uint32_t), 1, f_target);
-        fputc(0, f_target);
-        fwrite(odol_lod->vertexboneref, sizeof(struct odol_vertexboneref), odol_lod->num_points, f_target);
+        membuffer_put_u32(target, odol_lod->num_points);
+        membuffer_putc(target, 0);
+        membuffer_put_array(target, odol_lod->vertexboneref, sizeof(struct odol_vertexboneref), odol_lod->num_points);
     }
 
     // neighbor bone ref
-    fwrite("\0\0\0\0", 4, 1, f_target);
+    membuffer_write(target, "\0\0\0\0", 4);
 
     // has Collimator info?
-    fwrite("\0\0\0\0", sizeof(uint32_t), 1, f_target); //If 1 then need to write CollimatorInfo structure
+    membuffer_write(target, "\0\0\0\0", sizeof(uint32_t)); //If 1 then need to write CollimatorInfo structure
 
     // unknown byte
-    fwrite("\0", 1, 1, f_target);
+    membuffer_write(target, "\0", 1);
 
-    temp = ftell(f_target) - fp_vertextable_size;
-    fseek(f_target, fp_vertextable_size, SEEK_SET);
-    fwrite(&temp, 4, 1, f_target);
-    fseek(f_target, 0, SEEK_END);
+    temp = target->length - fp_vertextable_size;
+    memcpy(target->data + fp_vertextable_size, &temp, 4);
 }
 
 
@@ -1593,7 +1934,7 @@ void calculate_axis(struct animation *anim, uint32_t num_lods, struct mlod_lod *
 }
 
 
-void write_animations(FILE *f_target, uint32_t num_lods, struct mlod_lod *mlod_lods,
+void write_animations(struct membuffer *target, uint32_t num_lods, struct mlod_lod *mlod_lods,
         struct model_info *model_info) {
     int i;
     int j;
@@ -1603,56 +1944,56 @@ void write_animations(FILE *f_target, uint32_t num_lods, struct mlod_lod *mlod_l
     struct animation *anim;
 
     // Write animation classes
-    fwrite(&model_info->skeleton->num_animations, sizeof(uint32_t), 1, f_target);
+    membuffer_put_u32(target, model_info->skeleton->num_animations);
     for (i = 0; i < model_info->skeleton->num_animations; i++) {
         anim = &model_info->skeleton->animations[i];
-        fwrite(&anim->type, sizeof(uint32_t), 1, f_target);
-        fwrite( anim->name, strlen(anim->name) + 1, 1, f_target);
-        fwrite( anim->source, strlen(anim->source) + 1, 1, f_target);
-        fwrite(&anim->min_value, sizeof(float), 1, f_target);
-        fwrite(&anim->max_value, sizeof(float), 1, f_target);
-        fwrite(&anim->min_value, sizeof(float), 1, f_target);
-        fwrite(&anim->max_value, sizeof(float), 1, f_target);
+        membuffer_put_u32(target, anim->type);
+        membuffer_write(target, anim->name, strlen(anim->name) + 1);
+        membuffer_write(target, anim->source, strlen(anim->source) + 1);
+        membuffer_put_f32(target, anim->min_value);
+        membuffer_put_f32(target, anim->max_value);
+        membuffer_put_f32(target, anim->min_value);
+        membuffer_put_f32(target, anim->max_value);
         //fwrite(&anim->min_phase, sizeof(float), 1, f_target);
         //fwrite(&anim->max_phase, sizeof(float), 1, f_target);
-        fwrite(&anim->junk, sizeof(uint32_t), 1, f_target);
-        fwrite(&anim->always_0, sizeof(uint32_t), 1, f_target);
-        fwrite(&anim->source_address, sizeof(uint32_t), 1, f_target);
+        membuffer_put_u32(target, anim->junk);
+        membuffer_put_u32(target, anim->always_0);
+        membuffer_put_u32(target, anim->source_address);
 
         switch (anim->type) {
             case TYPE_ROTATION:
             case TYPE_ROTATION_X:
             case TYPE_ROTATION_Y:
             case TYPE_ROTATION_Z:
-                fwrite(&anim->angle0, sizeof(float), 1, f_target);
-                fwrite(&anim->angle1, sizeof(float), 1, f_target);
+                membuffer_put_f32(target, anim->angle0);
+                membuffer_put_f32(target, anim->angle1);
                 break;
             case TYPE_TRANSLATION:
             case TYPE_TRANSLATION_X:
             case TYPE_TRANSLATION_Y:
             case TYPE_TRANSLATION_Z:
-                fwrite(&anim->offset0, sizeof(float), 1, f_target);
-                fwrite(&anim->offset1, sizeof(float), 1, f_target);
+                membuffer_put_f32(target, anim->offset0);
+                membuffer_put_f32(target, anim->offset1);
                 break;
             case TYPE_DIRECT:
-                fwrite(&anim->axis_pos, sizeof(struct triplet), 1, f_target);
-                fwrite(&anim->axis_dir, sizeof(struct triplet), 1, f_target);
-                fwrite(&anim->angle, sizeof(float), 1, f_target);
-                fwrite(&anim->axis_offset, sizeof(float), 1, f_target);
+                membuffer_write(target, &anim->axis_pos, sizeof(struct triplet));
+                membuffer_write(target, &anim->axis_dir, sizeof(struct triplet));
+                membuffer_put_f32(target, anim->angle);
+                membuffer_put_f32(target, anim->axis_offset);
                 break;
             case TYPE_HIDE:
-                fwrite(&anim->hide_value, sizeof(float), 1, f_target);
-                fwrite(&anim->unhide_value, sizeof(float), 1, f_target);
+                membuffer_put_f32(target, anim->hide_value);
+                membuffer_put_f32(target, anim->unhide_value);
                 break;
         }
     }
 
     // Write bone2anim and anim2bone lookup tables
-    fwrite(&num_lods, sizeof(uint32_t), 1, f_target);
+    membuffer_put_u32(target, num_lods);
 
     // bone2anim
     for (i = 0; i < num_lods; i++) {
-        fwrite(&model_info->skeleton->num_bones, sizeof(uint32_t), 1, f_target);
+        membuffer_put_u32(target, model_info->skeleton->num_bones);
         for (j = 0; j < model_info->skeleton->num_bones; j++) {
             num = 0;
             for (k = 0; k < model_info->skeleton->num_animations; k++) {
@@ -1661,13 +2002,13 @@ void write_animations(FILE *f_target, uint32_t num_lods, struct mlod_lod *mlod_l
                     num++;
             }
 
-            fwrite(&num, sizeof(uint32_t), 1, f_target);
+            membuffer_put_u32(target, num);
 
             for (k = 0; k < model_info->skeleton->num_animations; k++) {
                 anim = &model_info->skeleton->animations[k];
                 if (stricmp(anim->selection, model_info->skeleton->bones[j].name) == 0) {
                     num = (uint32_t)k;
-                    fwrite(&num, sizeof(uint32_t), 1, f_target);
+                    membuffer_put_u32(target, num);
                 }
             }
         }
@@ -1686,7 +2027,7 @@ void write_animations(FILE *f_target, uint32_t num_lods, struct mlod_lod *mlod_l
                 }
             }
 
-            fwrite(&index, sizeof(int32_t), 1, f_target);
+            membuffer_write(target, &index, sizeof(int32_t));
 
             if (index == -1) {
                 if (i == 0) { // we only report errors for the first LOD
@@ -1704,13 +2045,78 @@ void write_animations(FILE *f_target, uint32_t num_lods, struct mlod_lod *mlod_l
             if (model_info->autocenter)
                 anim->axis_pos = vector_sub(anim->axis_pos, model_info->centre_of_mass);
 
-            fwrite(&anim->axis_pos, sizeof(struct triplet), 1, f_target);
-            fwrite(&anim->axis_dir, sizeof(struct triplet), 1, f_target);
+            membuffer_write(target, &anim->axis_pos, sizeof(struct triplet));
+            membuffer_write(target, &anim->axis_dir, sizeof(struct triplet));
         }
     }
 }
 
 
+void free_odol_lod(struct odol_lod *odol_lod) {
+    int i;
+
+    free(odol_lod->proxies);
+    free(odol_lod->subskeleton_to_skeleton);
+    free(odol_lod->skeleton_to_subskeleton);
+    free(odol_lod->textures);
+    free(odol_lod->point_to_vertex);
+    free(odol_lod->vertex_to_point);
+    free(odol_lod->point_first_vertex);
+    free(odol_lod->vertex_next);
+    free(odol_lod->point_weights_start);
+    free(odol_lod->point_weights);
+    free(odol_lod->face_lookup);
+    free(odol_lod->faces);
+    free(odol_lod->uv_coords);
+    free(odol_lod->points);
+    free(odol_lod->normals);
+    free(odol_lod->sections);
+    free(odol_lod->vertexboneref);
+
+    for (i = 0; i < odol_lod->num_materials; i++) {
+        free(odol_lod->materials[i].textures);
+        free(odol_lod->materials[i].transforms);
+    }
+
+    free(odol_lod->materials);
+
+    for (i = 0; i < odol_lod->num_selections; i++) {
+        free(odol_lod->selections[i].faces);
+        free(odol_lod->selections[i].sections);
+        free(odol_lod->selections[i].vertices);
+        free(odol_lod->selections[i].vertex_weights);
+    }
+
+    free(odol_lod->selections);
+}
+
+
+int convert_lod_job(int job, void *data) {
+    /*
+     * Converts a single LOD and serializes it into its own buffer, so LODs
+     * can be converted in parallel and written in order afterwards.
+     */
+
+    extern __thread char *current_target;
+    struct lod_jobs *lod_jobs = (struct lod_jobs *)data;
+    struct odol_lod odol_lod;
+    struct dependencies *previous_dependencies;
+
+    current_target = lod_jobs->source;
+
+    // jobs might run on another thread, so files read for materials are collected per LOD
+    previous_dependencies = collect_dependencies(&lod_jobs->dependencies[job]);
+    convert_lod(&lod_jobs->mlod_lods[job], &odol_lod, lod_jobs->model_info);
+    restore_dependencies(previous_dependencies);
+
+    write_odol_lod(&lod_jobs->buffers[job], &odol_lod);
+
+    free_odol_lod(&odol_lod);
+
+    return 0;
+}
+
+
 int mlod2odol(char *source, char *target) {
     /*
      * Converts the MLOD P3D to ODOL. Overwrites the target if it already
@@ -1720,232 +2126,141 @@ int mlod2odol(char *source, char *target) {
      */
 
     extern struct arguments args;
-    extern char *current_target;
-    FILE *f_source;
-    FILE *f_temp;
+    extern __thread char *current_target;
     FILE *f_target;
-    char buffer[4096];
-    int datasize;
     int i;
-    int j;
     int success;
-    long fp_lods;
-    long fp_temp;
-    uint32_t version;
+    size_t fp_lods;
+    uint32_t fp_temp;
     uint32_t num_lods;
     struct mlod_lod *mlod_lods;
     struct model_info model_info;
-    struct odol_lod odol_lod;
+    struct lod_jobs lod_jobs;
+    struct membuffer output;
 
     current_target = source;
 
-#ifdef _WIN32
-    char temp_name[2048];
-    if (!GetTempFileName(".", "amk", 0, temp_name)) {
-        errorf("Failed to get temp file name (system error %i).\n", GetLastError());
-        return 1;
-    }
-    f_temp = fopen(temp_name, "wb+");
-#else
-    f_temp = tmpfile();
-#endif
-
-    if (!f_temp) {
-        errorf("Failed to open temp file.\n");
-#ifdef _WIN32
-        DeleteFile(temp_name);
-#endif
-        return 1;
-    }
-
-    // Open source and read LODs
-    f_source = fopen(source, "rb");
-    if (!f_source) {
-        errorf("Failed to open source file.\n");
-        fclose(f_temp);
-#ifdef _WIN32
-        DeleteFile(temp_name);
-#endif
-        return 2;
-    }
-
-    fgets(buffer, 5, f_source);
-    if (strncmp(buffer, "MLOD", 4) != 0) {
-        if (strcmp(args.positionals[0], "binarize") == 0)
+    // Read LODs
+    success = read_mlod(source, &mlod_lods);
+    if (success < 0) {
+        if (success == -1)
+            errorf("Failed to open source file.\n");
+        else if (success == -3)
+            errorf("Failed to read LODs.\n");
+        else if (strcmp(args.positionals[0], "binarize") == 0)
             errorf("Source file is not MLOD.\n");
-        fclose(f_temp);
-        fclose(f_source);
-#ifdef _WIN32
-        DeleteFile(temp_name);
-#endif
-        return -3;
-    }
 
-    fseek(f_source, 8, SEEK_SET);
-    fread(&num_lods, 4, 1, f_source);
-    mlod_lods = (struct mlod_lod *)safe_malloc(sizeof(struct mlod_lod) * num_lods);
-    num_lods = read_lods(f_source, mlod_lods, num_lods);
-    if (num_lods < 0) {
-        errorf("Failed to read LODs.\n");
-        free(mlod_lods);
-        fclose(f_temp);
-        fclose(f_source);
-#ifdef _WIN32
-        DeleteFile(temp_name);
-#endif
-        return 4;
+        return (success == -1) ? 2 : ((success == -2) ? -3 : 4);
     }
+    num_lods = success;
 
-    fclose(f_source);
+    membuffer_init(&output);
 
     // Write header
-    fwrite("ODOL", 4, 1, f_temp);
-    version = P3DVERSION;
-    fwrite(&version, sizeof(uint32_t), 1, f_temp); // version 70
-    fwrite("\0\0\0\0", sizeof(uint32_t), 1, f_temp); // AppID
-    fwrite("\0", 1, 1, f_temp); // muzzleFlash string
-    fwrite(&num_lods, 4, 1, f_temp);
+    membuffer_write(&output, "ODOL", 4);
+    membuffer_put_u32(&output, P3DVERSION); // version 70
+    membuffer_write(&output, "\0\0\0\0", 4); // AppID
+    membuffer_putc(&output, 0); // muzzleFlash string
+    membuffer_put_u32(&output, num_lods);
 
     // Write model info
     build_model_info(mlod_lods, num_lods, &model_info);
     success = read_model_config(source, model_info.skeleton);
     if (success > 0) {
         errorf("Failed to read model config.\n");
-        fclose(f_temp);
-#ifdef _WIN32
-        DeleteFile(temp_name);
-#endif
+        membuffer_free(&output);
         return success;
     }
 
     current_target = source;
 
-    write_model_info(f_temp, num_lods, &model_info);
+    write_model_info(&output, num_lods, &model_info);
 
     // Write animations
     if (model_info.skeleton->num_animations > 0) {
-        fputc(1, f_temp);
-        write_animations(f_temp, num_lods, mlod_lods, &model_info);
+        membuffer_putc(&output, 1);
+        write_animations(&output, num_lods, mlod_lods, &model_info);
     } else {
-        fputc(0, f_temp);
+        membuffer_putc(&output, 0);
     }
 
     // Write place holder LOD addresses
-    fp_lods = ftell(f_temp);
+    fp_lods = output.length;
     for (i = 0; i < num_lods; i++)
-        fwrite("\0\0\0\0\0\0\0\0", 8, 1, f_temp);
+        membuffer_write(&output, "\0\0\0\0\0\0\0\0", 8);
 
     // Write LOD face defaults (or rather, don't)
     for (i = 0; i < num_lods; i++)
-        fputc(1, f_temp);
+        membuffer_putc(&output, 1);
+
+    // Convert LODs, each into its own buffer
+    lod_jobs.source = source;
+    lod_jobs.mlod_lods = mlod_lods;
+    lod_jobs.model_info = &model_info;
+    lod_jobs.buffers = (struct membuffer *)safe_malloc(sizeof(struct membuffer) * num_lods);
+    lod_jobs.dependencies = (struct dependencies *)safe_malloc(sizeof(struct dependencies) * num_lods);
+    for (i = 0; i < num_lods; i++) {
+        membuffer_init(&lod_jobs.buffers[i]);
+        lod_jobs.dependencies[i].num_dependencies = 0;
+        lod_jobs.dependencies[i].dependencies = NULL;
+    }
+
+    run_jobs(num_lods, convert_lod_job, &lod_jobs);
+
+    current_target = source;
+
+    for (i = 0; i < num_lods; i++) {
+        add_dependencies(&lod_jobs.dependencies[i]);
+        free_dependencies(&lod_jobs.dependencies[i]);
+    }
+    free(lod_jobs.dependencies);
 
     // Write LODs
     for (i = 0; i < num_lods; i++) {
         // Write start address
-        fp_temp = ftell(f_temp);
-        fseek(f_temp, fp_lods + i * 4, SEEK_SET);
-        fwrite(&fp_temp, 4, 1, f_temp);
-        fseek(f_temp, 0, SEEK_END);
-
-        // Convert to ODOL
-        convert_lod(&mlod_lods[i], &odol_lod, &model_info);
-
-        // Write to file
-        write_odol_lod(f_temp, &odol_lod);
-
-        // Clean up
-        free(odol_lod.proxies);
-        free(odol_lod.subskeleton_to_skeleton);
-        free(odol_lod.skeleton_to_subskeleton);
-        free(odol_lod.textures);
-        free(odol_lod.point_to_vertex);
-        free(odol_lod.vertex_to_point);
-        free(odol_lod.face_lookup);
-        free(odol_lod.faces);
-        free(odol_lod.uv_coords);
-        free(odol_lod.points);
-        free(odol_lod.normals);
-        free(odol_lod.sections);
-        free(odol_lod.vertexboneref);
-
-        for (j = 0; j < odol_lod.num_materials; j++) {
-            free(odol_lod.materials[j].textures);
-            free(odol_lod.materials[j].transforms);
-        }
+        fp_temp = output.length;
+        memcpy(output.data + fp_lods + i * 4, &fp_temp, 4);
 
-        free(odol_lod.materials);
-
-        for (j = 0; j < odol_lod.num_selections; j++) {
-            free(odol_lod.selections[j].faces);
-            free(odol_lod.selections[j].sections);
-            free(odol_lod.selections[j].vertices);
-            free(odol_lod.selections[j].vertex_weights);
-        }
-
-        free(odol_lod.selections);
+        membuffer_write(&output, lod_jobs.buffers[i].data, lod_jobs.buffers[i].length);
+        membuffer_free(&lod_jobs.buffers[i]);
 
         // Write end address
-        fp_temp = ftell(f_temp);
-        fseek(f_temp, fp_lods + (num_lods + i) * 4, SEEK_SET);
-        fwrite(&fp_temp, 4, 1, f_temp);
-        fseek(f_temp, 0, SEEK_END);
+        fp_temp = output.length;
+        memcpy(output.data + fp_lods + (num_lods + i) * 4, &fp_temp, 4);
     }
 
+    free(lod_jobs.buffers);
+
     // Write PhysX (@todo)
-    fwrite("\x00\x03\x03\x03\x00\x00\x00\x00", 8, 1, f_temp);
-    fwrite("\x00\x03\x03\x03\x00\x00\x00\x00", 8, 1, f_temp);
-    fwrite("\x00\x00\x00\x00\x00\x03\x03\x03", 8, 1, f_temp);
-    fwrite("\x00\x00\x00\x00\x00\x03\x03\x03", 8, 1, f_temp);
-    fwrite("\x00\x00\x00\x00", 4, 1, f_temp);
+    membuffer_write(&output, "\x00\x03\x03\x03\x00\x00\x00\x00", 8);
+    membuffer_write(&output, "\x00\x03\x03\x03\x00\x00\x00\x00", 8);
+    membuffer_write(&output, "\x00\x00\x00\x00\x00\x03\x03\x03", 8);
+    membuffer_write(&output, "\x00\x00\x00\x00\x00\x03\x03\x03", 8);
+    membuffer_write(&output, "\x00\x00\x00\x00", 4);
 
-    // Write temp to target
-    fseek(f_temp, 0, SEEK_END);
-    datasize = ftell(f_temp);
+    free_lods(mlod_lods, num_lods);
+    free(mlod_lods);
 
+    free(model_info.lod_resolutions);
+    free(model_info.skeleton);
+
+    // Write buffer to target
     f_target = fopen(target, "wb");
     if (!f_target) {
         errorf("Failed to open target file.\n");
-        fclose(f_temp);
-#ifdef _WIN32
-        DeleteFile(temp_name);
-#endif
+        membuffer_free(&output);
         return 5;
     }
 
-    fseek(f_temp, 0, SEEK_SET);
-    for (i = 0; datasize - i >= sizeof(buffer); i += sizeof(buffer)) {
-        fread(buffer, sizeof(buffer), 1, f_temp);
-        fwrite(buffer, sizeof(buffer), 1, f_target);
-    }
-    fread(buffer, datasize - i, 1, f_temp);
-    fwrite(buffer, datasize - i, 1, f_target);
-
-    // Clean up
-    fclose(f_temp);
-    fclose(f_target);
+    success = (fwrite(output.data, output.length, 1, f_target) != 1);
+    success |= (fclose(f_target) != 0);
 
-#ifdef _WIN32
-    DeleteFile(temp_name);
-#endif
+    membuffer_free(&output);
 
-    for (i = 0; i < num_lods; i++) {
-        free(mlod_lods[i].points);
-        free(mlod_lods[i].facenormals);
-        free(mlod_lods[i].faces);
-        free(mlod_lods[i].mass);
-        free(mlod_lods[i].sharp_edges);
-
-        for (j = 0; j < mlod_lods[i].num_selections; j++) {
-            free(mlod_lods[i].selections[j].points);
-            free(mlod_lods[i].selections[j].faces);
-        }
-
-        free(mlod_lods[i].selections);
+    if (success) {
+        errorf("Failed to write target file.\n");
+        return 5;
     }
-    free(mlod_lods);
-
-    free(model_info.lod_resolutions);
-    free(model_info.skeleton);
 
     return 0;
 }
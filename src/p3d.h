@@ -21,8 +21,6 @@
 
 #define P3DVERSION 71
 
-#define MAXTEXTURES 128
-#define MAXMATERIALS 128
 #define MAXPROPERTIES 128
 
 #define LOD_GRAPHICAL_START                              0.0f
@@ -80,6 +78,7 @@
 
 
 //#include "utils.h"
+#include "cache.h"
 #include "model_config.h"
 #include "matrix.h"
 
@@ -105,15 +104,26 @@ struct mlod_face {
     uint32_t face_type;
     struct pseudovertextable table[4];
     uint32_t face_flags;
-    char texture_name[512];
+    char *texture_name;
     int texture_index;
-    char material_name[512];
+    char *material_name;
     int material_index;
-    char section_names[512];
+    char *section_names;
+};
+
+struct name_index {
+    char *name;
+    uint32_t index;
+};
+
+struct name_indices {
+    uint32_t num_entries;
+    uint32_t size_entries;
+    struct name_index *entries;
 };
 
 struct mlod_selection {
-    char name[512];
+    char *name;
     uint8_t *points;
     uint8_t *faces;
 };
@@ -132,6 +142,7 @@ struct mlod_lod {
     float resolution;
     uint32_t num_selections;
     struct mlod_selection *selections;
+    struct arena *strings;
 };
 
 struct odol_face {
@@ -194,6 +205,11 @@ struct odol_vertexboneref {
     uint8_t weights[4][2];
 };
 
+struct point_weight {
+    uint32_t bone;
+    uint8_t weight;
+};
+
 struct odol_lod {
     uint32_t num_proxies;
     struct odol_proxy *proxies;
@@ -215,6 +231,10 @@ struct odol_lod {
     struct material *materials;
     uint32_t *point_to_vertex;
     uint32_t *vertex_to_point;
+    uint32_t *point_first_vertex;
+    uint32_t *vertex_next;
+    uint32_t *point_weights_start;
+    struct point_weight *point_weights;
     uint32_t *face_lookup;
     uint32_t num_faces;
     uint32_t face_allocation_size;
@@ -302,6 +322,18 @@ struct model_info {
     uint32_t always_0;
 };
 
-int read_lods(FILE *f_source, struct mlod_lod *mlod_lods, uint32_t num_lods);
+struct lod_jobs {
+    char *source;
+    struct mlod_lod *mlod_lods;
+    struct model_info *model_info;
+    struct membuffer *buffers;
+    struct dependencies *dependencies;
+};
+
+void free_lods(struct mlod_lod *mlod_lods, uint32_t num_lods);
+
+int read_lods(char *data, size_t length, struct mlod_lod *mlod_lods, uint32_t num_lods);
+
+int read_mlod(char *source, struct mlod_lod **mlod_lods);
 
 int mlod2odol(char *source, char *target);
@@ -22,8 +22,11 @@
 #include <stdlib.h>
 #include <stdint.h>
 #include <string.h>
+#include <limits.h>
 #include <unistd.h>
 #include <errno.h>
+#include <sys/stat.h>
+#include <pthread.h>
 
 #ifdef _WIN32
 #include <windows.h>
@@ -34,6 +37,7 @@
 #endif
 
 #include "args.h"
+#include "cache.h"
 #include "filesystem.h"
 #include "utils.h"
 #include "preprocess.h"
@@ -44,6 +48,9 @@
     ((x) >= 'A' && (x) <= 'Z') || \
     ((x) >= '0' && (x) <= '9') )
 
+__thread char include_stack[MAXINCLUDES][1024];
+
+
 #if __APPLE__
 char *strchrnul(const char *s, int c) {
     char *first = strchr(s, c);
@@ -58,9 +65,59 @@ struct constants *constants_init() {
     struct constants *c = (struct constants *)safe_malloc(sizeof(struct constants));
     c->head = NULL;
     c->tail = NULL;
+    c->num_constants = 0;
+    c->size = 256;
+    c->table = (struct constant **)safe_malloc(sizeof(struct constant *) * c->size);
+    memset(c->table, 0, sizeof(struct constant *) * c->size);
+    c->num_lookups = 0;
+    c->num_hits = 0;
     return c;
 }
 
+void constants_add(struct constants *constants, struct constant *c) {
+    /*
+     * Appends the constant to the list of constants (which keeps the
+     * definition order) and inserts it into the hash table used for lookups.
+     * The table uses open addressing with linear probing and is grown once
+     * it is 3/4 full.
+     */
+
+    struct constant *tmp;
+    uint32_t i;
+
+    c->hash = hash_string(c->name, strlen(c->name));
+
+    c->last = constants->tail;
+    c->next = NULL;
+    if (constants->tail == NULL) {
+        constants->head = constants->tail = c;
+    } else {
+        constants->tail->next = c;
+        constants->tail = c;
+    }
+
+    constants->num_constants++;
+
+    if (constants->num_constants * 4 >= constants->size * 3) {
+        constants->size *= 2;
+        constants->table = (struct constant **)safe_realloc(constants->table,
+            sizeof(struct constant *) * constants->size);
+        memset(constants->table, 0, sizeof(struct constant *) * constants->size);
+
+        for (tmp = constants->head; tmp != NULL; tmp = tmp->next) {
+            i = tmp->hash & (constants->size - 1);
+            while (constants->table[i] != NULL)
+                i = (i + 1) & (constants->size - 1);
+            constants->table[i] = tmp;
+        }
+    } else {
+        i = c->hash & (constants->size - 1);
+        while (constants->table[i] != NULL)
+            i = (i + 1) & (constants->size - 1);
+        constants->table[i] = c;
+    }
+}
+
 bool constants_parse(struct constants *constants, char *definition, int line) {
     struct constant *c = (struct constant *)safe_malloc(sizeof(struct constant));
     char *ptr = definition;
@@ -225,14 +282,7 @@ bool constants_parse(struct constants *constants, char *definition, int line) {
         trim(c->value, strlen(c->value) + 1);
     }
 
-    c->last = constants->tail;
-    c->next = NULL;
-    if (constants->tail == NULL) {
-        constants->head = constants->tail = c;
-    } else {
-        constants->tail->next = c;
-        constants->tail = c;
-    }
+    constants_add(constants, c);
 
     if (c->num_args > 0) {
         for (i = 0; i < c->num_args; i++)
@@ -245,6 +295,11 @@ bool constants_parse(struct constants *constants, char *definition, int line) {
 
 bool constants_remove(struct constants *constants, char *name) {
     struct constant *c = constants_find(constants, name, 0);
+    uint32_t mask = constants->size - 1;
+    uint32_t i;
+    uint32_t j;
+    uint32_t k;
+
     if (c == NULL)
         return false;
 
@@ -258,97 +313,125 @@ bool constants_remove(struct constants *constants, char *name) {
     else
         c->last->next = c->next;
 
+    // remove from the table, shifting back following entries of the cluster
+    i = c->hash & mask;
+    while (constants->table[i] != c)
+        i = (i + 1) & mask;
+    constants->table[i] = NULL;
+
+    for (j = (i + 1) & mask; constants->table[j] != NULL; j = (j + 1) & mask) {
+        k = constants->table[j]->hash & mask;
+        if ((i <= j) ? (i < k && k <= j) : (i < k || k <= j))
+            continue;
+        constants->table[i] = constants->table[j];
+        constants->table[j] = NULL;
+        i = j;
+    }
+
+    constants->num_constants--;
+
     constant_free(c);
 
     return true;
 }
 
 struct constant *constants_find(struct constants *constants, char *name, int len) {
-    struct constant *c = constants->head;
+    /*
+     * Looks up the constant with the given name. If len is 0 or less, name
+     * is expected to be null-terminated, otherwise only the first len
+     * characters are used.
+     */
 
-    while (c != NULL) {
-        if (len <= 0 && strcmp(c->name, name) == 0)
-            break;
-        if (len > 0 && strlen(c->name) == len && strncmp(c->name, name, len) == 0)
-            break;
-        c = c->next;
+    struct constant *c;
+    uint32_t hash;
+    uint32_t i;
+
+    if (len <= 0)
+        len = strlen(name);
+
+    hash = hash_string(name, len);
+
+    constants->num_lookups++;
+
+    for (i = hash & (constants->size - 1); (c = constants->table[i]) != NULL; i = (i + 1) & (constants->size - 1)) {
+        if (c->hash == hash && strncmp(c->name, name, len) == 0 && c->name[len] == 0) {
+            constants->num_hits++;
+            return c;
+        }
     }
 
-    return c;
+    return NULL;
 }
 
-char *constants_preprocess(struct constants *constants, char *source, int line, struct constant_stack *constant_stack) {
+bool constants_preprocess(struct constants *constants, struct arena *scratch, char *source, size_t length,
+        int line, struct constant_stack *constant_stack, struct membuffer *target) {
+    /*
+     * Resolves the macros in the first length characters of source and
+     * appends the result to target. Macro arguments and bodies are kept in
+     * the scratch arena while they are expanded.
+     *
+     * Returns true on success and false on failure.
+     */
+
     char *ptr = source;
+    char *end = source + length;
     char *start;
-    char *result;
-    char *value;
     char **args;
-    int i;
-    int len = 0;
     int num_args;
     int level;
+    bool success;
     char in_string;
     struct constant *c;
     struct constant_stack *cs;
 
-    result = (char *)safe_malloc(1);
-    result[0] = 0;
-
     while (true) {
         // Non-tokens
         start = ptr;
-        while (*ptr != 0 && !IS_MACRO_CHAR(*ptr)) {
+        while (ptr < end && !IS_MACRO_CHAR(*ptr)) {
             if (*ptr == '"') {
                 ptr++;
-                while (*ptr != 0 && *ptr != '"')
+                while (ptr < end && *ptr != '"')
                     ptr++;
             }
-            ptr++; //also skips ending "
-        }
-        
-        
-        if (ptr - start > 0) {
-            len += ptr - start;
-            result = (char *)safe_realloc(result, len + 1);
-            strncat(result, start, ptr - start);
+            if (ptr < end)
+                ptr++; //also skips ending "
         }
 
-        if (*ptr == 0)
+        if (ptr - start > 0)
+            membuffer_write(target, start, ptr - start);
+
+        if (ptr >= end)
             break;
 
         // Potential tokens
         start = ptr;
-        while (IS_MACRO_CHAR(*ptr))
+        while (ptr < end && IS_MACRO_CHAR(*ptr))
             ptr++;
 
         c = constants_find(constants, start, ptr - start);
-        if (c == NULL || (c->num_args > 0 && *ptr != '(')) {
-            len += ptr - start;
-            result = (char *)safe_realloc(result, len + 1);
-            strncat(result, start, ptr - start);
+        if (c == NULL || (c->num_args > 0 && (ptr >= end || *ptr != '('))) {
+            membuffer_write(target, start, ptr - start);
             continue;
         }
 
         // prevent infinite loop
-        if (constant_stack != NULL) {
-            for (cs = constant_stack; cs != NULL; cs = cs->next) {
-                if (cs->constant == c)
-                    break;
-            }
-            if (cs != NULL && cs->constant == c)
-                continue;
+        for (cs = constant_stack; cs != NULL; cs = cs->next) {
+            if (cs->constant == c)
+                break;
         }
+        if (cs != NULL)
+            continue;
 
         args = NULL;
         num_args = 0;
-        if (*ptr == '(') {
+        if (ptr < end && *ptr == '(') {
             args = (char **)safe_malloc(sizeof(char *) * 4);
             ptr++;
             start = ptr;
 
             in_string = 0;
             level = 0;
-            while (*ptr != 0) {
+            while (ptr < end) {
                 if (in_string) {
                     if (*ptr == in_string)
                         in_string = 0;
@@ -361,7 +444,7 @@ char *constants_preprocess(struct constants *constants, char *source, int line,
                 } else if (level == 0 && (*ptr == ',' || *ptr == ')')) {
                     if (num_args > 0 && num_args % 4 == 0)
                         args = (char **)safe_realloc(args, sizeof(char *) * (num_args + 4));
-                    args[num_args] = safe_strndup(start, ptr - start);
+                    args[num_args] = arena_strndup(scratch, start, ptr - start);
                     num_args++;
                     if (*ptr == ')') {
                         break;
@@ -371,35 +454,25 @@ char *constants_preprocess(struct constants *constants, char *source, int line,
                 ptr++;
             }
 
-            if (*ptr == 0) {
+            if (ptr >= end) {
                 lerrorf(current_target, line,
                         "Incomplete argument list for macro \"%s\".\n", c->name);
-                return NULL;
+                free(args);
+                return false;
             } else {
                 ptr++;
             }
         }
 
-        value = constant_value(constants, c, num_args, args, line, constant_stack);
-        if (!value)
-            return NULL;
-
-        if (args) {
-            for (i = 0; i < num_args; i++)
-                free(args[i]);
-            free(args);
-        }
+        success = constant_value(constants, scratch, c, num_args, args, line, constant_stack, target);
 
-        len += strlen(value);
-        result = (char *)safe_realloc(result, len + 1);
-        strcat(result, value);
+        free(args);
 
-        free(value);
+        if (!success)
+            return false;
     }
 
-    free(source);
-
-    return result;
+    return true;
 }
 
 void constants_free(struct constants *constants) {
@@ -411,58 +484,100 @@ void constants_free(struct constants *constants) {
         constant_free(c);
         c = next;
     }
+    free(constants->table);
     free(constants);
 }
 
-char *constant_value(struct constants *constants, struct constant *constant,
-        int num_args, char **args, int line, struct constant_stack *constant_stack) {
+void trim_membuffer(struct membuffer *buffer, size_t start) {
+    /*
+     * Trims tabs and spaces on either side of everything after start in
+     * the buffer.
+     */
+
+    size_t i;
+
+    while (buffer->length > start && (buffer->data[buffer->length - 1] == ' ' ||
+            buffer->data[buffer->length - 1] == '\t'))
+        buffer->length--;
+
+    for (i = start; i < buffer->length && (buffer->data[i] == ' ' || buffer->data[i] == '\t'); i++);
+    if (i > start) {
+        memmove(buffer->data + start, buffer->data + i, buffer->length - i);
+        buffer->length -= i - start;
+    }
+
+    buffer->data[buffer->length] = 0;
+    buffer->data[buffer->length + 1] = 0;
+}
+
+bool constant_value(struct constants *constants, struct arena *scratch, struct constant *constant,
+        int num_args, char **args, int line, struct constant_stack *constant_stack, struct membuffer *target) {
+    /*
+     * Appends the value of the constant for the given arguments to target,
+     * resolving macros in the arguments and the value itself.
+     *
+     * Returns true on success and false on failure.
+     */
+
     int i;
-    char *result;
+    size_t start;
+    size_t size;
+    char *value;
     char *ptr;
     char *tmp;
-    struct constant_stack *cs;
+    struct constant_stack cs;
 
     if (num_args != constant->num_args) {
         if (num_args)
             lerrorf(current_target, line,
                     "Macro \"%s\" expects %i arguments, %i given.\n", constant->name, constant->num_args, num_args);
-        return NULL;
+        return false;
     }
 
+    // the arguments are expanded at the end of target and moved to the arena
     for (i = 0; i < num_args; i++) {
-        args[i] = constants_preprocess(constants, args[i], line, constant_stack);
-        trim(args[i], strlen(args[i]) + 1);
-        if (args[i] == NULL)
-            return NULL;
+        start = target->length;
+        if (!constants_preprocess(constants, scratch, args[i], strlen(args[i]), line, constant_stack, target))
+            return false;
+        trim_membuffer(target, start);
+
+        args[i] = arena_strndup(scratch, target->data + start, target->length - start);
+
+        target->length = start;
+        target->data[start] = 0;
+        target->data[start + 1] = 0;
     }
 
     if (num_args == 0) {
-        result = safe_strdup(constant->value);
+        value = constant->value;
+        size = strlen(value);
     } else {
-        result = safe_strdup("");
+        size = strlen(constant->value);
+        for (i = 0; i < constant->num_occurences; i++)
+            size += strlen(args[constant->occurrences[i][0]]);
+
+        value = (char *)arena_alloc(scratch, size + 1);
+        tmp = value;
         ptr = constant->value;
         for (i = 0; i < constant->num_occurences; i++) {
-            tmp = safe_strndup(ptr, constant->occurrences[i][1] - (ptr - constant->value));
-            result = (char *)safe_realloc(result, strlen(result) + strlen(tmp) + strlen(args[constant->occurrences[i][0]]) + 1);
-            strcat(result, tmp);
-            free(tmp);
-            strcat(result, args[constant->occurrences[i][0]]);
+            memcpy(tmp, ptr, constant->occurrences[i][1] - (ptr - constant->value));
+            tmp += constant->occurrences[i][1] - (ptr - constant->value);
+            memcpy(tmp, args[constant->occurrences[i][0]], strlen(args[constant->occurrences[i][0]]));
+            tmp += strlen(args[constant->occurrences[i][0]]);
             ptr = constant->value + constant->occurrences[i][1];
         }
-        result = (char *)safe_realloc(result, strlen(result) + strlen(ptr) + 1);
-        strcat(result, ptr);
+        strcpy(tmp, ptr);
     }
 
-    cs = (struct constant_stack *)malloc(sizeof(struct constant_stack));
-    cs->next = constant_stack;
-    cs->constant = constant;
+    cs.next = constant_stack;
+    cs.constant = constant;
 
-    result = constants_preprocess(constants, result, line, cs);
-    trim(result, strlen(result) + 1);
-
-    free(cs);
+    start = target->length;
+    if (!constants_preprocess(constants, scratch, value, size, line, &cs, target))
+        return false;
+    trim_membuffer(target, start);
 
-    return result;
+    return true;
 }
 
 void constant_free(struct constant *constant) {
@@ -474,118 +589,211 @@ void constant_free(struct constant *constant) {
 }
 
 
-bool matches_includepath(char *path, char *includepath, char *includefolder) {
+bool read_prefix(char *folder, char *prefix, size_t buffsize) {
     /*
-     * Checks if a given file can be matched to an include path by traversing
-     * backwards through the filesystem until a $PBOPREFIX$ file is found.
-     * If the prefix file, together with the diretory strucure, matches the
-     * included path, true is returned.
+     * Reads the $PBOPREFIX$ file in the given folder into prefix, stripping
+     * trailing line breaks and backslashes and making sure the result starts
+     * with a backslash.
+     *
+     * Returns true if a prefix file was found, false otherwise.
      */
 
-    int i;
-    char cwd[2048];
     char prefixpath[2048];
-    char prefixedpath[2048];
     char *ptr;
     FILE *f_prefix;
 
-    strncpy(cwd, path, 2048);
-    ptr = cwd + strlen(cwd);
+    snprintf(prefixpath, sizeof(prefixpath), "%s%c$PBOPREFIX$", folder, PATHSEP);
 
-    while (strcmp(includefolder, cwd) != 0) {
-        while (*ptr != PATHSEP)
-            ptr--;
-        *ptr = 0;
+    f_prefix = fopen(prefixpath, "rb");
+    if (!f_prefix)
+        return false;
 
-        strncpy(prefixpath, cwd, 2048);
-        strcat(prefixpath, PATHSEP_STR);
-        strcat(prefixpath, "$PBOPREFIX$");
+    prefix[0] = '\\';
+    if (fgets(prefix + 1, buffsize - 1, f_prefix) == NULL)
+        prefix[1] = 0;
+    fclose(f_prefix);
+
+    ptr = prefix + strlen(prefix) - 1;
+    while (ptr >= prefix && (*ptr == '\n' || *ptr == '\r' || *ptr == '\\'))
+        *(ptr--) = 0;
+
+    for (ptr = prefix; *ptr != 0; ptr++) {
+        if (*ptr == '/')
+            *ptr = '\\';
+    }
+
+    // compensate for leading slash in PBOPREFIX
+    if (prefix[1] == '\\')
+        memmove(prefix, prefix + 1, strlen(prefix));
+
+    return true;
+}
+
+
+struct include_index *include_indices = NULL;
+pthread_mutex_t include_indices_lock = PTHREAD_MUTEX_INITIALIZER;
 
-        f_prefix = fopen(prefixpath, "rb");
-        if (!f_prefix)
-            continue;
 
-        fgets(prefixedpath, sizeof(prefixedpath), f_prefix);
-        fclose(f_prefix);
+void include_index_add(struct include_index *index, char *virtual_path, char *real_path) {
+    /*
+     * Adds a virtual path -> real path mapping to the given include index.
+     * The table uses open addressing with linear probing. If the virtual path
+     * is already known, the first mapping is kept, just like the first match
+     * used to win when walking the include folder.
+     */
 
-        if (prefixedpath[strlen(prefixedpath) - 1] == '\n')
-            prefixedpath[strlen(prefixedpath) - 1] = 0;
-        if (prefixedpath[strlen(prefixedpath) - 1] == '\r')
-            prefixedpath[strlen(prefixedpath) - 1] = 0;
-        if (prefixedpath[strlen(prefixedpath) - 1] == '\\')
-            prefixedpath[strlen(prefixedpath) - 1] = 0;
+    struct include_entry *old_entries;
+    uint32_t old_size;
+    uint32_t hash;
+    uint32_t i;
 
-        strcat(prefixedpath, path + strlen(cwd));
+    if ((index->num_entries + 1) * 4 >= index->size * 3) {
+        old_entries = index->entries;
+        old_size = index->size;
 
-        for (i = 0; i < strlen(prefixedpath); i++) {
-            if (prefixedpath[i] == '/')
-                prefixedpath[i] = '\\';
+        index->size = (old_size == 0) ? 256 : old_size * 2;
+        index->entries = (struct include_entry *)safe_malloc(sizeof(struct include_entry) * index->size);
+        memset(index->entries, 0, sizeof(struct include_entry) * index->size);
+
+        for (i = 0; i < old_size; i++) {
+            if (old_entries[i].virtual_path == NULL)
+                continue;
+            hash = old_entries[i].hash & (index->size - 1);
+            while (index->entries[hash].virtual_path != NULL)
+                hash = (hash + 1) & (index->size - 1);
+            index->entries[hash] = old_entries[i];
         }
 
-        // compensate for missing leading slash in PBOPREFIX
-        if (prefixedpath[0] != '\\')
-            return (strcmp(prefixedpath, includepath+1) == 0);
-        else
-            return (strcmp(prefixedpath, includepath) == 0);
+        free(old_entries);
     }
 
-    return false;
+    hash = hash_string(virtual_path, strlen(virtual_path));
+    i = hash & (index->size - 1);
+    while (index->entries[i].virtual_path != NULL) {
+        if (index->entries[i].hash == hash && strcmp(index->entries[i].virtual_path, virtual_path) == 0)
+            return;
+        i = (i + 1) & (index->size - 1);
+    }
+
+    index->entries[i].hash = hash;
+    index->entries[i].virtual_path = safe_strdup(virtual_path);
+    index->entries[i].real_path = safe_strdup(real_path);
+    index->num_entries++;
 }
 
 
-int find_file_helper(char *includepath, char *origin, char *includefolder, char *actualpath, char *cwd) {
+char *include_index_find(struct include_index *index, char *includepath) {
     /*
-     * Finds the file referenced in includepath in the includefolder. origin
-     * describes the file in which the include is used (used for relative
-     * includes). actualpath holds the return pointer. The 4th arg is used for
-     * recursion on Windows and should be passed as NULL initially.
-     *
-     * Returns 0 on success, 1 on error and 2 if no file could be found.
+     * Looks up the real path for the given include path.
      *
-     * Please note that relative includes always return a path, even if that
-     * file does not exist.
+     * Returns a pointer to the real path or NULL if it isn't indexed.
      */
 
-    // relative include, this shit is easy
-    if (includepath[0] != '\\') {
-        strncpy(actualpath, origin, 2048);
-        char *target = actualpath + strlen(actualpath) - 1;
-        while (*target != PATHSEP && target >= actualpath)
-            target--;
-        strncpy(target + 1, includepath, 2046 - (target - actualpath));
+    uint32_t hash;
+    uint32_t i;
 
-#ifndef _WIN32
-        int i;
-        for (i = 0; i < strlen(actualpath); i++) {
-            if (actualpath[i] == '\\')
-                actualpath[i] = '/';
-        }
-#endif
+    if (index->size == 0)
+        return NULL;
 
-        return 0;
+    hash = hash_string(includepath, strlen(includepath));
+    i = hash & (index->size - 1);
+    while (index->entries[i].virtual_path != NULL) {
+        if (index->entries[i].hash == hash && strcmp(index->entries[i].virtual_path, includepath) == 0)
+            return index->entries[i].real_path;
+        i = (i + 1) & (index->size - 1);
     }
 
-    char filename[2048];
-    char *ptr = includepath + strlen(includepath);
+    return NULL;
+}
+
+
+void include_index_stamp(struct include_index *index, char *path, time_t mtime) {
+    /*
+     * Records the modification time of a directory or prefix file, used to
+     * check whether a persisted index is still valid.
+     */
+
+    index->stamps = (struct include_stamp *)safe_realloc(index->stamps,
+        sizeof(struct include_stamp) * (index->num_stamps + 1));
+    index->stamps[index->num_stamps].path = safe_strdup(path);
+    index->stamps[index->num_stamps].mtime = mtime;
+    index->num_stamps++;
+}
+
+
+void include_index_clear(struct include_index *index) {
+    uint32_t i;
+
+    for (i = 0; i < index->size; i++) {
+        if (index->entries[i].virtual_path == NULL)
+            continue;
+        free(index->entries[i].virtual_path);
+        free(index->entries[i].real_path);
+    }
+    free(index->entries);
+
+    for (i = 0; i < index->num_stamps; i++)
+        free(index->stamps[i].path);
+    free(index->stamps);
+
+    index->num_entries = 0;
+    index->size = 0;
+    index->entries = NULL;
+    index->num_stamps = 0;
+    index->stamps = NULL;
+}
+
+
+bool include_index_stale(struct include_index *index) {
+    /*
+     * Checks all recorded directories and prefix files for changes. Adding,
+     * removing or renaming files changes the mtime of the containing folder,
+     * so this is enough to catch every change relevant to the index.
+     */
+
+    struct stat st;
+    uint32_t i;
+
+    for (i = 0; i < index->num_stamps; i++) {
+        if (stat(index->stamps[i].path, &st) != 0)
+            return true;
+        if (st.st_mtime != index->stamps[i].mtime)
+            return true;
+    }
 
-    while (*ptr != '\\')
-        ptr--;
-    ptr++;
+    return false;
+}
 
-    strncpy(filename, ptr, 2048);
 
 #ifdef _WIN32
-    if (cwd == NULL)
-        return find_file_helper(includepath, origin, includefolder, actualpath, includefolder);
+int include_index_build_helper(struct include_index *index, char *cwd, char *prefix, size_t prefix_root) {
+    /*
+     * Recursive helper for building the include index on Windows. prefix is
+     * the prefix of the closest parent folder with a $PBOPREFIX$ file (or
+     * NULL), prefix_root the length of that folder's path.
+     */
 
     WIN32_FIND_DATA file;
     HANDLE handle = NULL;
+    struct stat st;
+    char own_prefix[2048];
     char mask[2048];
+    char virtual_path[4096];
+    char *ptr;
+
+    if (stat(cwd, &st) == 0)
+        include_index_stamp(index, cwd, st.st_mtime);
+
+    if (read_prefix(cwd, own_prefix, sizeof(own_prefix))) {
+        prefix = own_prefix;
+        prefix_root = strlen(cwd);
 
-    GetFullPathName(includefolder, 2048, includefolder, NULL);
+        snprintf(mask, sizeof(mask), "%s\\$PBOPREFIX$", cwd);
+        if (stat(mask, &st) == 0)
+            include_index_stamp(index, mask, st.st_mtime);
+    }
 
-    GetFullPathName(cwd, 2048, mask, NULL);
-    sprintf(mask, "%s\\*", mask);
+    snprintf(mask, sizeof(mask), "%s\\*", cwd);
 
     handle = FindFirstFile(mask, &file);
     if (handle == INVALID_HANDLE_VALUE)
@@ -598,137 +806,859 @@ int find_file_helper(char *includepath, char *origin, char *includefolder, char
         if (strcmp(file.cFileName, ".git") == 0)
             continue;
 
-        GetFullPathName(cwd, 2048, mask, NULL);
-        sprintf(mask, "%s\\%s", mask, file.cFileName);
+        snprintf(mask, sizeof(mask), "%s\\%s", cwd, file.cFileName);
         if (file.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY) {
-            if (!find_file_helper(includepath, origin, includefolder, actualpath, mask)) {
-                FindClose(handle);
-                return 0;
-            }
-        } else {
-            if (strcmp(filename, file.cFileName) == 0 && matches_includepath(mask, includepath, includefolder)) {
-                strncpy(actualpath, mask, 2048);
-                FindClose(handle);
-                return 0;
+            include_index_build_helper(index, mask, prefix, prefix_root);
+        } else if (prefix != NULL) {
+            snprintf(virtual_path, sizeof(virtual_path), "%s%s", prefix, mask + prefix_root);
+            for (ptr = virtual_path; *ptr != 0; ptr++) {
+                if (*ptr == '/')
+                    *ptr = '\\';
             }
+            include_index_add(index, virtual_path, mask);
         }
     } while (FindNextFile(handle, &file));
 
     FindClose(handle);
+
+    return 0;
+}
+#endif
+
+
+int include_index_build(struct include_index *index) {
+    /*
+     * Walks the include folder once and maps every file below a $PBOPREFIX$
+     * to its virtual path (the prefix of the closest parent folder followed
+     * by the path relative to that folder).
+     *
+     * Returns 0 on success and a positive integer on failure.
+     */
+
+#ifdef _WIN32
+    char includefolder[2048];
+
+    GetFullPathName(index->includefolder, 2048, includefolder, NULL);
+
+    return include_index_build_helper(index, includefolder, NULL, 0);
 #else
     FTS *tree;
     FTSENT *f;
-    char *argv[] = { includefolder, NULL };
-
-    tree = fts_open(argv, FTS_LOGICAL | FTS_NOSTAT, NULL);
+    char *argv[] = { index->includefolder, NULL };
+    char virtual_path[4096];
+    char prefixfile[2048];
+    char *ptr;
+    struct stat st;
+    int num_levels = 0;
+    struct {
+        char *prefix;
+        size_t root;
+    } *levels = NULL;
+
+    tree = fts_open(argv, FTS_LOGICAL, NULL);
     if (tree == NULL)
         return 1;
 
     while ((f = fts_read(tree))) {
-        if (!strcmp(f->fts_name, ".git"))
+        if (!strcmp(f->fts_name, ".git")) {
             fts_set(tree, f, FTS_SKIP);
+            continue;
+        }
 
         switch (f->fts_info) {
             case FTS_DNR:
             case FTS_ERR:
-                fts_close(tree);
-                return 2;
+                goto error;
             case FTS_NS: continue;
             case FTS_DP: continue;
-            case FTS_D: continue;
             case FTS_DC: continue;
         }
 
-        if (strcmp(filename, f->fts_name) == 0 && matches_includepath(f->fts_path, includepath, includefolder)) {
-            strncpy(actualpath, f->fts_path, 2048);
-            fts_close(tree);
-            return 0;
+        if (f->fts_info == FTS_D) {
+            if (f->fts_level >= num_levels) {
+                levels = safe_realloc(levels, sizeof(*levels) * (f->fts_level + 1));
+                for (; num_levels <= f->fts_level; num_levels++)
+                    levels[num_levels].prefix = NULL;
+            }
+
+            include_index_stamp(index, f->fts_path, f->fts_statp->st_mtime);
+
+            free(levels[f->fts_level].prefix);
+            levels[f->fts_level].prefix = (char *)safe_malloc(2048);
+            if (read_prefix(f->fts_path, levels[f->fts_level].prefix, 2048)) {
+                levels[f->fts_level].root = f->fts_pathlen;
+
+                snprintf(prefixfile, sizeof(prefixfile), "%s/$PBOPREFIX$", f->fts_path);
+                if (stat(prefixfile, &st) == 0)
+                    include_index_stamp(index, prefixfile, st.st_mtime);
+            } else if (f->fts_level > 0 && levels[f->fts_level - 1].prefix != NULL) {
+                strcpy(levels[f->fts_level].prefix, levels[f->fts_level - 1].prefix);
+                levels[f->fts_level].root = levels[f->fts_level - 1].root;
+            } else {
+                free(levels[f->fts_level].prefix);
+                levels[f->fts_level].prefix = NULL;
+            }
+
+            continue;
         }
+
+        if (f->fts_level == 0 || levels[f->fts_level - 1].prefix == NULL)
+            continue;
+
+        snprintf(virtual_path, sizeof(virtual_path), "%s%s",
+            levels[f->fts_level - 1].prefix, f->fts_path + levels[f->fts_level - 1].root);
+        for (ptr = virtual_path; *ptr != 0; ptr++) {
+            if (*ptr == '/')
+                *ptr = '\\';
+        }
+
+        include_index_add(index, virtual_path, f->fts_path);
     }
 
     fts_close(tree);
-#endif
+    while (num_levels > 0)
+        free(levels[--num_levels].prefix);
+    free(levels);
 
-    // check for file without pboprefix
-    strncpy(filename, includefolder, sizeof(filename));
-    strncat(filename, includepath, sizeof(filename) - strlen(filename) - 1);
-#ifndef _WIN32
-    int i;
-    for (i = 0; i < strlen(filename); i++) {
-        if (filename[i] == '\\')
-            filename[i] = '/';
-    }
-#endif
-    if (access(filename, F_OK) != -1) {
-        strcpy(actualpath, filename);
-        return 0;
-    }
+    return 0;
+
+error:
+    fts_close(tree);
+    while (num_levels > 0)
+        free(levels[--num_levels].prefix);
+    free(levels);
 
     return 2;
+#endif
 }
 
 
-int find_file(char *includepath, char *origin, char *actualpath) {
+struct include_index *include_index_get(char *includefolder) {
     /*
-     * Finds the file referenced in includepath in the includefolder. origin
-     * describes the file in which the include is used (used for relative
-     * includes). actualpath holds the return pointer. The 4th arg is used for
-     * recursion on Windows and should be passed as NULL initially.
-     *
-     * Returns 0 on success, 1 on error and 2 if no file could be found.
+     * Returns the include index for the given folder, building it if it
+     * doesn't exist yet or if a loaded one is outdated. Once an index has
+     * been returned, it isn't modified anymore, so it can be used from
+     * multiple jobs at once.
      *
-     * Please note that relative includes always return a path, even if that
-     * file does not exist.
+     * Returns NULL if the folder could not be indexed.
      */
 
-    extern struct arguments args;
-    int i;
-    int success;
-    char *temp = (char *)malloc(2048);
+    struct include_index *index;
 
-    for (i = 0; i < args.num_includefolders; i++) {
-        strcpy(temp, args.includefolders[i]);
-        success = find_file_helper(includepath, origin, temp, actualpath, NULL);
+    pthread_mutex_lock(&include_indices_lock);
 
-        if (success != 2) {
-            free(temp);
-            return success;
-        }
+    for (index = include_indices; index != NULL; index = index->next) {
+        if (strcmp(index->includefolder, includefolder) == 0)
+            break;
     }
 
-    free(temp);
+    if (index != NULL && index->checked)
+        goto done;
 
-    return 2;
+    if (index != NULL && !include_index_stale(index)) {
+        index->checked = true;
+        goto done;
+    }
+
+    if (index == NULL) {
+        index = (struct include_index *)safe_malloc(sizeof(struct include_index));
+        memset(index, 0, sizeof(struct include_index));
+        index->includefolder = safe_strdup(includefolder);
+        index->next = include_indices;
+        include_indices = index;
+    } else {
+        include_index_clear(index);
+    }
+
+    index->dirty = true;
+    index->checked = true;
+    index->built = time(NULL);
+    if (include_index_build(index)) {
+        index->checked = false;
+        index = NULL;
+    }
+
+done:
+    pthread_mutex_unlock(&include_indices_lock);
+
+    return index;
 }
 
 
-int preprocess(char *source, FILE *f_target, struct constants *constants, struct lineref *lineref) {
+int include_index_load(char *path) {
     /*
-     * Writes the contents of source into the target file pointer, while
-     * recursively resolving constants and includes using the includefolder
-     * for finding included files.
+     * Loads include indices previously persisted with include_index_save.
+     * Indices are validated against the file system before being used, so
+     * outdated entries in the file are harmless. Invalid files are ignored
+     * and the indices are rebuilt.
      *
-     * Returns 0 on success, a positive integer on failure.
+     * Returns 0 on success (or if the file doesn't exist yet) and a positive
+     * integer if the file was invalid.
      */
 
-    extern char *current_target;
-    extern char include_stack[MAXINCLUDES][1024];
-    int file_index;
-    int line = 0;
-    int i = 0;
-    int j = 0;
-    int level = 0;
-    int level_true = 0;
-    int level_comment = 0;
+    FILE *f_source;
+    char line[8192];
+    char *tab;
+    long mtime;
+    struct include_index *index = NULL;
+
+    f_source = fopen(path, "rb");
+    if (!f_source)
+        return 0;
+
+    if (fgets(line, sizeof(line), f_source) == NULL || strcmp(line, "armake include index 1\n") != 0)
+        goto error;
+
+    while (fgets(line, sizeof(line), f_source)) {
+        if (line[strlen(line) - 1] != '\n')
+            goto error;
+        line[strlen(line) - 1] = 0;
+
+        if (line[0] == 'F' && line[1] == ' ') {
+            index = (struct include_index *)safe_malloc(sizeof(struct include_index));
+            memset(index, 0, sizeof(struct include_index));
+            index->includefolder = safe_strdup(line + 2);
+            index->next = include_indices;
+            include_indices = index;
+        } else if (index == NULL) {
+            goto error;
+        } else if (line[0] == 'S' && line[1] == ' ') {
+            mtime = strtol(line + 2, &tab, 10);
+            if (*tab != '\t')
+                goto error;
+            include_index_stamp(index, tab + 1, (time_t)mtime);
+        } else if (line[0] == 'E' && line[1] == ' ') {
+            tab = strchr(line + 2, '\t');
+            if (tab == NULL)
+                goto error;
+            *tab = 0;
+            include_index_add(index, line + 2, tab + 1);
+        } else {
+            goto error;
+        }
+    }
+
+    fclose(f_source);
+    return 0;
+
+error:
+    fclose(f_source);
+    include_index_free();
+    warningf("Ignoring invalid include index file \"%s\".\n", path);
+    return 1;
+}
+
+
+int include_index_save(char *path) {
+    /*
+     * Persists all include indices to the given file if any of them were
+     * (re)built in this run.
+     *
+     * Returns 0 on success and a positive integer on failure.
+     */
+
+    FILE *f_target;
+    struct include_index *index;
+    uint32_t i;
+    long mtime;
+    bool dirty = false;
+
+    for (index = include_indices; index != NULL; index = index->next)
+        dirty |= index->dirty;
+
+    if (!dirty)
+        return 0;
+
+    f_target = fopen(path, "wb");
+    if (!f_target) {
+        errorf("Failed to open include index file \"%s\".\n", path);
+        return 1;
+    }
+
+    fputs("armake include index 1\n", f_target);
+
+    for (index = include_indices; index != NULL; index = index->next) {
+        fprintf(f_target, "F %s\n", index->includefolder);
+        for (i = 0; i < index->num_stamps; i++) {
+            // folders changed in the second they were indexed in might have changed again since
+            mtime = (long)index->stamps[i].mtime;
+            if (index->dirty && index->stamps[i].mtime >= index->built)
+                mtime = -1;
+            fprintf(f_target, "S %ld\t%s\n", mtime, index->stamps[i].path);
+        }
+        for (i = 0; i < index->size; i++) {
+            if (index->entries[i].virtual_path == NULL)
+                continue;
+            fprintf(f_target, "E %s\t%s\n", index->entries[i].virtual_path, index->entries[i].real_path);
+        }
+    }
+
+    fclose(f_target);
+
+    return 0;
+}
+
+
+void include_index_free() {
+    struct include_index *index;
+
+    while (include_indices != NULL) {
+        index = include_indices;
+        include_indices = index->next;
+
+        include_index_clear(index);
+        free(index->includefolder);
+        free(index);
+    }
+}
+
+
+int find_file_helper(char *includepath, char *origin, char *includefolder, char *actualpath) {
+    /*
+     * Finds the file referenced in includepath in the includefolder. origin
+     * describes the file in which the include is used (used for relative
+     * includes). actualpath holds the return pointer.
+     *
+     * Returns 0 on success, 1 on error and 2 if no file could be found.
+     *
+     * Please note that relative includes always return a path, even if that
+     * file does not exist.
+     */
+
+    // relative include, this shit is easy
+    if (includepath[0] != '\\') {
+        strncpy(actualpath, origin, 2048);
+        char *target = actualpath + strlen(actualpath) - 1;
+        while (*target != PATHSEP && target >= actualpath)
+            target--;
+        strncpy(target + 1, includepath, 2046 - (target - actualpath));
+
+#ifndef _WIN32
+        int i;
+        for (i = 0; i < strlen(actualpath); i++) {
+            if (actualpath[i] == '\\')
+                actualpath[i] = '/';
+        }
+#endif
+
+        return 0;
+    }
+
+    char filename[2048];
+    struct include_index *index;
+    char *real_path;
+
+    index = include_index_get(includefolder);
+    if (index == NULL)
+        return 1;
+
+    real_path = include_index_find(index, includepath);
+    if (real_path != NULL) {
+        strncpy(actualpath, real_path, 2048);
+        return 0;
+    }
+
+    // check for file without pboprefix
+    strncpy(filename, includefolder, sizeof(filename));
+    strncat(filename, includepath, sizeof(filename) - strlen(filename) - 1);
+#ifndef _WIN32
+    int i;
+    for (i = 0; i < strlen(filename); i++) {
+        if (filename[i] == '\\')
+            filename[i] = '/';
+    }
+#endif
+    if (access(filename, F_OK) != -1) {
+        strcpy(actualpath, filename);
+        return 0;
+    }
+
+    return 2;
+}
+
+
+int find_file(char *includepath, char *origin, char *actualpath) {
+    /*
+     * Finds the file referenced in includepath in the includefolder. origin
+     * describes the file in which the include is used (used for relative
+     * includes). actualpath holds the return pointer.
+     *
+     * Absolute includes are resolved through a per-folder index of all
+     * prefixed files, which is built on first use (or loaded from the file
+     * given with --indexcache).
+     *
+     * Returns 0 on success, 1 on error and 2 if no file could be found.
+     *
+     * Please note that relative includes always return a path, even if that
+     * file does not exist.
+     */
+
+    extern struct arguments args;
+    int i;
     int success;
-    size_t buffsize;
+
+    for (i = 0; i < args.num_includefolders; i++) {
+        success = find_file_helper(includepath, origin, args.includefolders[i], actualpath);
+
+        if (success != 2)
+            return success;
+    }
+
+    return 2;
+}
+
+
+#define HEADER_DEFINE 0
+#define HEADER_UNDEF 1
+#define HEADER_CHECK 2
+
+struct header_op {
+    int type;
+    char *name;
+    bool defined;
+    struct constant *constant;
+    char *file;
+    int line;
+};
+
+struct header_record {
+    int num_ops;
+    struct header_op *ops;
+    bool cacheable;
+    time_t mtime;
+    off_t size;
+    struct dependencies dependencies;
+    bool replayed;
+    struct header_record *next;
+};
+
+struct cached_header {
+    char *path;
+    struct header_record *variants;
+};
+
+pthread_mutex_t header_cache_lock = PTHREAD_MUTEX_INITIALIZER;
+struct cached_header *cached_headers;
+int num_cached_headers;
+int size_cached_headers;
+
+// the header currently being preprocessed and recorded by this thread
+__thread struct header_record *current_header;
+
+// the variant loaded with --pch
+struct header_record *loaded_pch;
+
+
+struct constant *copy_constant(struct constant *constant) {
+    struct constant *result;
+
+    result = (struct constant *)safe_malloc(sizeof(struct constant));
+    *result = *constant;
+    result->name = safe_strdup(constant->name);
+    result->value = safe_strdup(constant->value);
+
+    if (constant->occurrences != NULL) {
+        result->occurrences = (int (*)[2])safe_malloc(sizeof(int) * 2 * MAX(constant->num_occurences, 1));
+        memcpy(result->occurrences, constant->occurrences, sizeof(int) * 2 * constant->num_occurences);
+    }
+
+    return result;
+}
+
+
+bool header_touches(struct header_record *record, char *name) {
+    /*
+     * Checks if the recorded header defined or undefined the given constant
+     * itself, in which case checks for it don't depend on the state the
+     * header was included with.
+     */
+
+    int i;
+
+    for (i = record->num_ops - 1; i >= 0; i--) {
+        if (record->ops[i].type != HEADER_CHECK && strcmp(record->ops[i].name, name) == 0)
+            return true;
+    }
+
+    return false;
+}
+
+
+void header_record_op(struct header_record *record, int type, char *name, bool defined,
+        struct constant *constant, char *file, int line) {
+    struct header_op *op;
+
+    if (type == HEADER_CHECK && header_touches(record, name))
+        return;
+
+    if (record->num_ops % 64 == 0)
+        record->ops = (struct header_op *)safe_realloc(record->ops, sizeof(struct header_op) * (record->num_ops + 64));
+
+    op = &record->ops[record->num_ops++];
+    op->type = type;
+    op->name = (constant != NULL) ? NULL : safe_strdup(name);
+    op->defined = defined;
+    op->constant = (constant != NULL) ? copy_constant(constant) : NULL;
+    op->file = (file != NULL) ? safe_strdup(file) : NULL;
+    op->line = line;
+
+    if (constant != NULL)
+        op->name = op->constant->name;
+}
+
+
+void header_record_free(struct header_record *record) {
+    int i;
+
+    for (i = 0; i < record->num_ops; i++) {
+        if (record->ops[i].constant != NULL)
+            constant_free(record->ops[i].constant);
+        else
+            free(record->ops[i].name);
+        free(record->ops[i].file);
+    }
+    free(record->ops);
+    free_dependencies(&record->dependencies);
+}
+
+
+void header_merge(struct header_record *target, struct header_record *source) {
+    /*
+     * Appends the operations of a header to the record of the header that
+     * included it.
+     */
+
+    int i;
+    struct header_op *op;
+
+    for (i = 0; i < source->num_ops; i++) {
+        op = &source->ops[i];
+        header_record_op(target, op->type, op->name, op->defined, op->constant, op->file, op->line);
+    }
+
+    if (!source->cacheable)
+        target->cacheable = false;
+}
+
+
+char *header_cache_key(char *path) {
+    /*
+     * Returns the absolute path of the given header for use as key in the
+     * header cache, so it is found no matter how it was referred to. Falls
+     * back to the path as given if it can't be resolved. The result has to
+     * be freed by the caller.
+     */
+
+    char *key;
+#ifdef _WIN32
+    DWORD length;
+
+    key = (char *)safe_malloc(2048);
+    length = GetFullPathName(path, 2048, key, NULL);
+    if (length > 0 && length < 2048)
+        return key;
+    free(key);
+#else
+    key = realpath(path, NULL);
+    if (key != NULL)
+        return key;
+#endif
+
+    return safe_strdup(path);
+}
+
+
+struct cached_header *find_cached_header(char *path) {
+    /*
+     * Returns the slot for the given path in the header cache. Needs to be
+     * called with the header cache lock held.
+     */
+
+    uint32_t i;
+
+    i = hash_string(path, strlen(path)) & (size_cached_headers - 1);
+    while (cached_headers[i].path != NULL && strcmp(cached_headers[i].path, path) != 0)
+        i = (i + 1) & (size_cached_headers - 1);
+
+    return &cached_headers[i];
+}
+
+
+struct header_record *add_cached_header(char *key, struct header_record *record) {
+    /*
+     * Adds the record as another variant of the header with the given key
+     * to the cache, taking ownership of it. Returns the cached variant.
+     */
+
+    struct cached_header *old_headers;
+    struct cached_header *slot;
+    struct header_record *variant;
+    int old_size;
+    int i;
+
+    variant = (struct header_record *)safe_malloc(sizeof(struct header_record));
+    *variant = *record;
+
+    pthread_mutex_lock(&header_cache_lock);
+
+    if ((num_cached_headers + 1) * 4 > size_cached_headers * 3) {
+        old_headers = cached_headers;
+        old_size = size_cached_headers;
+
+        size_cached_headers = (old_size == 0) ? 64 : old_size * 2;
+        cached_headers = (struct cached_header *)safe_malloc(sizeof(struct cached_header) * size_cached_headers);
+        for (i = 0; i < size_cached_headers; i++)
+            cached_headers[i].path = NULL;
+
+        for (i = 0; i < old_size; i++) {
+            if (old_headers[i].path != NULL)
+                *find_cached_header(old_headers[i].path) = old_headers[i];
+        }
+        free(old_headers);
+    }
+
+    slot = find_cached_header(key);
+    if (slot->path == NULL) {
+        slot->path = safe_strdup(key);
+        slot->variants = NULL;
+        num_cached_headers++;
+    }
+
+    variant->next = slot->variants;
+    slot->variants = variant;
+
+    pthread_mutex_unlock(&header_cache_lock);
+
+    return variant;
+}
+
+
+bool header_matches(struct header_record *variant, struct constants *constants, struct stat *st) {
+    int i;
+
+    if (variant->mtime != st->st_mtime || variant->size != st->st_size)
+        return false;
+
+    for (i = 0; i < variant->num_ops; i++) {
+        if (variant->ops[i].type != HEADER_CHECK)
+            continue;
+        if ((constants_find(constants, variant->ops[i].name, 0) != NULL) != variant->ops[i].defined)
+            return false;
+    }
+
+    return true;
+}
+
+
+bool replay_cached_header(char *path, char *key, struct constants *constants) {
+    /*
+     * Looks for a variant of the given header that was recorded with the
+     * same state of all constants it checks, and if there is one, applies
+     * its definitions instead of preprocessing the file again. The key is
+     * the normalized path from header_cache_key.
+     *
+     * Returns true if the header was replayed.
+     */
+
+    struct stat st;
+    struct cached_header *cached;
+    struct header_record *variant;
+    struct header_op *op;
+    int i;
+
+    if (stat(path, &st) != 0)
+        return false;
+
+    variant = NULL;
+
+    pthread_mutex_lock(&header_cache_lock);
+    if (size_cached_headers > 0) {
+        cached = find_cached_header(key);
+        if (cached->path != NULL) {
+            for (variant = cached->variants; variant != NULL; variant = variant->next) {
+                if (header_matches(variant, constants, &st))
+                    break;
+            }
+        }
+    }
+    if (variant != NULL)
+        variant->replayed = true;
+    pthread_mutex_unlock(&header_cache_lock);
+
+    // variants are never changed or freed once they are in the cache
+    if (variant == NULL)
+        return false;
+
+    for (i = 0; i < variant->num_ops; i++) {
+        op = &variant->ops[i];
+        if (op->type == HEADER_DEFINE) {
+            if (constants_remove(constants, op->name))
+                lnwarningf(op->file, op->line, "redefinition-wo-undef",
+                        "Constant \"%s\" is being redefined without an #undef.\n", op->name);
+            constants_add(constants, copy_constant(op->constant));
+        } else if (op->type == HEADER_UNDEF) {
+            constants_remove(constants, op->name);
+        }
+    }
+
+    add_dependencies(&variant->dependencies);
+
+    if (current_header != NULL)
+        header_merge(current_header, variant);
+
+    return true;
+}
+
+
+int preprocess_header(char *path, struct membuffer *target, struct constants *constants, struct lineref *lineref) {
+    /*
+     * Preprocesses an included file. Headers that only define constants are
+     * recorded and cached for the rest of the run, keyed by their path and
+     * the state of every constant they check with #ifdef/#ifndef before
+     * defining it themselves. Including them again with the same state just
+     * replays their definitions.
+     *
+     * Returns 0 on success, a positive integer on failure.
+     */
+
+    extern __thread char include_stack[MAXINCLUDES][1024];
+    struct header_record record;
+    struct header_record *previous_header;
+    struct dependencies *previous_dependencies;
+    struct stat st;
+    char *key;
+    int success;
+    int i;
+
+    // circular includes and too deep nesting are left to preprocess to report
+    for (i = 0; i < MAXINCLUDES && include_stack[i][0] != 0; i++) {
+        if (strcmp(path, include_stack[i]) == 0)
+            break;
+    }
+
+    key = header_cache_key(path);
+
+    if (i < MAXINCLUDES && include_stack[i][0] == 0 && replay_cached_header(path, key, constants)) {
+        // the caller pops the include stack like after preprocess
+        strcpy(include_stack[i], path);
+        free(key);
+        return 0;
+    }
+
+    memset(&record, 0, sizeof(struct header_record));
+    record.cacheable = stat(path, &st) == 0;
+    if (record.cacheable) {
+        record.mtime = st.st_mtime;
+        record.size = st.st_size;
+    }
+
+    previous_header = current_header;
+    current_header = &record;
+    previous_dependencies = collect_dependencies(&record.dependencies);
+
+    success = preprocess(path, target, constants, lineref);
+
+    restore_dependencies(previous_dependencies);
+    current_header = previous_header;
+
+    add_dependencies(&record.dependencies);
+
+    if (success == 0 && current_header != NULL)
+        header_merge(current_header, &record);
+
+    if (success == 0 && record.cacheable)
+        add_cached_header(key, &record);
+    else
+        header_record_free(&record);
+
+    free(key);
+
+    return success;
+}
+
+
+int read_logical_line(char **pos, char *end, struct membuffer *buffer) {
+    /*
+     * Reads the next logical line starting at pos into the buffer, joining
+     * lines ending with a backslash and normalizing line endings. The line
+     * always ends with a new line. pos is advanced past the line.
+     *
+     * Returns the number of physical lines read, 0 at the end of the data.
+     */
+
+    char *start;
+    char *next;
+    int lines = 0;
+
+    buffer->length = 0;
+    buffer->data[0] = 0;
+
+    while (*pos < end) {
+        start = *pos;
+        next = (char *)memchr(start, '\n', end - start);
+        next = (next == NULL) ? end : next + 1;
+        *pos = next;
+        lines++;
+
+        membuffer_write(buffer, start, next - start);
+
+        // Add trailing new line if necessary
+        if (buffer->data[buffer->length - 1] != '\n')
+            membuffer_putc(buffer, '\n');
+
+        // fix windows line endings
+        if (buffer->length >= 2 && buffer->data[buffer->length - 2] == '\r') {
+            buffer->data[buffer->length - 2] = '\n';
+            buffer->data[--buffer->length] = 0;
+        }
+
+        if (buffer->length < 2 || buffer->data[buffer->length - 2] != '\\' || *pos >= end)
+            break;
+
+        // drop the backslash and new line, the next line continues this one
+        buffer->length -= 2;
+        buffer->data[buffer->length] = 0;
+    }
+
+    return lines;
+}
+
+
+int preprocess(char *source, struct membuffer *target, struct constants *constants, struct lineref *lineref) {
+    /*
+     * Writes the contents of source into the target buffer, while
+     * recursively resolving constants and includes using the includefolder
+     * for finding included files.
+     *
+     * Returns 0 on success, a positive integer on failure.
+     */
+
+    extern __thread char *current_target;
+    extern __thread char include_stack[MAXINCLUDES][1024];
+    int file_index;
+    int line = 0;
+    int lines;
+    int i = 0;
+    int j = 0;
+    int level = 0;
+    int level_true = 0;
+    int level_comment = 0;
+    int success = 0;
+    long datasize;
+    size_t length;
+    char *data;
+    char *pos;
+    char *end;
     char *buffer;
     char *ptr;
     char *directive;
     char *directive_args;
     char in_string = 0;
+    bool found;
     char includepath[2048];
     char actualpath[2048];
+    struct membuffer line_buffer;
+    struct arena *scratch;
     FILE *f_source;
 
     current_target = source;
@@ -753,17 +1683,35 @@ int preprocess(char *source, FILE *f_target, struct constants *constants, struct
 
     strcpy(include_stack[i], source);
 
+    // the whole file is read at once and split into lines in memory
     f_source = fopen(source, "rb");
     if (!f_source) {
         errorf("Failed to open %s.\n", source);
         return 1;
     }
 
+    fseek(f_source, 0, SEEK_END);
+    datasize = ftell(f_source);
+    fseek(f_source, 0, SEEK_SET);
+
+    data = (char *)safe_malloc(MAX(datasize, 1));
+    if (datasize < 0 || (datasize > 0 && fread(data, datasize, 1, f_source) != 1)) {
+        errorf("Failed to read %s.\n", source);
+        fclose(f_source);
+        free(data);
+        return 1;
+    }
+
+    fclose(f_source);
+
+    add_dependency(source);
+
+    pos = data;
+    end = data + datasize;
+
     // Skip byte order mark if it exists
-    if (fgetc(f_source) == 0xef)
-        fseek(f_source, 3, SEEK_SET);
-    else
-        fseek(f_source, 0, SEEK_SET);
+    if (datasize > 0 && (unsigned char)data[0] == 0xef)
+        pos = MIN(data + 3, end);
 
     file_index = lineref->num_files;
     if (strchr(source, PATHSEP) == NULL)
@@ -793,46 +1741,23 @@ int preprocess(char *source, FILE *f_target, struct constants *constants, struct
     // if (constants[3].value == 0)
     //     constants[3].value = (char *)safe_malloc(1);
 
+    membuffer_init(&line_buffer);
+    scratch = arena_init();
+
     while (true) {
         // get line and add next lines if line ends with a backslash
-        buffer = NULL;
-        while (buffer == NULL || (strlen(buffer) >= 2 && buffer[strlen(buffer) - 2] == '\\')) {
-            ptr = NULL;
-            buffsize = 0;
-            if (getline(&ptr, &buffsize, f_source) == -1) {
-                free(ptr);
-                ptr = NULL;
-                break;
-            }
-
-            line++;
-
-            if (buffer == NULL) {
-                buffer = ptr;
-            } else {
-                buffer = (char *)safe_realloc(buffer, strlen(buffer) + 2 + buffsize);
-                strcpy(buffer + strlen(buffer) - 2, ptr);
-                free(ptr);
-            }
-
-            // Add trailing new line if necessary
-            if (strlen(buffer) >= 1 && buffer[strlen(buffer) - 1] != '\n')
-                strcat(buffer, "\n");
-
-            // fix windows line endings
-            if (strlen(buffer) >= 2 && buffer[strlen(buffer) - 2] == '\r') {
-                buffer[strlen(buffer) - 2] = '\n';
-                buffer[strlen(buffer) - 1] = 0;
-            }
-        }
-
-        if (buffer == NULL)
+        lines = read_logical_line(&pos, end, &line_buffer);
+        if (lines == 0)
             break;
 
+        line += lines;
+        buffer = line_buffer.data;
+        length = line_buffer.length;
+
         // Check for block comment delimiters
-        for (i = 0; i < strlen(buffer); i++) {
+        for (i = 0; i < length; i++) {
             if (in_string != 0) {
-                if (buffer[i] == in_string && buffer[i-1] != '\\')
+                if (buffer[i] == in_string && (i == 0 || buffer[i-1] != '\\'))
                     in_string = 0;
                 else
                     continue;
@@ -846,6 +1771,7 @@ int preprocess(char *source, FILE *f_target, struct constants *constants, struct
             if (buffer[i] == '/' && buffer[i+1] == '/' && level_comment == 0) {
                 buffer[i+1] = 0;
                 buffer[i] = '\n';
+                length = i + 1;
             } else if (buffer[i] == '/' && buffer[i+1] == '*') {
                 level_comment++;
                 buffer[i] = ' ';
@@ -864,16 +1790,17 @@ int preprocess(char *source, FILE *f_target, struct constants *constants, struct
             }
         }
 
-        // trim leading spaces
-        trim_leading(buffer, strlen(buffer) + 1);
+        // skip leading spaces
+        while (*buffer == ' ' || *buffer == '\t') {
+            buffer++;
+            length--;
+        }
 
         // skip lines inside untrue ifs
         if (level > level_true) {
-            if ((strlen(buffer) < 5 || strncmp(buffer, "#else", 5) != 0) &&
-                    (strlen(buffer) < 6 || strncmp(buffer, "#endif", 6) != 0)) {
-                free(buffer);
+            if ((length < 5 || strncmp(buffer, "#else", 5) != 0) &&
+                    (length < 6 || strncmp(buffer, "#endif", 6) != 0))
                 continue;
-            }
         }
 
         // second constant is line number
@@ -887,11 +1814,7 @@ int preprocess(char *source, FILE *f_target, struct constants *constants, struct
             while (*ptr == ' ' || *ptr == '\t')
                 ptr++;
 
-            directive = (char *)safe_malloc(strlen(ptr) + 1);
-            strcpy(directive, ptr);
-            *(strchrnul(directive, ' ')) = 0;
-            *(strchrnul(directive, '\t')) = 0;
-            *(strchrnul(directive, '\n')) = 0;
+            directive = safe_strndup(ptr, strcspn(ptr, " \t\n"));
 
             ptr += strlen(directive);
             while (*ptr == ' ' || *ptr == '\t')
@@ -900,32 +1823,34 @@ int preprocess(char *source, FILE *f_target, struct constants *constants, struct
             *(strchrnul(directive_args, '\n')) = 0;
 
             if (strcmp(directive, "include") == 0) {
-                for (i = 0; i < strlen(directive_args) ; i++) {
-                    if (directive_args[i] == '<' || directive_args[i] == '>')
-                        directive_args[i] = '"';
+                for (ptr = directive_args; *ptr != 0; ptr++) {
+                    if (*ptr == '<' || *ptr == '>')
+                        *ptr = '"';
                 }
                 if (strchr(directive_args, '"') == NULL) {
                     lerrorf(source, line, "Failed to parse #include.\n");
-                    fclose(f_source);
-                    return 5;
+                    free(directive);
+                    success = 5;
+                    goto cleanup;
                 }
                 strncpy(includepath, strchr(directive_args, '"') + 1, sizeof(includepath));
                 if (strchr(includepath, '"') == NULL) {
                     lerrorf(source, line, "Failed to parse #include.\n");
-                    fclose(f_source);
-                    return 6;
+                    free(directive);
+                    success = 6;
+                    goto cleanup;
                 }
                 *strchr(includepath, '"') = 0;
                 if (find_file(includepath, source, actualpath)) {
                     lerrorf(source, line, "Failed to find %s.\n", includepath);
-                    fclose(f_source);
-                    return 7;
+                    free(directive);
+                    success = 7;
+                    goto cleanup;
                 }
 
                 free(directive);
-                free(buffer);
 
-                success = preprocess(actualpath, f_target, constants, lineref);
+                success = preprocess_header(actualpath, target, constants, lineref);
 
                 for (i = 0; i < MAXINCLUDES && include_stack[i][0] != 0; i++);
                 include_stack[i - 1][0] = 0;
@@ -933,24 +1858,28 @@ int preprocess(char *source, FILE *f_target, struct constants *constants, struct
                 current_target = source;
 
                 if (success)
-                    return success;
+                    goto cleanup;
                 continue;
             } else if (strcmp(directive, "define") == 0) {
                 if (!constants_parse(constants, directive_args, line)) {
                     lerrorf(source, line, "Failed to parse macro definition.\n");
-                    fclose(f_source);
-                    return 3;
+                    free(directive);
+                    success = 3;
+                    goto cleanup;
                 }
+                if (current_header != NULL)
+                    header_record_op(current_header, HEADER_DEFINE, NULL, true, constants->tail, source, line);
             } else if (strcmp(directive, "undef") == 0) {
                 constants_remove(constants, directive_args);
-            } else if (strcmp(directive, "ifdef") == 0) {
-                level++;
-                if (constants_find(constants, directive_args, 0))
-                    level_true++;
-            } else if (strcmp(directive, "ifndef") == 0) {
+                if (current_header != NULL)
+                    header_record_op(current_header, HEADER_UNDEF, directive_args, false, NULL, NULL, line);
+            } else if (strcmp(directive, "ifdef") == 0 || strcmp(directive, "ifndef") == 0) {
                 level++;
-                if (!constants_find(constants, directive_args, 0))
+                found = constants_find(constants, directive_args, 0) != NULL;
+                if (found == (strcmp(directive, "ifdef") == 0))
                     level_true++;
+                if (current_header != NULL)
+                    header_record_op(current_header, HEADER_CHECK, directive_args, found, NULL, NULL, line);
             } else if (strcmp(directive, "else") == 0) {
                if (level == level_true)
                    level_true--;
@@ -959,29 +1888,32 @@ int preprocess(char *source, FILE *f_target, struct constants *constants, struct
             } else if (strcmp(directive, "endif") == 0) {
                if (level == 0) {
                    lerrorf(source, line, "Unexpected #endif.\n");
-                   fclose(f_source);
-                   return 4;
+                   free(directive);
+                   success = 4;
+                   goto cleanup;
                }
                if (level == level_true)
                    level_true--;
                level--;
             } else {
                 lerrorf(source, line, "Unknown preprocessor directive \"%s\".\n", directive);
-                fclose(f_source);
-                return 5;
+                free(directive);
+                success = 5;
+                goto cleanup;
             }
 
             free(directive);
-        } else if (strlen(buffer) > 1) {
-            buffer = constants_preprocess(constants, buffer, line, NULL);
-            if (buffer == NULL) {
+        } else if (length > 1) {
+            // headers with output can't just be replayed
+            if (current_header != NULL)
+                current_header->cacheable = false;
+
+            if (!constants_preprocess(constants, scratch, buffer, length, line, NULL, target)) {
                 lerrorf(source, line, "Failed to resolve macros.\n");
-                fclose(f_source);
-                return success;
+                success = 2;
+                goto cleanup;
             }
 
-            fputs(buffer, f_target);
-
             lineref->file_index[lineref->num_lines] = file_index;
             lineref->line_number[lineref->num_lines] = line;
 
@@ -991,11 +1923,450 @@ int preprocess(char *source, FILE *f_target, struct constants *constants, struct
                 lineref->line_number = (uint32_t *)safe_realloc(lineref->line_number, 4 * (lineref->num_lines + LINEINTERVAL));
             }
         }
+    }
+
+cleanup:
+    membuffer_free(&line_buffer);
+    arena_free(scratch);
+    free(data);
+
+    return success;
+}
+
+
+void pch_put_string(struct membuffer *target, char *string) {
+    membuffer_write(target, string, strlen(string) + 1);
+}
+
+
+void pch_put_i64(struct membuffer *target, int64_t value) {
+    membuffer_write(target, &value, sizeof(int64_t));
+}
+
+
+bool pch_read(char **pos, char *end, void *target, size_t size) {
+    if (end - *pos < size)
+        return false;
+
+    memcpy(target, *pos, size);
+    *pos += size;
+
+    return true;
+}
+
+
+char *pch_read_string(char **pos, char *end) {
+    char *terminator;
+    char *result;
+
+    terminator = (char *)memchr(*pos, 0, end - *pos);
+    if (terminator == NULL)
+        return NULL;
+
+    result = safe_strdup(*pos);
+    *pos = terminator + 1;
+
+    return result;
+}
+
+
+int pch_write(char *path, char *header, struct header_record *record) {
+    /*
+     * Writes the recorded definitions of the given header to a snapshot
+     * file. Besides the definitions in order (name, number of arguments,
+     * value and argument occurrences), the snapshot contains the constants
+     * the header checked and the size and modification time of every file
+     * that was read, so outdated snapshots can be detected.
+     *
+     * Returns 0 on success and a positive integer on failure.
+     */
+
+    struct membuffer output;
+    struct header_op *op;
+    struct stat st;
+    FILE *f_target;
+    int success;
+    int i;
+
+    membuffer_init(&output);
+
+    membuffer_write(&output, PCHMAGIC, 4);
+    membuffer_put_u32(&output, PCHVERSION);
+    pch_put_string(&output, header);
+
+    membuffer_put_u32(&output, record->dependencies.num_dependencies);
+    for (i = 0; i < record->dependencies.num_dependencies; i++) {
+        if (stat(record->dependencies.dependencies[i], &st) != 0) {
+            errorf("Failed to stat %s.\n", record->dependencies.dependencies[i]);
+            membuffer_free(&output);
+            return 1;
+        }
+        pch_put_string(&output, record->dependencies.dependencies[i]);
+        pch_put_i64(&output, (int64_t)st.st_mtime);
+        pch_put_i64(&output, (int64_t)st.st_size);
+    }
+
+    membuffer_put_u32(&output, record->num_ops);
+    for (i = 0; i < record->num_ops; i++) {
+        op = &record->ops[i];
+
+        membuffer_putc(&output, (char)op->type);
+        membuffer_put_u32(&output, op->line);
+        pch_put_string(&output, op->name);
+
+        if (op->type == HEADER_CHECK) {
+            membuffer_putc(&output, (char)op->defined);
+        } else if (op->type == HEADER_DEFINE) {
+            pch_put_string(&output, op->file);
+            membuffer_put_u32(&output, op->constant->num_args);
+            pch_put_string(&output, op->constant->value);
+            membuffer_put_u32(&output, op->constant->num_occurences);
+            if (op->constant->num_occurences > 0)
+                membuffer_put_array(&output, op->constant->occurrences, sizeof(int), op->constant->num_occurences * 2);
+        }
+    }
+
+    f_target = fopen(path, "wb");
+    if (!f_target) {
+        errorf("Failed to open %s.\n", path);
+        membuffer_free(&output);
+        return 2;
+    }
+
+    success = fwrite(output.data, output.length, 1, f_target) != 1;
+    success |= fclose(f_target) != 0;
+
+    membuffer_free(&output);
 
-        free(buffer);
+    if (success) {
+        errorf("Failed to write %s.\n", path);
+        return 3;
+    }
+
+    return 0;
+}
+
+
+bool pch_read_op(char **pos, char *end, struct header_op *op) {
+    /*
+     * Reads a single recorded operation from a snapshot. Argument
+     * occurrences are checked against the arguments and value of the
+     * constant, since they are used as indices when it is expanded.
+     *
+     * Returns false if the operation is invalid.
+     */
+
+    uint32_t temp;
+    char type;
+    char defined;
+    struct constant *constant;
+    size_t length;
+    int i;
+
+    memset(op, 0, sizeof(struct header_op));
+
+    if (!pch_read(pos, end, &type, 1) || !pch_read(pos, end, &temp, 4))
+        return false;
+
+    op->type = type;
+    op->line = temp;
+
+    op->name = pch_read_string(pos, end);
+    if (op->name == NULL)
+        return false;
+
+    if (op->type == HEADER_UNDEF)
+        return true;
+
+    if (op->type == HEADER_CHECK) {
+        if (!pch_read(pos, end, &defined, 1))
+            return false;
+        op->defined = defined != 0;
+        return true;
+    }
+
+    if (op->type != HEADER_DEFINE)
+        return false;
+
+    op->file = pch_read_string(pos, end);
+    if (op->file == NULL)
+        return false;
+
+    // from here on the name is owned by the constant
+    constant = (struct constant *)safe_malloc(sizeof(struct constant));
+    memset(constant, 0, sizeof(struct constant));
+    constant->name = op->name;
+    op->constant = constant;
+    op->defined = true;
+
+    if (!pch_read(pos, end, &temp, 4) || temp > INT_MAX)
+        return false;
+    constant->num_args = temp;
+
+    constant->value = pch_read_string(pos, end);
+    if (constant->value == NULL)
+        return false;
+
+    if (!pch_read(pos, end, &temp, 4) || temp > (end - *pos) / (sizeof(int) * 2))
+        return false;
+    constant->num_occurences = temp;
+
+    if (temp > 0) {
+        constant->occurrences = (int (*)[2])safe_malloc(sizeof(int) * 2 * temp);
+        if (!pch_read(pos, end, constant->occurrences, sizeof(int) * 2 * temp))
+            return false;
+    }
+
+    length = strlen(constant->value);
+    for (i = 0; i < constant->num_occurences; i++) {
+        if (constant->occurrences[i][0] < 0 || constant->occurrences[i][0] >= constant->num_args)
+            return false;
+        if (constant->occurrences[i][1] < ((i > 0) ? constant->occurrences[i - 1][1] : 0) ||
+                constant->occurrences[i][1] > length)
+            return false;
+    }
+
+    return true;
+}
+
+
+int pch_load(char *path) {
+    /*
+     * Loads a snapshot written with "armake pch" into the header cache, so
+     * includes of the precompiled header with a matching state of the
+     * constants it checks are replayed instead of preprocessed. Snapshots
+     * are ignored with a warning if any of the files they were created from
+     * changed since.
+     *
+     * Returns 0 on success and a positive integer if the file couldn't be
+     * read or is invalid.
+     */
+
+    FILE *f_source;
+    struct header_record record;
+    struct stat st;
+    char *data;
+    char *pos;
+    char *end;
+    char *header = NULL;
+    char *key;
+    char *dependency;
+    long datasize;
+    uint32_t temp;
+    int64_t mtime;
+    int64_t size;
+    bool outdated = false;
+    int i;
+
+    f_source = fopen(path, "rb");
+    if (!f_source) {
+        errorf("Failed to open %s.\n", path);
+        return 1;
+    }
+
+    fseek(f_source, 0, SEEK_END);
+    datasize = ftell(f_source);
+    fseek(f_source, 0, SEEK_SET);
+
+    data = (char *)safe_malloc(MAX(datasize, 1));
+    if (datasize < 0 || (datasize > 0 && fread(data, datasize, 1, f_source) != 1)) {
+        errorf("Failed to read %s.\n", path);
+        fclose(f_source);
+        free(data);
+        return 2;
     }
 
     fclose(f_source);
 
+    memset(&record, 0, sizeof(struct header_record));
+    record.cacheable = true;
+
+    pos = data;
+    end = data + datasize;
+
+    if (datasize < 8 || strncmp(data, PCHMAGIC, 4) != 0)
+        goto error;
+    pos += 4;
+
+    if (!pch_read(&pos, end, &temp, 4) || temp != PCHVERSION)
+        goto error;
+
+    header = pch_read_string(&pos, end);
+    if (header == NULL)
+        goto error;
+
+    if (!pch_read(&pos, end, &temp, 4))
+        goto error;
+
+    for (i = 0; i < temp; i++) {
+        dependency = pch_read_string(&pos, end);
+        if (dependency == NULL)
+            goto error;
+
+        record.dependencies.dependencies = (char **)safe_realloc(record.dependencies.dependencies,
+            sizeof(char *) * (record.dependencies.num_dependencies + 1));
+        record.dependencies.dependencies[record.dependencies.num_dependencies++] = dependency;
+
+        if (!pch_read(&pos, end, &mtime, 8) || !pch_read(&pos, end, &size, 8))
+            goto error;
+
+        if (stat(dependency, &st) != 0 || (int64_t)st.st_mtime != mtime || (int64_t)st.st_size != size) {
+            outdated = true;
+        } else if (strcmp(dependency, header) == 0) {
+            record.mtime = st.st_mtime;
+            record.size = st.st_size;
+        }
+    }
+
+    if (!pch_read(&pos, end, &temp, 4) || temp > end - pos)
+        goto error;
+
+    record.ops = (struct header_op *)safe_malloc(sizeof(struct header_op) * MAX(temp, 1));
+    for (i = 0; i < temp; i++) {
+        record.num_ops++;
+        if (!pch_read_op(&pos, end, &record.ops[i]))
+            goto error;
+    }
+
+    if (pos != end)
+        goto error;
+
+    if (outdated) {
+        warningf("Ignoring outdated precompiled header %s.\n", path);
+        header_record_free(&record);
+    } else {
+        key = header_cache_key(header);
+        loaded_pch = add_cached_header(key, &record);
+        free(key);
+    }
+
+    free(header);
+    free(data);
+
     return 0;
+
+error:
+    errorf("Invalid precompiled header %s.\n", path);
+    header_record_free(&record);
+    free(header);
+    free(data);
+
+    return 3;
+}
+
+
+int pch_create(char *header, char *target) {
+    /*
+     * Preprocesses the given header and writes the resulting definitions
+     * to a snapshot that can be passed to binarize/build with --pch.
+     *
+     * Returns 0 on success and a positive integer on failure.
+     */
+
+    extern __thread char *current_target;
+    struct header_record record;
+    struct dependencies *previous_dependencies;
+    struct constants *constants;
+    struct lineref *lineref;
+    struct membuffer output;
+    char actualpath[2048];
+    char *key;
+    int success;
+    int i;
+
+    // absolute include paths are resolved like an #include would be
+    if (header[0] == '\\') {
+        if (find_file(header, "", actualpath)) {
+            errorf("Failed to find %s.\n", header);
+            return 1;
+        }
+    } else {
+        strncpy(actualpath, header, sizeof(actualpath) - 1);
+        actualpath[sizeof(actualpath) - 1] = 0;
+    }
+
+    // store the path the header cache will look it up with
+    key = header_cache_key(actualpath);
+    strncpy(actualpath, key, sizeof(actualpath) - 1);
+    actualpath[sizeof(actualpath) - 1] = 0;
+    free(key);
+
+    current_target = actualpath;
+
+    for (i = 0; i < MAXINCLUDES; i++)
+        include_stack[i][0] = 0;
+
+    constants = constants_init();
+
+    lineref = (struct lineref *)safe_malloc(sizeof(struct lineref));
+    lineref->num_files = 0;
+    lineref->num_lines = 0;
+    lineref->file_names = (char **)safe_malloc(sizeof(char **) * FILEINTERVAL);
+    lineref->file_index = (uint32_t *)safe_malloc(sizeof(uint32_t) * LINEINTERVAL);
+    lineref->line_number = (uint32_t *)safe_malloc(sizeof(uint32_t) * LINEINTERVAL);
+
+    membuffer_init(&output);
+
+    memset(&record, 0, sizeof(struct header_record));
+    record.cacheable = true;
+
+    current_header = &record;
+    previous_dependencies = collect_dependencies(&record.dependencies);
+
+    success = preprocess(actualpath, &output, constants, lineref);
+
+    restore_dependencies(previous_dependencies);
+    current_header = NULL;
+
+    if (success) {
+        errorf("Failed to preprocess %s.\n", actualpath);
+    } else if (!record.cacheable) {
+        errorf("%s produces output and can't be precompiled.\n", actualpath);
+        success = 1;
+    } else {
+        success = pch_write(target, actualpath, &record);
+    }
+
+    header_record_free(&record);
+    membuffer_free(&output);
+    constants_free(constants);
+
+    for (i = 0; i < lineref->num_files; i++)
+        free(lineref->file_names[i]);
+    free(lineref->file_names);
+    free(lineref->file_index);
+    free(lineref->line_number);
+    free(lineref);
+
+    return success;
+}
+
+
+void pch_check_used(char *path) {
+    /*
+     * Notes in verbose mode if the snapshot loaded with --pch was never
+     * replayed, either because the header wasn't included or always with a
+     * different state of the constants it checks.
+     */
+
+    extern struct arguments args;
+
+    if (loaded_pch != NULL && !loaded_pch->replayed && args.verbose)
+        debugf("Precompiled header %s was never used.\n", path);
+}
+
+
+int cmd_pch() {
+    extern struct arguments args;
+
+    if (args.num_positionals != 3)
+        return 128;
+
+    // check if target already exists
+    if (access(args.positionals[2], F_OK) != -1 && !args.force) {
+        errorf("File %s already exists and --force was not set.\n", args.positionals[2]);
+        return 1;
+    }
+
+    return pch_create(args.positionals[1], args.positionals[2]);
 }
@@ -22,6 +22,9 @@
 #include <stdlib.h>
 #include <stdint.h>
 #include <stdbool.h>
+#include <time.h>
+
+#include "utils.h"
 
 
 #define MAXCONSTS 4096
@@ -29,10 +32,13 @@
 #define MAXINCLUDES 64
 #define FILEINTERVAL 32
 #define LINEINTERVAL 1024
+#define PCHMAGIC "APCH"
+#define PCHVERSION 1
 
 
 struct constant {
     char *name;
+    uint32_t hash;
     char *value;
     int num_args;
     int num_occurences;
@@ -44,6 +50,11 @@ struct constant {
 struct constants {
     struct constant *head;
     struct constant *tail;
+    uint32_t num_constants;
+    uint32_t size;
+    struct constant **table;
+    unsigned long num_lookups;
+    unsigned long num_hits;
 };
 
 struct lineref {
@@ -59,25 +70,60 @@ struct constant_stack {
     struct constant_stack *next;
 };
 
+struct include_entry {
+    uint32_t hash;
+    char *virtual_path;
+    char *real_path;
+};
+
+struct include_stamp {
+    char *path;
+    time_t mtime;
+};
+
+struct include_index {
+    char *includefolder;
+    uint32_t num_entries;
+    uint32_t size;
+    struct include_entry *entries;
+    uint32_t num_stamps;
+    struct include_stamp *stamps;
+    bool checked;
+    bool dirty;
+    time_t built;
+    struct include_index *next;
+};
+
 
-char include_stack[MAXINCLUDES][1024];
+extern __thread char include_stack[MAXINCLUDES][1024];
 
 
 struct constants *constants_init();
+void constants_add(struct constants *constants, struct constant *c);
 bool constants_parse(struct constants *constants, char *definition, int line);
 bool constants_remove(struct constants *constants, char *name);
 struct constant *constants_find(struct constants *constants, char *name, int len);
-char *constants_preprocess(struct constants *constants, char *source, int line, struct constant_stack *constant_stack);
+bool constants_preprocess(struct constants *constants, struct arena *scratch, char *source, size_t length,
+        int line, struct constant_stack *constant_stack, struct membuffer *target);
 void constants_free(struct constants *constants);
 
-char *constant_value(struct constants *constants, struct constant *constant,
-        int num_args, char **args, int value, struct constant_stack *constant_stack);
+bool constant_value(struct constants *constants, struct arena *scratch, struct constant *constant,
+        int num_args, char **args, int line, struct constant_stack *constant_stack, struct membuffer *target);
 void constant_free(struct constant *constant);
 
-bool matches_includepath(char *path, char *includepath, char *includefolder);
+int include_index_load(char *path);
+int include_index_save(char *path);
+void include_index_free();
 
 int find_file(char *includepath, char *origin, char *actualpath);
 
 char * resolve_macros(char *string, size_t buffsize, struct constant *constants);
 
-int preprocess(char *source, FILE *f_target, struct constants *constants, struct lineref *lineref);
+int preprocess(char *source, struct membuffer *target, struct constants *constants, struct lineref *lineref);
+
+int pch_load(char *path);
+int pch_create(char *header, char *target);
+
+void pch_check_used(char *path);
+
+int cmd_pch();
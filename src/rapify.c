@@ -29,6 +29,7 @@
 #include <wchar.h>
 #endif
 
+#include "args.h"
 #include "filesystem.h"
 #include "utils.h"
 #include "preprocess.h"
@@ -36,47 +37,42 @@
 #include "rapify.tab.h"
 
 
-struct definitions *new_definitions() {
+struct definitions *new_definitions(struct arena *arena) {
     struct definitions *result;
 
-    result = (struct definitions *)safe_malloc(sizeof(struct definitions));
+    result = (struct definitions *)arena_alloc(arena, sizeof(struct definitions));
     result->head = NULL;
+    result->tail = NULL;
+    result->num_definitions = 0;
 
     return result;
 }
 
 
-struct definitions *add_definition(struct definitions *head, int type, void *content) {
+struct definitions *add_definition(struct arena *arena, struct definitions *head, int type, void *content) {
     struct definition *definition;
-    struct definition *tmp;
 
-    definition = (struct definition *)safe_malloc(sizeof(struct definition));
+    definition = (struct definition *)arena_alloc(arena, sizeof(struct definition));
     definition->type = type;
     definition->content = content;
     definition->next = NULL;
 
-    if (head->head == NULL) {
+    if (head->head == NULL)
         head->head = definition;
-        return head;
-    }
+    else
+        head->tail->next = definition;
 
-    tmp = head->head;
-    while (tmp != NULL) {
-        if (tmp->next == NULL) {
-            tmp->next = definition;
-            return head;
-        }
-        tmp = tmp->next;
-    }
+    head->tail = definition;
+    head->num_definitions++;
 
     return head;
 }
 
 
-struct class *new_class(char *name, char *parent, struct definitions *content, bool is_delete) {
+struct class *new_class(struct arena *arena, char *name, char *parent, struct definitions *content, bool is_delete) {
     struct class *result;
 
-    result = (struct class *)safe_malloc(sizeof(struct class));
+    result = (struct class *)arena_alloc(arena, sizeof(struct class));
     result->name = name;
     result->parent = parent;
     result->is_delete = is_delete;
@@ -86,10 +82,10 @@ struct class *new_class(char *name, char *parent, struct definitions *content, b
 }
 
 
-struct variable *new_variable(int type, char *name, struct expression *expression) {
+struct variable *new_variable(struct arena *arena, int type, char *name, struct expression *expression) {
     struct variable *result;
 
-    result = (struct variable *)safe_malloc(sizeof(struct variable));
+    result = (struct variable *)arena_alloc(arena, sizeof(struct variable));
     result->type = type;
     result->name = name;
     result->expression = expression;
@@ -98,13 +94,15 @@ struct variable *new_variable(int type, char *name, struct expression *expressio
 }
 
 
-struct expression *new_expression(int type, void *value) {
+struct expression *new_expression(struct arena *arena, int type, void *value) {
     struct expression *result;
 
-    result = (struct expression *)safe_malloc(sizeof(struct expression));
+    result = (struct expression *)arena_alloc(arena, sizeof(struct expression));
     result->type = type;
     result->string_value = NULL;
     result->head = NULL;
+    result->tail = NULL;
+    result->num_entries = 0;
     result->next = NULL;
 
     if (type == TYPE_INT) {
@@ -114,159 +112,100 @@ struct expression *new_expression(int type, void *value) {
     } else if (type == TYPE_STRING) {
         result->string_value = (char *)value;
     } else if (type == TYPE_ARRAY || type == TYPE_ARRAY_EXPANSION) {
+        // arrays start out with their first element, see add_expression
         result->head = (struct expression *)value;
+        result->tail = result->head;
+        result->num_entries = (value == NULL) ? 0 : 1;
     }
 
     return result;
 }
 
 
-struct expression *add_expression(struct expression *head, struct expression *new) {
-    struct expression *tmp;
-
-    tmp = head;
-    while (tmp != NULL) {
-        if (tmp->next == NULL) {
-            tmp->next = new;
-            break;
-        }
-
-        tmp = tmp->next;
-    }
-
-    return head;
-}
-
-
-void free_expression(struct expression *expr) {
-    if (expr == NULL) { return; }
-    free(expr->string_value);
-    free_expression(expr->head);
-    free_expression(expr->next);
-    free(expr);
-}
-
-
-void free_variable(struct variable *var) {
-    free(var->name);
-    free_expression(var->expression);
-    free(var);
-}
-
-
-void free_definition(struct definition *definition) {
-    if (definition == NULL) { return; }
-
-    free_definition(definition->next);
-
-    if (definition->type == TYPE_VAR)
-        free_variable((struct variable *)definition->content);
+struct expression *add_expression(struct expression *array, struct expression *new) {
+    if (array->head == NULL)
+        array->head = new;
     else
-        free_class((struct class *)definition->content);
-
-    free(definition);
-}
-
+        array->tail->next = new;
 
-void free_class(struct class *class) {
-    free(class->name);
-    free(class->parent);
+    array->tail = new;
+    array->num_entries++;
 
-    if (class->content != NULL && class->content != (struct definitions *)-1) {
-        free_definition(class->content->head);
-        free(class->content);
-    }
-
-    free(class);
+    return array;
 }
 
 
-void rapify_expression(struct expression *expr, FILE *f_target) {
+void rapify_expression(struct expression *expr, struct membuffer *target) {
     struct expression *tmp;
-    uint32_t num_entries;
 
     if (expr->type == TYPE_ARRAY) {
-        num_entries = 0;
-        tmp = expr->head;
-        while (tmp != NULL) {
-            num_entries++;
-            tmp = tmp->next;
-        }
-
-        write_compressed_int(num_entries, f_target);
+        write_compressed_int(expr->num_entries, target);
 
         tmp = expr->head;
         while (tmp != NULL) {
-            fputc((char)((tmp->type == TYPE_STRING) ? 0 :
+            membuffer_putc(target, (char)((tmp->type == TYPE_STRING) ? 0 :
                 ((tmp->type == TYPE_FLOAT) ? 1 :
-                ((tmp->type == TYPE_INT) ? 2 : 3))), f_target);
-            rapify_expression(tmp, f_target);
+                ((tmp->type == TYPE_INT) ? 2 : 3))));
+            rapify_expression(tmp, target);
             tmp = tmp->next;
         }
     } else if (expr->type == TYPE_INT) {
-        fwrite(&expr->int_value, 4, 1, f_target);
+        membuffer_write(target, &expr->int_value, 4);
     } else if (expr->type == TYPE_FLOAT) {
-        fwrite(&expr->float_value, 4, 1, f_target);
+        membuffer_write(target, &expr->float_value, 4);
     } else {
-        fwrite(expr->string_value, strlen(expr->string_value) + 1, 1, f_target);
+        membuffer_write(target, expr->string_value, strlen(expr->string_value) + 1);
     }
 }
 
 
-void rapify_variable(struct variable *var, FILE *f_target) {
+void rapify_variable(struct variable *var, struct membuffer *target) {
     if (var->type == TYPE_VAR) {
-        fputc(1, f_target);
-        fputc((char)((var->expression->type == TYPE_STRING) ? 0 : ((var->expression->type == TYPE_FLOAT) ? 1 : 2 )), f_target);
+        membuffer_putc(target, 1);
+        membuffer_putc(target, (char)((var->expression->type == TYPE_STRING) ? 0 : ((var->expression->type == TYPE_FLOAT) ? 1 : 2 )));
     } else {
-        fputc((char)((var->type == TYPE_ARRAY) ? 2 : 5), f_target);
+        membuffer_putc(target, (char)((var->type == TYPE_ARRAY) ? 2 : 5));
         if (var->type == TYPE_ARRAY_EXPANSION) {
-            fwrite("\x01\0\0\0", 4, 1, f_target);
+            membuffer_write(target, "\x01\0\0\0", 4);
         }
     }
 
-    fwrite(var->name, strlen(var->name) + 1, 1, f_target);
-    rapify_expression(var->expression, f_target);
+    membuffer_write(target, var->name, strlen(var->name) + 1);
+    rapify_expression(var->expression, target);
 }
 
 
-void rapify_class(struct class *class, FILE *f_target) {
+void rapify_class(struct class *class, struct membuffer *target) {
     struct definition *tmp;
     uint32_t fp_temp;
-    uint32_t num_entries = 0;
 
     if (class->content == NULL) {
         // extern or delete class
-        fputc((char)(class->is_delete ? 4 : 3), f_target);
-        fwrite(class->name, strlen(class->name) + 1, 1, f_target);
+        membuffer_putc(target, (char)(class->is_delete ? 4 : 3));
+        membuffer_write(target, class->name, strlen(class->name) + 1);
         return;
     }
 
     if (class->parent)
-        fwrite(class->parent, strlen(class->parent) + 1, 1, f_target);
+        membuffer_write(target, class->parent, strlen(class->parent) + 1);
     else
-        fputc(0, f_target);
+        membuffer_putc(target, 0);
 
-    tmp = class->content->head;
-    while (tmp != NULL) {
-        num_entries++;
-        tmp = tmp->next;
-    }
-
-    write_compressed_int(num_entries, f_target);
+    write_compressed_int(class->content->num_definitions, target);
 
     tmp = class->content->head;
     while (tmp != NULL) {
         if (tmp->type == TYPE_VAR) {
-            rapify_variable((struct variable *)tmp->content, f_target);
+            rapify_variable((struct variable *)tmp->content, target);
         } else {
             if (((struct class *)(tmp->content))->content != NULL) {
-                fputc(0, f_target);
-                fwrite(((struct class *)(tmp->content))->name,
-                    strlen(((struct class *)(tmp->content))->name) + 1, 1, f_target);
-                ((struct class *)(tmp->content))->offset_location = ftell(f_target);
-                fwrite("\0\0\0\0", 4, 1, f_target);
+                membuffer_putc(target, 0);
+                membuffer_write(target, ((struct class *)(tmp->content))->name,
+                    strlen(((struct class *)(tmp->content))->name) + 1);
+                ((struct class *)(tmp->content))->offset_location = target->length;
+                membuffer_write(target, "\0\0\0\0", 4);
             } else {
-                rapify_class(tmp->content, f_target);
+                rapify_class(tmp->content, target);
             }
         }
 
@@ -276,102 +215,71 @@ void rapify_class(struct class *class, FILE *f_target) {
     tmp = class->content->head;
     while (tmp != NULL) {
         if (tmp->type == TYPE_CLASS && ((struct class *)(tmp->content))->content != NULL) {
-            fp_temp = ftell(f_target);
-            fseek(f_target, ((struct class *)(tmp->content))->offset_location, SEEK_SET);
-            fwrite(&fp_temp, sizeof(uint32_t), 1, f_target);
-            fseek(f_target, 0, SEEK_END);
+            // patch the offset of the class body
+            fp_temp = target->length;
+            memcpy(target->data + ((struct class *)(tmp->content))->offset_location, &fp_temp, 4);
 
-            rapify_class(tmp->content, f_target);
+            rapify_class(tmp->content, target);
         }
 
         tmp = tmp->next;
     }
 }
 
-int rapify_file(char *source, char *target) {
+
+int rapify_to_buffer(char *source, struct membuffer *target) {
     /*
-     * Resolves macros/includes and rapifies the given file. If source and
-     * target are identical, the target is overwritten.
+     * Resolves macros/includes and rapifies the given file into the target
+     * buffer, discarding anything that was in the buffer before. Files that
+     * are already rapified are read as they are.
      *
      * Returns 0 on success and a positive integer on failure.
      */
 
-    extern char *current_target;
-    FILE *f_temp;
-    FILE *f_target;
+    extern __thread char *current_target;
+    extern struct arguments args;
+    FILE *f_source;
     int i;
-    int datasize;
+    long datasize;
     int success;
-    char buffer[4096];
+    char buffer[4];
     uint32_t enum_offset = 0;
     struct constants *constants;
     struct lineref *lineref;
+    struct membuffer preprocessed;
+    struct class *result;
+    struct arena *arena;
 
     current_target = source;
+    target->length = 0;
 
     // Check if the file is already rapified
-    f_temp = fopen(source, "rb");
-    if (!f_temp) {
+    f_source = fopen(source, "rb");
+    if (!f_source) {
         errorf("Failed to open %s.\n", source);
         return 1;
     }
 
-    fread(buffer, 4, 1, f_temp);
-    if (strncmp(buffer, "\0raP", 4) == 0) {
-        if ((strcmp(source, target)) == 0) {
-            fclose(f_temp);
-            return 0;
-        }
+    if (fread(buffer, 4, 1, f_source) == 1 && strncmp(buffer, "\0raP", 4) == 0) {
+        fseek(f_source, 0, SEEK_END);
+        datasize = ftell(f_source);
+        fseek(f_source, 0, SEEK_SET);
 
-        if (strcmp(target, "-") == 0) {
-            f_target = stdout;
-        } else {
-            f_target = fopen(target, "wb");
-            if (!f_target) {
-                errorf("Failed to open %s.\n", target);
-                fclose(f_temp);
-                return 2;
-            }
-        }
-
-        fseek(f_temp, 0, SEEK_END);
-        datasize = ftell(f_temp);
-
-        fseek(f_temp, 0, SEEK_SET);
-        for (i = 0; datasize - i >= sizeof(buffer); i += sizeof(buffer)) {
-            fread(buffer, sizeof(buffer), 1, f_temp);
-            fwrite(buffer, sizeof(buffer), 1, f_target);
+        membuffer_reserve(target, datasize);
+        if (fread(target->data, datasize, 1, f_source) != 1) {
+            errorf("Failed to read %s.\n", source);
+            fclose(f_source);
+            return 2;
         }
-        fread(buffer, datasize - i, 1, f_temp);
-        fwrite(buffer, datasize - i, 1, f_target);
-
-        fclose(f_temp);
-        if (strcmp(target, "-") != 0)
-            fclose(f_target);
+        target->length = datasize;
+        target->data[datasize] = 0;
+        target->data[datasize + 1] = 0;
 
+        fclose(f_source);
         return 0;
-    } else {
-        fclose(f_temp);
-    }
-
-#ifdef _WIN32
-    char temp_name[2048];
-    if (!GetTempFileName(".", "amk", 0, temp_name)) {
-        errorf("Failed to get temp file name (system error %i).\n", GetLastError());
-        return 1;
     }
-    f_temp = fopen(temp_name, "wb+");
-#else
-    f_temp = tmpfile();
-#endif
 
-    if (!f_temp) {
-        errorf("Failed to open temp file.\n");
-#ifdef _WIN32
-        DeleteFile(temp_name);
-#endif
-        return 1;
-    }
+    fclose(f_source);
 
     for (i = 0; i < MAXINCLUDES; i++)
         include_stack[i][0] = 0;
@@ -385,19 +293,21 @@ int rapify_file(char *source, char *target) {
     lineref->file_index = (uint32_t *)safe_malloc(sizeof(uint32_t) * LINEINTERVAL);
     lineref->line_number = (uint32_t *)safe_malloc(sizeof(uint32_t) * LINEINTERVAL);
 
-    success = preprocess(source, f_temp, constants, lineref);
+    membuffer_init(&preprocessed);
+
+    success = preprocess(source, &preprocessed, constants, lineref);
 
     current_target = source;
 
     if (success) {
         errorf("Failed to preprocess %s.\n", source);
-        fclose(f_temp);
-#ifdef _WIN32
-        DeleteFile(temp_name);
-#endif
-        return success;
+        goto cleanup;
     }
 
+    if (args.verbose)
+        debugf("Macro lookups for %s: %lu, %lu hits, %u constants defined.\n", source,
+            constants->num_lookups, constants->num_hits, constants->num_constants);
+
 #if 0
     FILE *f_dump;
 
@@ -406,93 +316,36 @@ int rapify_file(char *source, char *target) {
     printf("Done with preprocessing, dumping preprocessed config to %s.\n", dump_name);
 
     f_dump = fopen(dump_name, "wb");
-    fseek(f_temp, 0, SEEK_END);
-    datasize = ftell(f_temp);
-
-    fseek(f_temp, 0, SEEK_SET);
-    for (i = 0; datasize - i >= sizeof(buffer); i += sizeof(buffer)) {
-        fread(buffer, sizeof(buffer), 1, f_temp);
-        fwrite(buffer, sizeof(buffer), 1, f_dump);
-    }
-
-    fread(buffer, datasize - i, 1, f_temp);
-    fwrite(buffer, datasize - i, 1, f_dump);
-
+    fwrite(preprocessed.data, preprocessed.length, 1, f_dump);
     fclose(f_dump);
 #endif
 
-    fseek(f_temp, 0, SEEK_SET);
-    struct class *result;
-    result = parse_file(f_temp, lineref);
+    arena = arena_init();
+    result = parse_file(preprocessed.data, preprocessed.length, lineref, arena);
 
     if (result == NULL) {
-        errorf("Failed to parse config.\n");
-        return 1;
+        errorf("Failed to parse %s.\n", source);
+        arena_free(arena);
+        success = 1;
+        goto cleanup;
     }
 
-#ifdef _WIN32
-    char temp_name2[2048];
-#endif
-
     // Rapify file
-    if (strcmp(target, "-") == 0) {
-#ifdef _WIN32
-        if (!GetTempFileName(".", "amk", 0, temp_name2)) {
-            errorf("Failed to get temp file name (system error %i).\n", GetLastError());
-            return 1;
-        }
-        f_target = fopen(temp_name2, "wb+");
-#else
-        f_target = tmpfile();
-#endif
+    membuffer_write(target, "\0raP", 4);
+    membuffer_write(target, "\0\0\0\0\x08\0\0\0", 8);
+    membuffer_write(target, &enum_offset, 4); // this is replaced later
 
-        if (!f_target) {
-            errorf("Failed to open temp file.\n");
-#ifdef _WIN32
-            DeleteFile(temp_name2);
-#endif
-            return 1;
-        }
-    } else {
-        f_target = fopen(target, "wb+");
-        if (!f_target) {
-            errorf("Failed to open %s.\n", target);
-            fclose(f_temp);
-            return 2;
-        }
-    }
-    fwrite("\0raP", 4, 1, f_target);
-    fwrite("\0\0\0\0\x08\0\0\0", 8, 1, f_target);
-    fwrite(&enum_offset, 4, 1, f_target); // this is replaced later
-
-    rapify_class(result, f_target);
-
-    enum_offset = ftell(f_target);
-    fwrite("\0\0\0\0", 4, 1, f_target); // fuck enums
-    fseek(f_target, 12, SEEK_SET);
-    fwrite(&enum_offset, 4, 1, f_target);
+    rapify_class(result, target);
 
-    if (strcmp(target, "-") == 0) {
-        fseek(f_target, 0, SEEK_END);
-        datasize = ftell(f_target);
-
-        fseek(f_target, 0, SEEK_SET);
-        for (i = 0; datasize - i >= sizeof(buffer); i += sizeof(buffer)) {
-            fread(buffer, sizeof(buffer), 1, f_target);
-            fwrite(buffer, sizeof(buffer), 1, stdout);
-        }
-        fread(buffer, datasize - i, 1, f_target);
-        fwrite(buffer, datasize - i, 1, stdout);
-    }
+    enum_offset = target->length;
+    membuffer_write(target, "\0\0\0\0", 4); // fuck enums
+    memcpy(target->data + 12, &enum_offset, 4);
 
-    fclose(f_temp);
-    fclose(f_target);
+    // the whole parse tree lives in the arena
+    arena_free(arena);
 
-#ifdef _WIN32
-    DeleteFile(temp_name);
-    if (strcmp(target, "-") == 0)
-        DeleteFile(temp_name2);
-#endif
+cleanup:
+    membuffer_free(&preprocessed);
 
     constants_free(constants);
 
@@ -503,7 +356,51 @@ int rapify_file(char *source, char *target) {
     free(lineref->line_number);
     free(lineref);
 
-    free_class(result);
+    return success;
+}
+
+
+int rapify_file(char *source, char *target) {
+    /*
+     * Resolves macros/includes and rapifies the given file. If source and
+     * target are identical, the target is overwritten.
+     *
+     * Returns 0 on success and a positive integer on failure.
+     */
+
+    FILE *f_target;
+    int success;
+    struct membuffer buffer;
+
+    membuffer_init(&buffer);
+
+    success = rapify_to_buffer(source, &buffer);
+    if (success) {
+        membuffer_free(&buffer);
+        return success;
+    }
+
+    if (strcmp(target, "-") == 0) {
+        f_target = stdout;
+    } else {
+        f_target = fopen(target, "wb");
+        if (!f_target) {
+            errorf("Failed to open %s.\n", target);
+            membuffer_free(&buffer);
+            return 2;
+        }
+    }
+
+    success = (fwrite(buffer.data, buffer.length, 1, f_target) != 1);
+    if (strcmp(target, "-") != 0)
+        success |= (fclose(f_target) != 0);
+
+    membuffer_free(&buffer);
+
+    if (success) {
+        errorf("Failed to write %s.\n", target);
+        return 3;
+    }
 
     return 0;
 }
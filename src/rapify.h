@@ -20,6 +20,7 @@
 
 
 #include "preprocess.h"
+#include "utils.h"
 
 
 #define MAXCLASSES 4096
@@ -37,6 +38,8 @@ enum {
 
 struct definitions {
     struct definition *head;
+    struct definition *tail;
+    uint32_t num_definitions;
 };
 
 struct definition {
@@ -65,36 +68,39 @@ struct expression {
     float float_value;
     char *string_value;
     struct expression *head;
+    struct expression *tail;
+    uint32_t num_entries;
     struct expression *next;
 };
 
+struct lexer_state {
+    char *data;
+    bool allow_val;
+    bool allow_arr;
+    bool last_was_class;
+};
 
-struct class *parse_file(FILE *f, struct lineref *lineref);
-
-struct definitions *new_definitions();
-
-struct definitions *add_definition(struct definitions *head, int type, void *content);
 
-struct class *new_class(char *name, char *parent, struct definitions *content, bool is_delete);
+struct class *parse_file(char *data, size_t size, struct lineref *lineref, struct arena *arena);
 
-struct variable *new_variable(int type, char *name, struct expression *expression);
+struct definitions *new_definitions(struct arena *arena);
 
-struct expression *new_expression(int type, void *value);
+struct definitions *add_definition(struct arena *arena, struct definitions *head, int type, void *content);
 
-struct expression *add_expression(struct expression *head, struct expression *new);
+struct class *new_class(struct arena *arena, char *name, char *parent, struct definitions *content, bool is_delete);
 
-void free_expression(struct expression *expr);
+struct variable *new_variable(struct arena *arena, int type, char *name, struct expression *expression);
 
-void free_variable(struct variable *var);
+struct expression *new_expression(struct arena *arena, int type, void *value);
 
-void free_definition(struct definition *definition);
+struct expression *add_expression(struct expression *array, struct expression *new);
 
-void free_class(struct class *class);
+void rapify_expression(struct expression *expr, struct membuffer *target);
 
-void rapify_expression(struct expression *expr, FILE *f_target);
+void rapify_variable(struct variable *var, struct membuffer *target);
 
-void rapify_variable(struct variable *var, FILE *f_target);
+void rapify_class(struct class *class, struct membuffer *target);
 
-void rapify_class(struct class *class, FILE *f_target);
+int rapify_to_buffer(char *source, struct membuffer *target);
 
 int rapify_file(char *source, char *target);
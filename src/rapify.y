@@ -19,6 +19,7 @@
 %{
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <math.h>
 
 #include "utils.h"
@@ -29,14 +30,31 @@
 #define YYDEBUG 0
 #define YYERROR_VERBOSE 1
 
-extern int yylex(struct class **result, struct lineref *lineref);
-extern int yyparse();
-extern FILE* yyin;
-extern int yylineno;
-
-void yyerror(struct class **result, struct lineref *lineref, const char* s);
+typedef struct yy_buffer_state *YY_BUFFER_STATE;
 %}
 
+%code requires {
+#ifndef YY_TYPEDEF_YY_SCANNER_T
+#define YY_TYPEDEF_YY_SCANNER_T
+typedef void *yyscan_t;
+#endif
+}
+
+%code {
+extern int yylex(YYSTYPE *yylval_param, YYLTYPE *yylloc_param,
+    struct class **result, struct lineref *lineref, struct arena *arena, yyscan_t yyscanner);
+extern int yylex_init_extra(struct lexer_state *state, yyscan_t *scanner);
+extern int yylex_destroy(yyscan_t scanner);
+extern YY_BUFFER_STATE yy_scan_buffer(char *base, size_t size, yyscan_t scanner);
+extern void yy_delete_buffer(YY_BUFFER_STATE buffer, yyscan_t scanner);
+extern void yyset_lineno(int line_number, yyscan_t scanner);
+extern struct lexer_state *yyget_extra(yyscan_t scanner);
+extern void lexer_restore_buffer(yyscan_t scanner);
+
+void yyerror(YYLTYPE *location, struct class **result, struct lineref *lineref, struct arena *arena,
+    yyscan_t scanner, const char* s);
+}
+
 %union {
     struct definitions* definitions_value;
     struct class *class_value;
@@ -63,80 +81,110 @@ void yyerror(struct class **result, struct lineref *lineref, const char* s);
 
 %start start
 
-%param {struct class **result} {struct lineref *lineref}
+%define api.pure full
+%param {struct class **result} {struct lineref *lineref} {struct arena *arena} {yyscan_t scanner}
 %locations
 
 %%
-start: definitions { *result = new_class(NULL, NULL, $1, false); }
+start: definitions { *result = new_class(arena, NULL, NULL, $1, false); }
 
-definitions:  /* empty */ { $$ = new_definitions(); }
-            | definitions class { $$ = add_definition($1, TYPE_CLASS, $2); }
-            | definitions variable { $$ = add_definition($1, TYPE_VAR, $2); }
+definitions:  /* empty */ { $$ = new_definitions(arena); }
+            | definitions class { $$ = add_definition(arena, $1, TYPE_CLASS, $2); }
+            | definitions variable { $$ = add_definition(arena, $1, TYPE_VAR, $2); }
 ;
 
-class:        T_CLASS T_NAME T_LBRACE definitions T_RBRACE T_SEMICOLON { $$ = new_class($2, NULL, $4, false); }
-            | T_CLASS T_NAME T_COLON T_NAME T_LBRACE definitions T_RBRACE T_SEMICOLON { $$ = new_class($2, $4, $6, false); }
-            | T_CLASS T_NAME T_SEMICOLON { $$ = new_class($2, NULL, NULL, false); }
-            | T_CLASS T_NAME T_COLON T_NAME T_SEMICOLON { $$ = new_class($2, $4, 0, false); }
-            | T_DELETE T_NAME T_SEMICOLON { $$ = new_class($2, NULL, NULL, true); }
+class:        T_CLASS T_NAME T_LBRACE definitions T_RBRACE T_SEMICOLON { $$ = new_class(arena, $2, NULL, $4, false); }
+            | T_CLASS T_NAME T_COLON T_NAME T_LBRACE definitions T_RBRACE T_SEMICOLON { $$ = new_class(arena, $2, $4, $6, false); }
+            | T_CLASS T_NAME T_SEMICOLON { $$ = new_class(arena, $2, NULL, NULL, false); }
+            | T_CLASS T_NAME T_COLON T_NAME T_SEMICOLON { $$ = new_class(arena, $2, $4, 0, false); }
+            | T_DELETE T_NAME T_SEMICOLON { $$ = new_class(arena, $2, NULL, NULL, true); }
 ;
 
-variable:     T_NAME T_EQUALS expression T_SEMICOLON { $$ = new_variable(TYPE_VAR, $1, $3); }
-            | T_NAME T_LBRACKET T_RBRACKET T_EQUALS expression T_SEMICOLON { $$ = new_variable(TYPE_ARRAY, $1, $5); }
-            | T_NAME T_LBRACKET T_RBRACKET T_PLUS T_EQUALS expression T_SEMICOLON { $$ = new_variable(TYPE_ARRAY_EXPANSION, $1, $6); }
+variable:     T_NAME T_EQUALS expression T_SEMICOLON { $$ = new_variable(arena, TYPE_VAR, $1, $3); }
+            | T_NAME T_LBRACKET T_RBRACKET T_EQUALS expression T_SEMICOLON { $$ = new_variable(arena, TYPE_ARRAY, $1, $5); }
+            | T_NAME T_LBRACKET T_RBRACKET T_PLUS T_EQUALS expression T_SEMICOLON { $$ = new_variable(arena, TYPE_ARRAY_EXPANSION, $1, $6); }
 ;
 
-expression:   T_INT { $$ = new_expression(TYPE_INT, &$1); }
-            | T_FLOAT { $$ = new_expression(TYPE_FLOAT, &$1); }
-            | T_STRING { $$ = new_expression(TYPE_STRING, $1); }
-            | T_LBRACE expressions T_RBRACE { $$ = new_expression(TYPE_ARRAY, $2); }
-            | T_LBRACE expressions T_COMMA T_RBRACE { $$ = new_expression(TYPE_ARRAY, $2); }
-            | T_LBRACE T_RBRACE { $$ = new_expression(TYPE_ARRAY, NULL); }
+expression:   T_INT { $$ = new_expression(arena, TYPE_INT, &$1); }
+            | T_FLOAT { $$ = new_expression(arena, TYPE_FLOAT, &$1); }
+            | T_STRING { $$ = new_expression(arena, TYPE_STRING, $1); }
+            | T_LBRACE expressions T_RBRACE { $$ = $2; }
+            | T_LBRACE expressions T_COMMA T_RBRACE { $$ = $2; }
+            | T_LBRACE T_RBRACE { $$ = new_expression(arena, TYPE_ARRAY, NULL); }
 ;
 
-expressions:  expression { $$ = $1; }
+expressions:  expression { $$ = new_expression(arena, TYPE_ARRAY, $1); }
             | expressions T_COMMA expression { $$ = add_expression($1, $3); }
 ;
 %%
 
-struct class *parse_file(FILE *f, struct lineref *lineref) {
+struct class *parse_file(char *data, size_t size, struct lineref *lineref, struct arena *arena) {
+    /*
+     * Parses the given preprocessed config. The data is scanned in place
+     * and, like the data of a membuffer, needs to be followed by two NUL
+     * bytes. All parser and scanner state is local to the call, so configs
+     * can be parsed on several threads at once.
+     */
+
     struct class *result;
+    struct lexer_state state;
+    yyscan_t scanner;
+    YY_BUFFER_STATE buffer;
+
+    state.data = data;
+    state.allow_val = false;
+    state.allow_arr = false;
+    state.last_was_class = false;
+
+    if (yylex_init_extra(&state, &scanner))
+        return NULL;
+
+    buffer = yy_scan_buffer(data, size + 2, scanner);
+    if (buffer == NULL) {
+        yylex_destroy(scanner);
+        return NULL;
+    }
 
-    yylineno = 0;
-    yyin = f;
+    yyset_lineno(0, scanner);
 
 #if YYDEBUG == 1
     yydebug = 1;
 #endif
 
-    do { 
-        if (yyparse(&result, lineref)) {
-            return NULL;
-        }
-    } while(!feof(yyin));
+    if (yyparse(&result, lineref, arena, scanner))
+        result = NULL;
+
+    yy_delete_buffer(buffer, scanner);
+    yylex_destroy(scanner);
 
     return result;
 }
 
-void yyerror(struct class **result, struct lineref *lineref,  const char* s) {
-    int line = 0;
-    char *buffer = NULL;
-    size_t buffsize;
+void yyerror(YYLTYPE *location, struct class **result, struct lineref *lineref, struct arena *arena,
+        yyscan_t scanner, const char* s) {
+    int line;
+    char *ptr;
+    char *end;
 
-    fseek(yyin, 0, SEEK_SET);
-    while (line < yylloc.first_line) {
-        if (buffer != NULL)
-            free(buffer);
+    lexer_restore_buffer(scanner);
 
-        buffer = NULL;
-        buffsize = 0;
-        getline(&buffer, &buffsize, yyin);
-
-        line++;
+    // find the offending line in the preprocessed source
+    ptr = yyget_extra(scanner)->data;
+    for (line = 1; line < location->first_line && ptr != NULL; line++) {
+        ptr = strchr(ptr, '\n');
+        if (ptr != NULL)
+            ptr++;
     }
 
-    lerrorf(lineref->file_names[lineref->file_index[yylloc.first_line]],
-            lineref->line_number[yylloc.first_line], "%s\n", s);
+    lerrorf(lineref->file_names[lineref->file_index[location->first_line]],
+            lineref->line_number[location->first_line], "%s\n", s);
+
+    if (ptr == NULL)
+        return;
 
-    fprintf(stderr, " %s", buffer);
+    end = strchr(ptr, '\n');
+    if (end == NULL)
+        fprintf(stderr, " %s", ptr);
+    else
+        fprintf(stderr, " %.*s", (int)(end - ptr + 1), ptr);
 }
@@ -24,12 +24,16 @@
 #include <string.h>
 #include <unistd.h>
 #include <math.h>
+#include <sys/time.h>
 
 #include "args.h"
 #include "filesystem.h"
 #include "utils.h"
 
 
+__thread char *current_target;
+
+
 #ifdef _WIN32
 
 char *strndup(const char *s, size_t n) {
@@ -72,6 +76,29 @@ int stricmp(char *a, char *b) {
 #endif
 
 
+void lock_output() {
+    /*
+     * Locks stderr for the current thread, so that messages consisting of
+     * multiple writes aren't interleaved with those of other jobs.
+     */
+
+#ifdef _WIN32
+    _lock_file(stderr);
+#else
+    flockfile(stderr);
+#endif
+}
+
+
+void unlock_output() {
+#ifdef _WIN32
+    _unlock_file(stderr);
+#else
+    funlockfile(stderr);
+#endif
+}
+
+
 void infof(char *format, ...) {
     char buffer[4096];
     va_list argptr;
@@ -134,12 +161,16 @@ void lwarningf(char *file, int line, char *format, ...) {
     vsprintf(buffer, format, argptr);
     va_end(argptr);
 
+    lock_output();
+
     if (line > 0)
         fprintf(stderr, "In file %s:%i: ", file, line);
     else
         fprintf(stderr, "In file %s: ", file);
 
     warningf(buffer);
+
+    unlock_output();
 }
 
 
@@ -184,6 +215,8 @@ void lnwarningf(char *file, int line, char *name, char *format, ...) {
     vsprintf(buffer, format, argptr);
     va_end(argptr);
 
+    lock_output();
+
     if (!warning_muted(name)) {
         if (line > 0)
             fprintf(stderr, "In file %s:%i: ", file, line);
@@ -192,6 +225,8 @@ void lnwarningf(char *file, int line, char *name, char *format, ...) {
     }
 
     nwarningf(name, buffer);
+
+    unlock_output();
 }
 
 
@@ -221,12 +256,16 @@ void lerrorf(char *file, int line, char *format, ...) {
     vsprintf(buffer, format, argptr);
     va_end(argptr);
 
+    lock_output();
+
     if (line > 0)
         fprintf(stderr, "In file %s:%i: ", file, line);
     else
         fprintf(stderr, "In file %s: ", file);
 
     errorf(buffer);
+
+    unlock_output();
 }
 
 
@@ -278,6 +317,201 @@ char *safe_strndup(const char *s, size_t n) {
 }
 
 
+struct arena *arena_init() {
+    /*
+     * Creates a new arena. Everything allocated from it is released at once
+     * with arena_free, so small allocations that all live equally long
+     * don't need to be freed one by one.
+     */
+
+    struct arena *arena;
+
+    arena = (struct arena *)safe_malloc(sizeof(struct arena));
+    arena->blocks = NULL;
+    arena->num_strings = 0;
+    arena->size_strings = 0;
+    arena->strings = NULL;
+
+    return arena;
+}
+
+
+void *arena_alloc(struct arena *arena, size_t size) {
+    struct arena_block *block;
+    size_t block_size;
+
+    // keep everything 8-byte aligned
+    size = (size + 7) & ~((size_t)7);
+
+    block = arena->blocks;
+    if (block == NULL || block->used + size > block->size) {
+        block_size = MAX(size, ARENABLOCKSIZE);
+        block = (struct arena_block *)safe_malloc(sizeof(struct arena_block) + block_size);
+        block->size = block_size;
+        block->used = 0;
+
+        // oversized allocations get their own block, so the current one keeps being used
+        if (size > ARENABLOCKSIZE && arena->blocks != NULL) {
+            block->next = arena->blocks->next;
+            arena->blocks->next = block;
+        } else {
+            block->next = arena->blocks;
+            arena->blocks = block;
+        }
+    }
+
+    block->used += size;
+
+    return (char *)(block + 1) + block->used - size;
+}
+
+
+char *arena_strndup(struct arena *arena, const char *s, size_t n) {
+    char *result;
+
+    result = (char *)arena_alloc(arena, n + 1);
+    memcpy(result, s, n);
+    result[n] = 0;
+
+    return result;
+}
+
+
+char *arena_intern(struct arena *arena, char *s) {
+    /*
+     * Returns a copy of the string in the arena, reusing the existing copy
+     * if the same string was interned before.
+     */
+
+    char **old_strings;
+    uint32_t old_size;
+    uint32_t i;
+    uint32_t j;
+
+    if ((arena->num_strings + 1) * 4 > arena->size_strings * 3) {
+        old_strings = arena->strings;
+        old_size = arena->size_strings;
+
+        arena->size_strings = (old_size == 0) ? 1024 : old_size * 2;
+        arena->strings = (char **)safe_malloc(sizeof(char *) * arena->size_strings);
+        for (i = 0; i < arena->size_strings; i++)
+            arena->strings[i] = NULL;
+
+        for (i = 0; i < old_size; i++) {
+            if (old_strings[i] == NULL)
+                continue;
+
+            j = hash_string(old_strings[i], strlen(old_strings[i])) & (arena->size_strings - 1);
+            while (arena->strings[j] != NULL)
+                j = (j + 1) & (arena->size_strings - 1);
+            arena->strings[j] = old_strings[i];
+        }
+        free(old_strings);
+    }
+
+    i = hash_string(s, strlen(s)) & (arena->size_strings - 1);
+    while (arena->strings[i] != NULL) {
+        if (strcmp(arena->strings[i], s) == 0)
+            return arena->strings[i];
+        i = (i + 1) & (arena->size_strings - 1);
+    }
+
+    arena->strings[i] = arena_strndup(arena, s, strlen(s));
+    arena->num_strings++;
+
+    return arena->strings[i];
+}
+
+
+void arena_free(struct arena *arena) {
+    struct arena_block *block;
+    struct arena_block *next;
+
+    for (block = arena->blocks; block != NULL; block = next) {
+        next = block->next;
+        free(block);
+    }
+
+    free(arena->strings);
+    free(arena);
+}
+
+
+void membuffer_init(struct membuffer *buffer) {
+    /*
+     * Initializes an empty, growable memory buffer. The data is always
+     * followed by two NUL bytes, so it can be used as a string or handed to
+     * the lexer directly.
+     */
+
+    buffer->size = MEMBUFFERINTERVAL;
+    buffer->length = 0;
+    buffer->data = (char *)safe_malloc(buffer->size);
+    buffer->data[0] = 0;
+    buffer->data[1] = 0;
+}
+
+
+void membuffer_reserve(struct membuffer *buffer, size_t size) {
+    /*
+     * Makes sure that another size bytes fit into the buffer.
+     */
+
+    if (buffer->length + size + 2 <= buffer->size)
+        return;
+
+    while (buffer->length + size + 2 > buffer->size)
+        buffer->size *= 2;
+
+    buffer->data = (char *)safe_realloc(buffer->data, buffer->size);
+}
+
+
+void membuffer_write(struct membuffer *buffer, const void *data, size_t size) {
+    membuffer_reserve(buffer, size);
+
+    memcpy(buffer->data + buffer->length, data, size);
+    buffer->length += size;
+
+    buffer->data[buffer->length] = 0;
+    buffer->data[buffer->length + 1] = 0;
+}
+
+
+void membuffer_putc(struct membuffer *buffer, char c) {
+    membuffer_reserve(buffer, 1);
+
+    buffer->data[buffer->length++] = c;
+
+    buffer->data[buffer->length] = 0;
+    buffer->data[buffer->length + 1] = 0;
+}
+
+
+void membuffer_put_u32(struct membuffer *buffer, uint32_t value) {
+    membuffer_write(buffer, &value, sizeof(uint32_t));
+}
+
+
+void membuffer_put_f32(struct membuffer *buffer, float value) {
+    membuffer_write(buffer, &value, sizeof(float));
+}
+
+
+void membuffer_put_array(struct membuffer *buffer, const void *data, size_t size, size_t count) {
+    // size is the element size, like fwrite
+    membuffer_write(buffer, data, size * count);
+}
+
+
+void membuffer_free(struct membuffer *buffer) {
+    free(buffer->data);
+    buffer->data = NULL;
+    buffer->length = 0;
+    buffer->size = 0;
+}
+
+
 int get_line_number(FILE *f_source) {
     int line;
     long fp_start;
@@ -349,6 +583,38 @@ bool float_equal(float f1, float f2, float precision) {
 }
 
 
+uint32_t hash_string(char *string, size_t len) {
+    /*
+     * Computes the 32-bit FNV-1a hash of the first len bytes of the given
+     * string.
+     */
+
+    uint32_t hash = 2166136261u;
+    size_t i;
+
+    for (i = 0; i < len; i++) {
+        hash ^= (unsigned char)string[i];
+        hash *= 16777619u;
+    }
+
+    return hash;
+}
+
+
+double get_time() {
+    /*
+     * Returns the wall clock time in seconds, for timing things in verbose
+     * output.
+     */
+
+    struct timeval tv;
+
+    gettimeofday(&tv, NULL);
+
+    return tv.tv_sec + tv.tv_usec / 1000000.0;
+}
+
+
 int fsign(float f) {
     return (0 < f) - (f < 0);
 }
@@ -618,26 +884,26 @@ void unescape_string(char *buffer, size_t buffsize) {
 }
 
 
-void write_compressed_int(uint32_t integer, FILE *f) {
+void write_compressed_int(uint32_t integer, struct membuffer *buffer) {
     uint64_t temp;
     char c;
 
     temp = (uint64_t)integer;
 
     if (temp == 0) {
-        fwrite(&temp, 1, 1, f);
+        membuffer_putc(buffer, 0);
     }
 
     while (temp > 0) {
         if (temp > 0x7f) {
             // there are going to be more entries
             c = 0x80 | (temp & 0x7f);
-            fwrite(&c, 1, 1, f);
+            membuffer_putc(buffer, c);
             temp = temp >> 7;
         } else {
             // last entry
             c = temp;
-            fwrite(&c, 1, 1, f);
+            membuffer_putc(buffer, c);
             temp = 0;
         }
     }
@@ -44,6 +44,9 @@
 #define OP_DERAPIFY 8
 #define OP_IMAGE 9
 
+#define ARENABLOCKSIZE (64 * 1024)
+#define MEMBUFFERINTERVAL (64 * 1024)
+
 
 struct point {
     float x;
@@ -52,7 +55,26 @@ struct point {
     uint32_t point_flags;
 };
 
-char *current_target;
+struct arena_block {
+    struct arena_block *next;
+    size_t size;
+    size_t used;
+};
+
+struct arena {
+    struct arena_block *blocks;
+    uint32_t num_strings;
+    uint32_t size_strings;
+    char **strings;
+};
+
+struct membuffer {
+    char *data;
+    size_t length;
+    size_t size;
+};
+
+extern __thread char *current_target;
 
 
 #ifdef _WIN32
@@ -63,6 +85,9 @@ char *strchrnul(const char *s, int c);
 int stricmp(char *a, char *b);
 #endif
 
+void lock_output();
+void unlock_output();
+
 void infof(char *format, ...);
 
 void debugf(char *format, ...);
@@ -83,6 +108,21 @@ void *safe_realloc(void *ptr, size_t size);
 char *safe_strdup(const char *s);
 char *safe_strndup(const char *s, size_t n);
 
+struct arena *arena_init();
+void *arena_alloc(struct arena *arena, size_t size);
+char *arena_strndup(struct arena *arena, const char *s, size_t n);
+char *arena_intern(struct arena *arena, char *s);
+void arena_free(struct arena *arena);
+
+void membuffer_init(struct membuffer *buffer);
+void membuffer_reserve(struct membuffer *buffer, size_t size);
+void membuffer_write(struct membuffer *buffer, const void *data, size_t size);
+void membuffer_putc(struct membuffer *buffer, char c);
+void membuffer_put_u32(struct membuffer *buffer, uint32_t value);
+void membuffer_put_f32(struct membuffer *buffer, float value);
+void membuffer_put_array(struct membuffer *buffer, const void *data, size_t size, size_t count);
+void membuffer_free(struct membuffer *buffer);
+
 int get_line_number(FILE *f_source);
 
 void reverse_endianness(void *ptr, size_t buffsize);
@@ -91,6 +131,10 @@ bool matches_glob(char *string, char *pattern);
 
 bool float_equal(float f1, float f2, float precision);
 
+uint32_t hash_string(char *string, size_t len);
+
+double get_time();
+
 int fsign(float f);
 
 void lower_case(char *string);
@@ -115,6 +159,6 @@ void escape_string(char *buffer, size_t buffsize);
 
 void unescape_string(char *buffer, size_t buffsize);
 
-void write_compressed_int(uint32_t integer, FILE *f);
+void write_compressed_int(uint32_t integer, struct membuffer *buffer);
 
 uint32_t read_compressed_int(FILE *f);
@@ -0,0 +1,64 @@
+#!/bin/bash
+# Binarization cache
+
+mkdir -p /tmp/amktest/addon || exit 1
+mkdir -p /tmp/amktest/unpacked
+
+fail() {
+    rm -rf /tmp/amktest
+    exit 1
+}
+
+echo '#include "value.hpp"' > /tmp/amktest/addon/config.cpp
+echo 'class CfgTest { value = VALUE; };' >> /tmp/amktest/addon/config.cpp
+echo '#define VALUE 1' > /tmp/amktest/addon/value.hpp
+
+# without --cache-dir, nothing is cached
+./bin/armake build -f /tmp/amktest/addon /tmp/amktest/uncached.pbo > /tmp/amktest/log 2>&1 || fail
+grep -q "Binarization cache" /tmp/amktest/log && fail
+[ -e /tmp/amktest/cache ] && fail
+
+# first run fills the cache
+./bin/armake build -f --cache-dir /tmp/amktest/cache /tmp/amktest/addon /tmp/amktest/addon.pbo > /tmp/amktest/log 2>&1 || fail
+grep -q "0 hits, 1 misses" /tmp/amktest/log || fail
+cmp --silent /tmp/amktest/uncached.pbo /tmp/amktest/addon.pbo || fail
+
+# unchanged files are taken from the cache
+./bin/armake build -f --cache-dir /tmp/amktest/cache /tmp/amktest/addon /tmp/amktest/addon.pbo > /tmp/amktest/log 2>&1 || fail
+grep -q "1 hits, 0 misses" /tmp/amktest/log || fail
+cmp --silent /tmp/amktest/uncached.pbo /tmp/amktest/addon.pbo || fail
+
+# changing an include rebuilds the config
+echo '#define VALUE 2' > /tmp/amktest/addon/value.hpp
+./bin/armake build -f --cache-dir /tmp/amktest/cache /tmp/amktest/addon /tmp/amktest/addon.pbo > /tmp/amktest/log 2>&1 || fail
+grep -q "0 hits, 1 misses" /tmp/amktest/log || fail
+./bin/armake unpack -f /tmp/amktest/addon.pbo /tmp/amktest/unpacked || fail
+./bin/armake derapify -f /tmp/amktest/unpacked/config.bin /tmp/amktest/config.cpp || fail
+grep -q "value = 2;" /tmp/amktest/config.cpp || fail
+
+# changing a material used by a model rebuilds the model, even if the LODs are converted in parallel
+mkdir -p /tmp/amktest/model
+echo 'x\amktest\addon' > '/tmp/amktest/model/$PBOPREFIX$'
+cp test/cache/model.p3d /tmp/amktest/model/model.p3d
+echo 'specularPower = 10;' > /tmp/amktest/model/test.rvmat
+./bin/armake binarize -f -j 4 -i /tmp/amktest --cache-dir /tmp/amktest/cache /tmp/amktest/model/model.p3d /tmp/amktest/before.p3d || fail
+echo 'specularPower = 20;' > /tmp/amktest/model/test.rvmat
+./bin/armake binarize -f -j 4 -i /tmp/amktest /tmp/amktest/model/model.p3d /tmp/amktest/uncached.p3d || fail
+./bin/armake binarize -f -j 4 -i /tmp/amktest --cache-dir /tmp/amktest/cache /tmp/amktest/model/model.p3d /tmp/amktest/after.p3d || fail
+cmp --silent /tmp/amktest/before.p3d /tmp/amktest/after.p3d && fail
+cmp --silent /tmp/amktest/uncached.p3d /tmp/amktest/after.p3d || fail
+
+# identical configs in different folders don't share cache entries
+mkdir -p /tmp/amktest/first /tmp/amktest/second
+echo '#define VALUE 1' > /tmp/amktest/first/value.hpp
+echo '#define VALUE 2' > /tmp/amktest/second/value.hpp
+echo '#include "value.hpp"' > /tmp/amktest/first/config.cpp
+echo 'class CfgTest { value = VALUE; };' >> /tmp/amktest/first/config.cpp
+cp /tmp/amktest/first/config.cpp /tmp/amktest/second/config.cpp
+./bin/armake binarize -f --cache-dir /tmp/amktest/cache /tmp/amktest/first/config.cpp /tmp/amktest/first.bin || fail
+./bin/armake binarize -f --cache-dir /tmp/amktest/cache /tmp/amktest/second/config.cpp /tmp/amktest/second.bin || fail
+cmp --silent /tmp/amktest/first.bin /tmp/amktest/second.bin && fail
+./bin/armake derapify -f /tmp/amktest/second.bin /tmp/amktest/second.cpp || fail
+grep -q "value = 2;" /tmp/amktest/second.cpp || fail
+
+rm -rf /tmp/amktest
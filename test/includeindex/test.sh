@@ -0,0 +1,35 @@
+#!/bin/bash
+# Include index cache
+
+mkdir -p /tmp/amktest/include/lib || exit 1
+
+fail() {
+    rm -rf /tmp/amktest
+    exit 1
+}
+
+echo 'x\amktest\lib' > '/tmp/amktest/include/lib/$PBOPREFIX$'
+echo '#define VALUE 1' > /tmp/amktest/include/lib/value.hpp
+echo '#include "\x\amktest\lib\value.hpp"' > /tmp/amktest/config.cpp
+echo 'class CfgTest { value = VALUE; };' >> /tmp/amktest/config.cpp
+
+./bin/armake binarize -f -i /tmp/amktest/include /tmp/amktest/config.cpp /tmp/amktest/reference.bin || fail
+
+# the first run writes the index
+./bin/armake binarize -f -i /tmp/amktest/include --indexcache /tmp/amktest/index /tmp/amktest/config.cpp /tmp/amktest/config.bin || fail
+head -n 1 /tmp/amktest/index | grep -q "armake include index" || fail
+grep -q "value.hpp" /tmp/amktest/index || fail
+cmp --silent /tmp/amktest/reference.bin /tmp/amktest/config.bin || fail
+
+# the second run uses it
+./bin/armake binarize -f -i /tmp/amktest/include --indexcache /tmp/amktest/index /tmp/amktest/config.cpp /tmp/amktest/config.bin || fail
+cmp --silent /tmp/amktest/reference.bin /tmp/amktest/config.bin || fail
+
+# files added since the index was saved are still found
+echo '#define OTHER 2' > /tmp/amktest/include/lib/other.hpp
+echo '#include "\x\amktest\lib\other.hpp"' > /tmp/amktest/other.cpp
+echo 'class CfgTest { value = OTHER; };' >> /tmp/amktest/other.cpp
+./bin/armake binarize -f -i /tmp/amktest/include --indexcache /tmp/amktest/index /tmp/amktest/other.cpp /tmp/amktest/other.bin || fail
+grep -q "other.hpp" /tmp/amktest/index || fail
+
+rm -rf /tmp/amktest
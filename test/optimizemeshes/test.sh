@@ -0,0 +1,28 @@
+#!/bin/bash
+# Mesh optimization
+
+mkdir -p /tmp/amktest/model || exit 1
+
+fail() {
+    rm -rf /tmp/amktest
+    exit 1
+}
+
+echo 'x\amktest\addon' > '/tmp/amktest/model/$PBOPREFIX$'
+cp test/cache/model.p3d /tmp/amktest/model/model.p3d
+echo 'specularPower = 10;' > /tmp/amktest/model/test.rvmat
+
+./bin/armake binarize -f -i /tmp/amktest /tmp/amktest/model/model.p3d /tmp/amktest/plain.p3d || fail
+./bin/armake binarize -f -i /tmp/amktest --optimize-meshes /tmp/amktest/model/model.p3d /tmp/amktest/optimized.p3d || fail
+
+# reordering faces and vertices changes neither the header, the number of LODs nor the size
+cmp --silent -n 12 /tmp/amktest/plain.p3d /tmp/amktest/optimized.p3d || fail
+head -c 4 /tmp/amktest/optimized.p3d | grep -q "ODOL" || fail
+[[ $(wc -c < /tmp/amktest/optimized.p3d) -eq $(wc -c < /tmp/amktest/plain.p3d) ]] || fail
+cmp --silent /tmp/amktest/plain.p3d /tmp/amktest/optimized.p3d && fail
+
+# the result is deterministic, also when LODs are optimized in parallel
+./bin/armake binarize -f -j 4 -i /tmp/amktest --optimize-meshes /tmp/amktest/model/model.p3d /tmp/amktest/parallel.p3d || fail
+cmp --silent /tmp/amktest/optimized.p3d /tmp/amktest/parallel.p3d || fail
+
+rm -rf /tmp/amktest
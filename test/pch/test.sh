@@ -0,0 +1,46 @@
+#!/bin/bash
+# Precompiled headers
+
+mkdir -p /tmp/amktest/include/lib || exit 1
+
+fail() {
+    rm -rf /tmp/amktest
+    exit 1
+}
+
+echo 'x\amktest\lib' > '/tmp/amktest/include/lib/$PBOPREFIX$'
+cat > /tmp/amktest/include/lib/macros.hpp <<'HPP'
+#ifndef MACROS_HPP
+#define MACROS_HPP
+#define VALUE 1
+#define TWICE(x) x##x
+#define QUOTE(x) #x
+#endif
+HPP
+echo '#include "\x\amktest\lib\macros.hpp"' > /tmp/amktest/config.cpp
+echo 'class CfgTest { value = VALUE; twice = TWICE(VALUE); name = QUOTE(VALUE); };' >> /tmp/amktest/config.cpp
+echo 'class CfgTest { value = 1; };' > /tmp/amktest/other.cpp
+
+./bin/armake binarize -f -i /tmp/amktest/include /tmp/amktest/config.cpp /tmp/amktest/reference.bin || fail
+
+# the snapshot is found no matter how the header was passed to armake pch
+for header in '\x\amktest\lib\macros.hpp' /tmp/amktest/include/lib/./macros.hpp; do
+    ./bin/armake pch -f -i /tmp/amktest/include "$header" /tmp/amktest/macros.pch || fail
+    ./bin/armake binarize -f -i /tmp/amktest/include --pch /tmp/amktest/macros.pch --verbose \
+        /tmp/amktest/config.cpp /tmp/amktest/config.bin > /tmp/amktest/output || fail
+    grep -q "never used" /tmp/amktest/output && fail
+    cmp --silent /tmp/amktest/reference.bin /tmp/amktest/config.bin || fail
+done
+
+# unused snapshots are pointed out
+./bin/armake binarize -f -i /tmp/amktest/include --pch /tmp/amktest/macros.pch --verbose \
+    /tmp/amktest/other.cpp /tmp/amktest/other.bin > /tmp/amktest/output || fail
+grep -q "never used" /tmp/amktest/output || fail
+
+# snapshots referring to arguments the macro doesn't have are rejected
+printf '\005\000\000\000' | dd of=/tmp/amktest/macros.pch bs=1 seek=$(($(wc -c < /tmp/amktest/macros.pch) - 8)) conv=notrunc 2> /dev/null
+./bin/armake binarize -f -i /tmp/amktest/include --pch /tmp/amktest/macros.pch \
+    /tmp/amktest/config.cpp /tmp/amktest/config.bin > /tmp/amktest/output 2>&1 && fail
+grep -q "Invalid precompiled header" /tmp/amktest/output || fail
+
+rm -rf /tmp/amktest